@@ -96,7 +96,7 @@ static http_entity_t *http_root_entity = (http_entity_t[]){{
 				}},				
 				.next = (http_entity_t[]) {{
 				.name = "series",
-				/* FIXME: Need links to individual series (get_handler) */
+				.get_handler = http_tsdb_get_multi_series,
 				
 				.child = (http_entity_t[]) {{
 					.name = "*", /* metric id */
@@ -113,6 +113,9 @@ static http_entity_t *http_root_entity = (http_entity_t[]){{
 				}},
 			}},
 		}},
+		.next = (http_entity_t[]) {{
+		.name = "stats",
+		.get_handler = http_tsdb_get_stats,
 #if 0
 		.next = (http_entity_t[]) {{
 		.name = "test",
@@ -120,6 +123,7 @@ static http_entity_t *http_root_entity = (http_entity_t[]){{
 		.get_handler = http_get_file,
 		}},
 #endif
+		}},
 	}},
 }};
 
@@ -44,6 +44,9 @@
 /*! Maximum length of output buffer for Location and Content-type headers */
 #define MAX_HEADER_STRING	128
 
+/*! Number of rows to accumulate before writing them to the database as a block */
+#define CSV_BATCH_ROWS		1024
+
 HTTP_HANDLER(http_csv_get_values)
 {
 	return MHD_HTTP_NOT_FOUND;
@@ -55,9 +58,9 @@ HTTP_HANDLER(http_csv_post_values)
 	uint64_t node_id;
 	char *start_ptr, *end_ptr, *eof_ptr = &req_data[req_data_size];
 	char c;
-	int rc, nmetrics, nrows = 0;
-	int64_t timestamp;
-	tsdb_data_t values[TSDB_MAX_METRICS];
+	int rc, nmetrics, nrows = 0, nbatch = 0;
+	int64_t *timestamps = NULL;
+	tsdb_data_t *values, *batch_values = NULL;
 	unsigned short status = MHD_HTTP_OK;
 	tsdb_key_t key;
 	
@@ -88,6 +91,16 @@ HTTP_HANDLER(http_csv_post_values)
 		}
 	}
 	
+	/* Rows are decoded into a block and written to the database together */
+	timestamps = (int64_t*)malloc(sizeof(int64_t) * CSV_BATCH_ROWS);
+	batch_values = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * db->meta->nmetrics * CSV_BATCH_ROWS);
+	if (timestamps == NULL || batch_values == NULL) {
+		CRITICAL("Out of memory\n");
+		status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	values = batch_values;
+	
 	/* Decode rows (we can modify the request data since it has already been copied) */
 	start_ptr = req_data;
 	nmetrics = -1;
@@ -95,17 +108,17 @@ HTTP_HANDLER(http_csv_post_values)
 		c = *end_ptr;
 		if (c == ',' || c == '\r' || c == '\n') {
 			*end_ptr = '\0';
-			if (nmetrics == TSDB_MAX_METRICS) {
-				ERROR("Too many metrics\n");
+			if (nmetrics == (int)db->meta->nmetrics) {
+				ERROR("Too many metrics on row %d\n", nrows);
 				status = MHD_HTTP_BAD_REQUEST;
-				goto done;
+				goto partial;
 			}
 			if (nmetrics == -1) {
 				/* Decode timestamp */
-				if (sscanf(start_ptr, "%" SCNi64, &timestamp) != 1) {
+				if (sscanf(start_ptr, "%" SCNi64, &timestamps[nbatch]) != 1) {
 					ERROR("Couldn't decode timestamp on row %d\n", nrows);
 					status = MHD_HTTP_BAD_REQUEST;
-					goto done;
+					goto partial;
 				}
 			} else {
 				/* Decode value */
@@ -119,18 +132,23 @@ HTTP_HANDLER(http_csv_post_values)
 				if (nmetrics != db->meta->nmetrics) {
 					ERROR("Invalid number of metrics on row %d\n", nrows);
 					status = MHD_HTTP_BAD_REQUEST;
-					goto done;
+					goto partial;
 				}
 
-				/* Valid row - write to database */
-				if ((rc = tsdb_update_values(db, &timestamp, values)) < 0) {
-					/* -ENOENT returned if timestamp is before the start of the database */
-					ERROR("Update failed\n");
-					status = (rc == -ENOENT) ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_INTERNAL_SERVER_ERROR;
-					goto done;
+				/* Valid row - add to block and write to database when full */
+				values += nmetrics;
+				nrows++;
+				if (++nbatch == CSV_BATCH_ROWS) {
+					if ((rc = tsdb_update_values_batch(db, timestamps, batch_values, nbatch)) < 0) {
+						/* -ENOENT returned if timestamp is before the start of the database */
+						ERROR("Update failed\n");
+						status = (rc == -ENOENT) ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_INTERNAL_SERVER_ERROR;
+						goto done;
+					}
+					nbatch = 0;
+					values = batch_values;
 				}
 				nmetrics = -1;
-				nrows++;
 
 				/* Skip blank lines or second part of CR/LF pair */
 				while (end_ptr[1] == '\r' || end_ptr[1] == '\n')
@@ -139,8 +157,23 @@ HTTP_HANDLER(http_csv_post_values)
 			start_ptr = end_ptr + 1;
 		}
 	}
+	
+	/* Write final partial block */
+	if ((rc = tsdb_update_values_batch(db, timestamps, batch_values, nbatch)) < 0) {
+		ERROR("Update failed\n");
+		status = (rc == -ENOENT) ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
 	INFO("Imported %d rows to node %016" PRIx64 "\n", nrows, node_id);
+	goto done;
+partial:
+	/* Keep the rows before a bad one, as they would have been if written one at a time */
+	if (nbatch && tsdb_update_values_batch(db, timestamps, batch_values, nbatch) < 0)
+		ERROR("Update failed\n");
+	INFO("Imported %d rows to node %016" PRIx64 " before a bad row\n", nrows, node_id);
 done:
+	free(timestamps);
+	free(batch_values);
 	tsdb_close(db);
 	return status;
 }
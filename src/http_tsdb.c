@@ -25,12 +25,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <inttypes.h>
 #include <time.h>
 #include <math.h>
 
 #include "tsdb.h"
+#include "tsdb_pack.h"
 #include "cJSON/cJSON.h"
 
 #include "http.h"
@@ -216,9 +218,36 @@ static int put_node_decimation_parser(cJSON *json, unsigned int *decimation)
 	return 0;	
 }
 
+static int put_node_layer_values_parser(cJSON *json, const char *name, uint64_t *values)
+{
+	int nlayers = 0;
+	cJSON *subitem = json->child;
+	
+	FUNCTION_TRACE;
+	
+	for ( ; subitem; subitem = subitem->next) {
+		if (nlayers == TSDB_MAX_LAYERS) {
+			ERROR("Maximum number of layers exceeded\n");
+			return -EINVAL;
+		}
+		if (subitem->type != cJSON_Number) {
+			ERROR("%s values must be numeric\n", name);
+			return -EINVAL;
+		}
+		if (subitem->valuedouble < 0) {
+			ERROR("%s values must be positive\n", name);
+			return -EINVAL;
+		}
+		values[nlayers++] = (uint64_t)subitem->valuedouble;
+		DEBUG("layer %u %s %" PRIu64 "\n", nlayers - 1, name, values[nlayers - 1]);
+	}
+	return 0;
+}
+
 static int put_node_data_parser(cJSON *json, unsigned int *interval,
 	unsigned int *nmetrics, tsdb_pad_mode_t *pad_mode, tsdb_downsample_mode_t *ds_mode,
-	unsigned int *decimation)
+	unsigned int *decimation, tsdb_layout_t *layout, tsdb_compression_t *compression,
+	unsigned int *segment_points, uint64_t *capacity, uint64_t *retention, int *packed)
 {
 	cJSON *subitem = json->child;
 	
@@ -247,6 +276,60 @@ static int put_node_data_parser(cJSON *json, unsigned int *interval,
 			if (put_node_metrics_parser(subitem, nmetrics, pad_mode, ds_mode) < 0) {
 				return -EINVAL;
 			}
+		} else if (strcmp(subitem->string, "layout") == 0) {
+			if (subitem->type != cJSON_String) {
+				ERROR("layout must be a string\n");
+				return -EINVAL;
+			}
+			if (strcmp(subitem->valuestring, "row") == 0) {
+				*layout = tsdbLayout_Row;
+			} else if (strcmp(subitem->valuestring, "columnar") == 0) {
+				*layout = tsdbLayout_Columnar;
+			} else {
+				ERROR("layout must be \"row\" or \"columnar\"\n");
+				return -EINVAL;
+			}
+			DEBUG("layout = %d\n", *layout);
+		} else if (strcmp(subitem->string, "compression") == 0) {
+			if (subitem->type != cJSON_String) {
+				ERROR("compression must be a string\n");
+				return -EINVAL;
+			}
+			if (strcmp(subitem->valuestring, "none") == 0) {
+				*compression = tsdbCompression_None;
+			} else if (strcmp(subitem->valuestring, "gorilla") == 0) {
+				*compression = tsdbCompression_Gorilla;
+			} else {
+				ERROR("compression must be \"none\" or \"gorilla\"\n");
+				return -EINVAL;
+			}
+			DEBUG("compression = %d\n", *compression);
+		} else if (strcmp(subitem->string, "segment_points") == 0) {
+			if (subitem->type != cJSON_Number) {
+				ERROR("segment_points must be numeric\n");
+				return -EINVAL;
+			}
+			if (subitem->valueint < 0) {
+				ERROR("segment_points must be positive\n");
+				return -EINVAL;
+			}
+			*segment_points = (unsigned int)subitem->valueint;
+			DEBUG("segment_points = %u\n", *segment_points);
+		} else if (strcmp(subitem->string, "capacity") == 0) {
+			if (put_node_layer_values_parser(subitem, "capacity", capacity) < 0) {
+				return -EINVAL;
+			}
+		} else if (strcmp(subitem->string, "retention") == 0) {
+			if (put_node_layer_values_parser(subitem, "retention", retention) < 0) {
+				return -EINVAL;
+			}
+		} else if (strcmp(subitem->string, "packed") == 0) {
+			if (subitem->type != cJSON_True && subitem->type != cJSON_False) {
+				ERROR("packed must be a boolean\n");
+				return -EINVAL;
+			}
+			*packed = (subitem->type == cJSON_True);
+			DEBUG("packed = %d\n", *packed);
 		}
 	}
 	return 0;
@@ -283,10 +366,53 @@ HTTP_HANDLER(http_tsdb_get_nodes)
 	return MHD_HTTP_NOT_FOUND;
 }
 
+HTTP_HANDLER(http_tsdb_get_stats)
+{
+	tsdb_page_stats_t stats;
+	tsdb_pack_stats_t pack_stats;
+	cJSON *json, *hits, *misses;
+	int layer;
+	
+	FUNCTION_TRACE;
+	
+	/* Check access - statistics cover every node, so need the admin key */
+	if (http_check_signature(conn, (unsigned char*)&g_admin_key, sizeof(g_admin_key),
+			"GET", url, req_data, req_data_size)) {
+		/* Bad signature */
+		return MHD_HTTP_FORBIDDEN;
+	}
+	
+	/* Page cache hits and misses of the table files of each layer */
+	tsdb_get_page_stats(&stats);
+	json = cJSON_CreateObject();
+	cJSON_AddNumberToObject(json, "page_size", (double)sysconf(_SC_PAGESIZE));
+	hits = cJSON_CreateArray();
+	misses = cJSON_CreateArray();
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		cJSON_AddItemToArray(hits, cJSON_CreateNumber((double)stats.hits[layer]));
+		cJSON_AddItemToArray(misses, cJSON_CreateNumber((double)stats.misses[layer]));
+	}
+	cJSON_AddItemToObject(json, "hits", hits);
+	cJSON_AddItemToObject(json, "misses", misses);
+	
+	/* Space taken by the containers of packed nodes, and how much of it is free for reuse */
+	tsdb_pack_get_stats(&pack_stats);
+	cJSON_AddNumberToObject(json, "pack_size", (double)pack_stats.size);
+	cJSON_AddNumberToObject(json, "pack_free", (double)pack_stats.free);
+	
+	/* Pass response back to handler and set content type */
+	*resp_data = cJSON_Print(json);
+	cJSON_Delete(json);
+	DEBUG("JSON: %s\n", *resp_data);
+	*resp_data_size = strlen(*resp_data);
+	*content_type = strdup(CONTENT_TYPE);
+	return MHD_HTTP_OK;
+}
+
 HTTP_HANDLER(http_tsdb_get_node)
 {
 	tsdb_ctx_t *db;
-	cJSON *json, *metrics, *metric;
+	cJSON *json, *metrics, *metric, *capacity, *retention;
 	uint64_t node_id;
 	int n, nlayers;
 	tsdb_key_t key;
@@ -329,6 +455,20 @@ HTTP_HANDLER(http_tsdb_get_node)
 			break;
 	}
 	cJSON_AddItemToObject(json, "decimation", cJSON_CreateIntArray((int*)db->meta->decimation, nlayers));
+	cJSON_AddStringToObject(json, "layout", (db->meta->layout == tsdbLayout_Columnar) ? "columnar" : "row");
+	cJSON_AddStringToObject(json, "compression", (db->meta->compression == tsdbCompression_Gorilla) ? "gorilla" : "none");
+	cJSON_AddNumberToObject(json, "segment_points", db->meta->segment_points);
+	cJSON_AddItemToObject(json, "packed", (db->pack != NULL) ? cJSON_CreateTrue() : cJSON_CreateFalse());
+	capacity = cJSON_CreateArray();
+	for (n = 0; n <= nlayers && n < TSDB_MAX_LAYERS; n++) {
+		cJSON_AddItemToArray(capacity, cJSON_CreateNumber((double)db->meta->capacity[n]));
+	}
+	cJSON_AddItemToObject(json, "capacity", capacity);
+	retention = cJSON_CreateArray();
+	for (n = 0; n <= nlayers && n < TSDB_MAX_LAYERS; n++) {
+		cJSON_AddItemToArray(retention, cJSON_CreateNumber((double)db->meta->retention[n]));
+	}
+	cJSON_AddItemToObject(json, "retention", retention);
 	metrics = cJSON_CreateArray();
 	for (n = 0; n < db->meta->nmetrics; n++) {
 		metric = cJSON_CreateObject();
@@ -356,6 +496,12 @@ HTTP_HANDLER(http_tsdb_create_node)
 	unsigned int decimation[TSDB_MAX_LAYERS] = {0};
 	tsdb_pad_mode_t pad_mode[TSDB_MAX_METRICS];
 	tsdb_downsample_mode_t ds_mode[TSDB_MAX_METRICS];
+	tsdb_layout_t layout = tsdbLayout_Row;
+	tsdb_compression_t compression = tsdbCompression_None;
+	unsigned int segment_points = 0;
+	uint64_t capacity[TSDB_MAX_LAYERS] = {0};
+	uint64_t retention[TSDB_MAX_LAYERS] = {0};
+	int packed = 0;
 	cJSON *json;
 	int rc;
 	
@@ -377,7 +523,8 @@ HTTP_HANDLER(http_tsdb_create_node)
 	
 	/* Parse payload - returns 400 Bad Request on syntax error */
 	json = cJSON_Parse(req_data);
-	if (!json || (rc = put_node_data_parser(json, &interval, &nmetrics, pad_mode, ds_mode, decimation))) {
+	if (!json || (rc = put_node_data_parser(json, &interval, &nmetrics, pad_mode, ds_mode, decimation, &layout, &compression,
+			&segment_points, capacity, retention, &packed))) {
 		ERROR("JSON error: %d\n", rc);
 		return (rc == -EACCES) ? MHD_HTTP_FORBIDDEN : MHD_HTTP_BAD_REQUEST;
 	}
@@ -390,7 +537,12 @@ HTTP_HANDLER(http_tsdb_create_node)
 	}
 	
 	/* Create the TSDB */
-	if (tsdb_create(node_id, interval, nmetrics, pad_mode, ds_mode, decimation) < 0) {
+	if ((rc = tsdb_create(node_id, interval, nmetrics, pad_mode, ds_mode, decimation, layout, compression,
+			segment_points, capacity, retention, packed)) < 0) {
+		if (rc == -EINVAL) {
+			ERROR("Invalid combination of node options\n");
+			return MHD_HTTP_BAD_REQUEST;
+		}
 		ERROR("Error creating new database (probably exists)\n");
 		return MHD_HTTP_FORBIDDEN;
 	}
@@ -819,13 +971,96 @@ HTTP_HANDLER(http_tsdb_get_values)
 // FIXME: Do this more intelligently
 #define BUF_SIZE	(1024 * 1024)
 
+/* Parses the interpolate query parameter.  Returns the tsdb_get_series flag or a negative
+ * error code. */
+static int get_series_interpolate_parser(const char *param)
+{
+	if (param == NULL || strcmp(param, "none") == 0)
+		return 0;
+	if (strcmp(param, "linear") == 0)
+		return TSDB_SERIES_LINEAR;
+	if (strcmp(param, "step") == 0)
+		return TSDB_SERIES_STEP;
+	ERROR("interpolate must be none, linear or step\n");
+	return -EINVAL;
+}
+
+/* Encodes the envelope of one or more series as a 2D array.  Each row has the timestamp
+ * followed by min, max, mean and count, nested in an array for each metric if there may be
+ * more than one (null where a metric has no data).  Returns an HTTP status code. */
+static unsigned short get_series_envelope(tsdb_ctx_t *db, const unsigned int *metric_ids,
+	unsigned int nseries, int nested, int64_t start, int64_t end, unsigned int npoints, int flags,
+	char **resp_data, size_t *resp_data_size)
+{
+	int64_t *timestamps = NULL;
+	tsdb_envelope_t *envelopes = NULL, *envptr;
+	char *outbuf, *bufptr;
+	size_t bufsize;
+	unsigned int n, s;
+	int actual_npoints;
+	unsigned short rc;
+	
+	FUNCTION_TRACE;
+	
+	timestamps = (int64_t*)malloc(sizeof(int64_t) * npoints);
+	envelopes = (tsdb_envelope_t*)malloc(sizeof(tsdb_envelope_t) * npoints * nseries);
+	if ((timestamps == NULL || envelopes == NULL) && npoints) {
+		CRITICAL("Out of memory\n");
+		rc = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	
+	if ((actual_npoints = tsdb_get_series_envelope(db, metric_ids, nseries, start, end, npoints, flags,
+			timestamps, envelopes)) < 0) {
+		/* Will fail with -ENOENT if a metric ID is invalid - 404 */
+		ERROR("Fetch failed\n");
+		rc = (actual_npoints == -ENOENT) ? MHD_HTTP_NOT_FOUND : MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	
+	/* The buffer is sized for the longest representation of each value */
+	bufsize = 3 + (size_t)actual_npoints * (32 + nseries * (sizeof(tsdb_data_t) == sizeof(float) ? 180 : 1000));
+	bufptr = outbuf = (char*)malloc(bufsize);
+	if (outbuf == NULL) {
+		CRITICAL("Out of memory\n");
+		rc = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	
+	bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "[");
+	for (n = 0, envptr = envelopes; n < (unsigned int)actual_npoints; n++) {
+		bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "%s[ %" PRIi64,
+			n ? ", " : "",
+			timestamps[n] * 1000); /* return in ms for JavaScript */
+		for (s = 0; s < nseries; s++, envptr++) {
+			if (envptr->count == 0)
+				bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, ", null");
+			else
+				bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, nested ? ", [ %f, %f, %f, %u ]" : ", %f, %f, %f, %u",
+					envptr->min, envptr->max, envptr->mean, envptr->count);
+		}
+		bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, " ]");
+	}
+	bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "]");
+	
+	*resp_data = outbuf;
+	DEBUG("JSON: %s\n", *resp_data);
+	*resp_data_size = (unsigned int)(bufptr - outbuf);
+	rc = MHD_HTTP_OK;
+	
+done:
+	free(timestamps);
+	free(envelopes);
+	return rc;
+}
+
 HTTP_HANDLER(http_tsdb_get_series)
 {
 	tsdb_ctx_t *db;
 	const char *param;
 	uint64_t node_id;
-	unsigned int metric_id, npoints = DEFAULT_SERIES_NPOINTS;
-	int actual_npoints;
+	unsigned int metric_id, npoints = DEFAULT_SERIES_NPOINTS, envelope = 0, lttb = 0, once = 0;
+	int actual_npoints, interpolate;
 	int64_t start = TSDB_NO_TIMESTAMP, end = TSDB_NO_TIMESTAMP;
 	tsdb_series_point_t *points, *pointptr;
 	char *outbuf, *bufptr;
@@ -853,7 +1088,26 @@ HTTP_HANDLER(http_tsdb_get_series)
 	if (param) {
 		sscanf(param, "%u", &npoints);
 	}
-	DEBUG("start = %" PRIi64 " end = %" PRIi64 " npoints = %u\n", start, end, npoints);
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "envelope");
+	if (param) {
+		sscanf(param, "%u", &envelope);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "lttb");
+	if (param) {
+		sscanf(param, "%u", &lttb);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "once");
+	if (param) {
+		sscanf(param, "%u", &once);
+	}
+	interpolate = get_series_interpolate_parser(
+		MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "interpolate"));
+	DEBUG("start = %" PRIi64 " end = %" PRIi64 " npoints = %u envelope = %u lttb = %u interpolate = %d\n",
+		start, end, npoints, envelope, lttb, interpolate);
+	if (interpolate < 0 || (envelope && lttb) || ((envelope || lttb) && interpolate)) {
+		ERROR("envelope, lttb and interpolate are mutually exclusive\n");
+		return MHD_HTTP_BAD_REQUEST;
+	}
 	
 	/* Fetch the requested series */
 	db = tsdb_open(node_id);
@@ -873,14 +1127,26 @@ HTTP_HANDLER(http_tsdb_get_series)
 		}
 	}
 
+	/* Return min, max, mean and count if requested */
+	if (envelope) {
+		unsigned short status = get_series_envelope(db, &metric_id, 1, 0, start, end, npoints,
+			once ? TSDB_SERIES_ONCE : 0, resp_data, resp_data_size);
+		tsdb_close(db);
+		if (status == MHD_HTTP_OK)
+			*content_type = strdup(CONTENT_TYPE);
+		return status;
+	}
+
 	/* Allocate output buffer */
 	pointptr = points = (tsdb_series_point_t*)malloc(sizeof(tsdb_series_point_t) * npoints);
 	if (points == NULL) {
 		CRITICAL("Out of memory\n");
+		tsdb_close(db);
 		return MHD_HTTP_INTERNAL_SERVER_ERROR;
 	}
 	
-	if ((actual_npoints = tsdb_get_series(db, metric_id, start, end, npoints, 0, points)) < 0) {
+	if ((actual_npoints = tsdb_get_series(db, metric_id, start, end, npoints,
+			(lttb ? TSDB_SERIES_LTTB : interpolate) | (once ? TSDB_SERIES_ONCE : 0), points)) < 0) {
 		/* Will fail with -ENOENT if the metric ID is invalid - 404 */
 		free(points);
 		tsdb_close(db);
@@ -916,6 +1182,187 @@ HTTP_HANDLER(http_tsdb_get_series)
 	return MHD_HTTP_OK;
 }
 
+/* Parses a comma-separated list of metric IDs.  Returns the number of IDs or a negative
+ * error code. */
+static int get_multi_series_metric_parser(const char *param, unsigned int *metric_ids)
+{
+	unsigned int nseries = 0;
+	char *end;
+	
+	FUNCTION_TRACE;
+	
+	while (*param) {
+		if (nseries == TSDB_MAX_METRICS) {
+			ERROR("Maximum number of metrics exceeded\n");
+			return -EINVAL;
+		}
+		errno = 0;
+		metric_ids[nseries++] = (unsigned int)strtoul(param, &end, 10);
+		if (end == param || errno || (*end != ',' && *end != '\0')) {
+			ERROR("Invalid metric list\n");
+			return -EINVAL;
+		}
+		param = (*end == ',') ? end + 1 : end;
+	}
+	DEBUG("found %u metrics\n", nseries);
+	return (int)nseries;
+}
+
+HTTP_HANDLER(http_tsdb_get_multi_series)
+{
+	tsdb_ctx_t *db;
+	const char *param;
+	uint64_t node_id;
+	unsigned int metric_ids[TSDB_MAX_METRICS], nseries, npoints = DEFAULT_SERIES_NPOINTS, envelope = 0;
+	unsigned int n, s, once = 0;
+	int actual_npoints, rc, interpolate;
+	int64_t start = TSDB_NO_TIMESTAMP, end = TSDB_NO_TIMESTAMP;
+	int64_t *timestamps = NULL;
+	tsdb_data_t *values = NULL, *valueptr;
+	char *outbuf = NULL, *bufptr;
+	size_t bufsize;
+	tsdb_key_t key;
+	
+	FUNCTION_TRACE;
+	
+	/* Extract node ID from the URL */
+	if (sscanf(url, SCN_NODE, &node_id) != 1) {
+		/* If the URL doesn't parse then treat as a 404 */
+		ERROR("Invalid node\n");
+		return MHD_HTTP_NOT_FOUND;
+	}
+	
+	/* Parse query parameters */
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "start");
+	if (param) {
+		sscanf(param, "%" SCNi64, &start);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "end");
+	if (param) {
+		sscanf(param, "%" SCNi64, &end);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "npoints");
+	if (param) {
+		sscanf(param, "%u", &npoints);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "envelope");
+	if (param) {
+		sscanf(param, "%u", &envelope);
+	}
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "once");
+	if (param) {
+		sscanf(param, "%u", &once);
+	}
+	interpolate = get_series_interpolate_parser(
+		MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "interpolate"));
+	DEBUG("start = %" PRIi64 " end = %" PRIi64 " npoints = %u envelope = %u interpolate = %d\n",
+		start, end, npoints, envelope, interpolate);
+	if (interpolate < 0 || (envelope && interpolate)) {
+		ERROR("envelope and interpolate are mutually exclusive\n");
+		return MHD_HTTP_BAD_REQUEST;
+	}
+	
+	db = tsdb_open(node_id);
+	if (db == NULL) {
+		ERROR("Invalid node\n");
+		return MHD_HTTP_NOT_FOUND;
+	}
+
+	/* Check access */
+	if (tsdb_get_key(db, tsdbKey_Read, &key) == 0) {
+		/* Key is set - check signature */
+		if (http_check_signature(conn, (unsigned char*)&key, sizeof(key),
+				"GET", url, req_data, req_data_size)) {
+			/* Bad signature */
+			tsdb_close(db);
+			return MHD_HTTP_FORBIDDEN;
+		}
+	}
+	
+	/* Return all metrics unless a list is given */
+	param = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "metrics");
+	if (param) {
+		if ((rc = get_multi_series_metric_parser(param, metric_ids)) <= 0) {
+			tsdb_close(db);
+			return MHD_HTTP_BAD_REQUEST;
+		}
+		nseries = (unsigned int)rc;
+	} else {
+		for (nseries = 0; nseries < db->meta->nmetrics; nseries++)
+			metric_ids[nseries] = nseries;
+	}
+	
+	/* Return min, max, mean and count if requested */
+	if (envelope) {
+		rc = get_series_envelope(db, metric_ids, nseries, 1, start, end, npoints,
+			once ? TSDB_SERIES_ONCE : 0, resp_data, resp_data_size);
+		if (rc == MHD_HTTP_OK)
+			*content_type = strdup(CONTENT_TYPE);
+		goto done;
+	}
+	
+	/* Allocate output arrays */
+	timestamps = (int64_t*)malloc(sizeof(int64_t) * npoints);
+	values = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * npoints * nseries);
+	if ((timestamps == NULL || values == NULL) && npoints) {
+		CRITICAL("Out of memory\n");
+		rc = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	
+	/* Fetch all of the requested series in one pass */
+	if ((actual_npoints = tsdb_get_series_multi(db, metric_ids, nseries, start, end, npoints,
+			interpolate | (once ? TSDB_SERIES_ONCE : 0),
+			timestamps, values)) < 0) {
+		/* Will fail with -ENOENT if a metric ID is invalid - 404 */
+		ERROR("Fetch failed\n");
+		rc = (actual_npoints == -ENOENT) ? MHD_HTTP_NOT_FOUND : MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	tsdb_close(db);
+	db = NULL;
+	
+	/* Encode the response record - a 2D array with the timestamp followed by a value (or
+	 * null) for each metric on each row.  The buffer is sized for the longest
+	 * representation of each value. */
+	bufsize = 3 + (size_t)actual_npoints * (32 + nseries * (sizeof(tsdb_data_t) == sizeof(float) ? 50 : 320));
+	bufptr = outbuf = (char*)malloc(bufsize);
+	if (outbuf == NULL) {
+		CRITICAL("Out of memory\n");
+		rc = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+	
+	bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "[");
+	for (n = 0, valueptr = values; n < (unsigned int)actual_npoints; n++) {
+		bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "%s[ %" PRIi64,
+			n ? ", " : "",
+			timestamps[n] * 1000); /* return in ms for JavaScript */
+		for (s = 0; s < nseries; s++, valueptr++) {
+			if (isnan(*valueptr))
+				bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, ", null");
+			else
+				bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, ", %f", *valueptr);
+		}
+		bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, " ]");
+	}
+	bufptr += snprintf(bufptr, outbuf + bufsize - bufptr, "]");
+	
+	/* Pass response back to handler and set content type */
+	*resp_data = outbuf;
+	DEBUG("JSON: %s\n", *resp_data);
+	*resp_data_size = (unsigned int)(bufptr - outbuf);
+	*content_type = strdup(CONTENT_TYPE);
+	rc = MHD_HTTP_OK;
+	
+done:
+	if (db)
+		tsdb_close(db);
+	free(timestamps);
+	free(values);
+	return rc;
+}
+
 void http_tsdb_gen_admin_key(int persistent)
 {
 	const char *keychars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890^(){}[]-_=+;:@#~<>,./?";
@@ -38,6 +38,8 @@
 
 /*! Returns a list of hyperlinks to each registered node */
 HTTP_HANDLER(http_tsdb_get_nodes);
+/*! Returns page cache statistics for all nodes */
+HTTP_HANDLER(http_tsdb_get_stats);
 /*! Returns metadata for a specific node */
 HTTP_HANDLER(http_tsdb_get_node);
 /*! Allows creation of a new node.  Metadata specified in the request. */
@@ -59,6 +61,8 @@ HTTP_HANDLER(http_tsdb_post_values);
 HTTP_HANDLER(http_tsdb_get_values);
 /*! Return a time series on the specified metric for the addressed node */
 HTTP_HANDLER(http_tsdb_get_series);
+/*! Return time series on several (by default all) metrics for the addressed node */
+HTTP_HANDLER(http_tsdb_get_multi_series);
 
 /*!
  * \brief Generate random admin key.  MUST be called during startup
@@ -37,6 +37,7 @@
 #include <pwd.h>
 
 #include "tsdb.h"
+#include "tsdb_wal.h"
 #include "http.h"
 #include "http_tsdb.h"
 #include "logging.h"
@@ -47,6 +48,7 @@
 #define DEFAULT_DB_PATH		"/var/lib/timestore"
 #define DEFAULT_LOG_FILE	"/var/log/timestore.log"
 #define DEFAULT_LOG_LEVEL	1
+#define DEFAULT_WAL_POLICY	tsdbWal_Interval
 
 static int terminate = 0;
 
@@ -61,14 +63,23 @@ static void usage(const char *name)
 	fprintf(stderr,
 		"Timestore v" PACKAGE_VERSION "\n"
 		"(C) 2012-2013 Mike Stirling\n\n"
-		"Usage: %s [-d] [-v <log level>] [-p <HTTP port>] [-u <run as user>] [-D <db path>]\n\n"
+		"Usage: %s [-d] [-v <log level>] [-p <HTTP port>] [-u <run as user>] [-D <db path>]\n"
+		"          [-w <log sync policy>] [-i <log sync interval>] [-t <decimation threads>]\n"
+		"          [-f <metadata flush interval>] [-c <cached file descriptors>] [-m]\n\n"
 		"-a Use persistent admin key (if exists)\n"
+		"-c Most file descriptors held open by cached nodes (default %u)\n"
 		"-d Don't daemonise - logs to stderr\n"
 		"-D Path to database tree\n\n"
+		"-f Milliseconds between metadata write-backs (default %u, 0 to disable)\n"
+		"-i Milliseconds between write-ahead log syncs (default %u)\n"
+		"-m Move nodes from a flat database tree into shard directories in the background\n"
 		"-p Override HTTP listen port\n"
+		"-t Decimate lower layers in the background with this many threads (default 0 - during\n"
+		"   each update)\n"
 		"-u Run as specified user (not when -d specified)\n"
-		"-v Set logging verbosity\n",
-		name);
+		"-v Set logging verbosity\n"
+		"-w Write-ahead log sync policy: none, interval (default) or commit\n",
+		name, TSDB_CACHE_MAX_FDS, TSDB_FLUSH_DEFAULT_INTERVAL, TSDB_WAL_DEFAULT_INTERVAL);
 	exit(EXIT_FAILURE);
 }
 
@@ -116,7 +127,7 @@ void test(void)
 	int n;
 
 	tsdb_create(0xcafe, 30, 1, (tsdb_pad_mode_t[]){0}, (tsdb_downsample_mode_t[]){0},
-		    (unsigned int[]){20, 6, 6, 4, 7, 0});
+		    (unsigned int[]){20, 6, 6, 4, 7, 0}, tsdbLayout_Row, tsdbCompression_None, 0, NULL, NULL, 0);
 	db = tsdb_open(0xcafe);
 
 	/* Add a lot of random data */
@@ -139,33 +150,63 @@ void test(void)
 int main(int argc, char **argv)
 {
 	struct MHD_Daemon *d;
-	int opt, debug = 0, persistadmin = 0;
+	int opt, debug = 0, persistadmin = 0, migrate = 0;
 	int log_level = DEFAULT_LOG_LEVEL;
 	unsigned short port = DEFAULT_PORT;
+	tsdb_wal_policy_t wal_policy = DEFAULT_WAL_POLICY;
+	unsigned int wal_interval = TSDB_WAL_DEFAULT_INTERVAL;
+	unsigned int decimate_threads = 0;
+	unsigned int flush_interval = TSDB_FLUSH_DEFAULT_INTERVAL;
+	unsigned int cache_fds = TSDB_CACHE_MAX_FDS;
 	char *path = NULL, *user = NULL;
 	struct sigaction newsa, oldsa;
 
 	/* Parse options */
-	while ((opt = getopt(argc, argv, "adD:p:u:v:")) != -1) {
+	while ((opt = getopt(argc, argv, "ac:dD:f:i:mp:t:u:v:w:")) != -1) {
 		switch (opt) {
 			case 'a':
 				persistadmin = 1;
 				break;
+			case 'c':
+				cache_fds = atoi(optarg);
+				break;
 			case 'd':
 				debug = 1;
 				break;
 			case 'D':
 				path = strdup(optarg);
 				break;
+			case 'f':
+				flush_interval = atoi(optarg);
+				break;
+			case 'i':
+				wal_interval = atoi(optarg);
+				break;
+			case 'm':
+				migrate = 1;
+				break;
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 't':
+				decimate_threads = atoi(optarg);
+				break;
 			case 'u':
 				user = strdup(optarg);
 				break;
 			case 'v':
 				log_level = atoi(optarg);
 				break;
+			case 'w':
+				if (strcmp(optarg, "none") == 0)
+					wal_policy = tsdbWal_None;
+				else if (strcmp(optarg, "interval") == 0)
+					wal_policy = tsdbWal_Interval;
+				else if (strcmp(optarg, "commit") == 0)
+					wal_policy = tsdbWal_Commit;
+				else
+					usage(argv[0]);
+				break;
 			default:
 				usage(argv[0]);
 		}
@@ -207,6 +248,27 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/* Idle nodes are kept open up to these limits */
+	tsdb_cache_set_limits(cache_fds, TSDB_CACHE_MAX_MEMORY);
+
+	/* Recover from any unclean shutdown before accepting updates */
+	if (tsdb_wal_open(TSDB_WAL_FILE, wal_policy, wal_interval) < 0) {
+		ERROR("Failed opening write-ahead log\n");
+		exit(EXIT_FAILURE);
+	}
+	if (decimate_threads && tsdb_decimate_start(decimate_threads) < 0) {
+		ERROR("Failed starting decimation threads\n");
+		exit(EXIT_FAILURE);
+	}
+	if (flush_interval && tsdb_flush_start(flush_interval) < 0) {
+		ERROR("Failed starting metadata flusher\n");
+		exit(EXIT_FAILURE);
+	}
+	if (migrate && tsdb_migrate_start() < 0) {
+		ERROR("Failed starting shard migration\n");
+		exit(EXIT_FAILURE);
+	}
+
 	/* Install signal handler for quit */
 	newsa.sa_handler = sigint_handler;
 	sigemptyset(&newsa.sa_mask);
@@ -230,6 +292,18 @@ int main(int argc, char **argv)
 	}
 	INFO("Terminating\n");
 	http_destroy(d);
+	
+	tsdb_migrate_stop();
+	
+	/* Bring all lower layers up to date */
+	tsdb_decimate_stop();
+	tsdb_flush_stop();
+	
+	/* Make all updates durable and empty the log */
+	tsdb_wal_close();
+	
+	/* Close all cached databases */
+	tsdb_cache_flush();
 
 	/* Uninstall signal handler */
 	sigaction(SIGINT, &oldsa, NULL);
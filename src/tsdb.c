@@ -23,6 +23,8 @@
 
 /* TODO: Review use of xint_fast32_t */
 
+#define _GNU_SOURCE		/* for mremap */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -32,32 +34,503 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/time.h>
 #include <time.h>
 #include <errno.h>
 #include <math.h>
 
 #include "tsdb.h"
+#include "tsdb_wal.h"
+#include "tsdb_agg.h"
+#include "tsdb_pack.h"
 #include "logging.h"
 #include "profile.h"
 
+#ifdef TSDB_PTHREAD_LOCKING
+#define TSDB_LOCK(a)		pthread_mutex_lock(a)
+#define TSDB_UNLOCK(a)		pthread_mutex_unlock(a)
+#define TSDB_RDLOCK(ctx)	pthread_rwlock_rdlock(&(ctx)->lock)
+#define TSDB_WRLOCK(ctx)	pthread_rwlock_wrlock(&(ctx)->lock)
+#define TSDB_RWUNLOCK(ctx)	pthread_rwlock_unlock(&(ctx)->lock)
+#define TSDB_WAIT(c, a)		pthread_cond_wait(c, a)
+#define TSDB_BROADCAST(c)	pthread_cond_broadcast(c)
+#else
+#define TSDB_LOCK(a)
+#define TSDB_UNLOCK(a)
+#define TSDB_RDLOCK(ctx)
+#define TSDB_WRLOCK(ctx)
+#define TSDB_RWUNLOCK(ctx)
+#define TSDB_WAIT(c, a)
+#define TSDB_BROADCAST(c)
+#endif
+
+/* Size of one time point (all metrics) in a table */
+#define TSDB_ROW_SIZE(ctx)		(sizeof(tsdb_data_t) * (ctx)->meta->nmetrics)
+
+/* Each layer is stored in a single table file, or in one file per metric for the
+ * columnar layout */
+#define TSDB_IS_COLUMNAR(ctx)		((ctx)->meta->layout == tsdbLayout_Columnar)
+#define TSDB_NCOLUMNS(ctx)		(TSDB_IS_COLUMNAR(ctx) ? (ctx)->meta->nmetrics : 1)
+/* Number of values per point in each table file, and their size */
+#define TSDB_COLUMN_WIDTH(ctx)		(TSDB_IS_COLUMNAR(ctx) ? 1 : (ctx)->meta->nmetrics)
+#define TSDB_COLUMN_POINT_SIZE(ctx)	(sizeof(tsdb_data_t) * TSDB_COLUMN_WIDTH(ctx))
+
+/* Completed blocks of compressed layers are held in a separate block store */
+#define TSDB_IS_COMPRESSED(ctx)		((ctx)->meta->compression != tsdbCompression_None)
+
+/* Table files of segmented layers each hold a fixed span of points, and are opened as
+ * they are needed.  Each table holds open the segment it last wrote and the segment it
+ * last read, if different, so that queries of old data don't disturb updates. */
+#define TSDB_IS_SEGMENTED(ctx)		((ctx)->meta->segment_points != 0)
+#define TSDB_SEGMENT_WRITE		0
+#define TSDB_SEGMENT_READ		1
+#define TSDB_SEGMENT_SLOTS(ctx, layer, column)	\
+	((ctx)->segments + ((layer) * TSDB_NCOLUMNS(ctx) + (column)) * 2)
+
+typedef struct tsdb_segment {
+	int		fd;				/*< File descriptor (0 if none open) */
+	int		written;			/*< Set if written since it was last synced */
+	uint64_t	segment;			/*< Segment number */
+	uint64_t	offset;				/*< Position of the segment in its file (non-zero only if packed) */
+#ifdef TSDB_MMAP_TABLES
+	tsdb_data_t	*map;				/*< Shared mapping of the file (or NULL) */
+	size_t		size;				/*< Size of the mapping (bytes) */
+#endif
+} tsdb_segment_t;
+
+/* Layers with a capacity are rings of that many points, each stored at its point number
+ * modulo the capacity.  Points more than the capacity older than the newest written
+ * have been overwritten. */
+#define TSDB_IS_RING(ctx, layer)	((ctx)->meta->capacity[layer] != 0)
+/* Layers that wrap or release old points don't hold all of their points, so they are
+ * only accessed through tsdb_column_get and tsdb_column_write */
+#define TSDB_IS_LIMITED(ctx, layer)	(TSDB_IS_RING(ctx, layer) || (ctx)->meta->retention[layer] != 0)
+#define TSDB_EXPIRED(ctx, layer, point)	((point) < tsdb_layer_first(ctx, layer))
+
+/* First point still held by a layer, those before having been released after its
+ * retention period or overwritten in its ring */
+static inline uint64_t tsdb_layer_first(tsdb_ctx_t *ctx, unsigned int layer)
+{
+	uint64_t end = ctx->meta->ring_end[layer], capacity = ctx->meta->capacity[layer];
+	
+	if (capacity && end > capacity && end - capacity > ctx->meta->base[layer])
+		return end - capacity;
+	return ctx->meta->base[layer];
+}
+
+/* Downsampling mode for a metric */
+#define TSDB_DS_MODE(ctx, metric)	((tsdb_downsample_mode_t)(((ctx)->meta->flags[metric] >> TSDB_DOWNSAMPLE_SHIFT) & TSDB_DOWNSAMPLE_MASK))
+
+/* A node being loaded into the cache.  Only one thread loads a node at a time - others
+ * opening or deleting it wait for the load to finish. */
+typedef struct tsdb_loading {
+	uint64_t	node_id;			/*< Node being loaded */
+	struct tsdb_loading *next;			/*< Next node being loaded */
+} tsdb_loading_t;
+
+/* Process-wide cache of open contexts.  All cached contexts are reachable through
+ * the hash table.  Those not currently held by a caller are also linked into the
+ * LRU list, from which they are evicted to keep within the fd and memory limits. */
+static struct {
+	tsdb_ctx_t	*hash[TSDB_CACHE_HASH_SIZE];	/*< Cached contexts by node ID */
+	tsdb_loading_t	*loading;			/*< Nodes being loaded outside the lock */
+	tsdb_ctx_t	*dropped;			/*< Contexts removed, to be freed once unlocked */
+	unsigned int	nfreeing;			/*< Contexts removed and not yet freed */
+	tsdb_ctx_t	*lru_head;			/*< Most recently used idle context */
+	tsdb_ctx_t	*lru_tail;			/*< Least recently used idle context */
+	unsigned int	nfds;				/*< File descriptors held by cached contexts */
+	size_t		mem_size;			/*< Memory held by cached contexts */
+	unsigned int	max_fds;			/*< Limit on nfds */
+	size_t		max_mem_size;			/*< Limit on mem_size */
+	unsigned int	npacked;			/*< Contexts of packed nodes not yet freed (atomic) */
+} g_cache = {
+	.max_fds = TSDB_CACHE_MAX_FDS,
+	.max_mem_size = TSDB_CACHE_MAX_MEMORY,
+};
+#ifdef TSDB_PTHREAD_LOCKING
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when a node has finished loading */
+static pthread_cond_t g_cache_loaded = PTHREAD_COND_INITIALIZER;
+/* Signalled when no removed context is still being freed */
+static pthread_cond_t g_cache_freed = PTHREAD_COND_INITIALIZER;
+#endif
+
+#ifdef TSDB_PAGE_STATS
+/* Page cache statistics of every node.  Updated without locking by concurrent readers. */
+static tsdb_page_stats_t g_page_stats;
+#endif
+
+/* How a range of a table is about to be used (see tsdb_storage_advise) */
+typedef enum {
+	tsdbAdvice_Sequential = 0,	/*< Read in order, so read well ahead */
+	tsdbAdvice_WillNeed,		/*< Read soon, so start reading now */
+	tsdbAdvice_DontNeed,		/*< Not read again soon, so drop from the page cache */
+} tsdb_advice_t;
+
+#ifdef TSDB_PTHREAD_LOCKING
+/* Pool of threads that decimate updated nodes in the background.  Each node waiting for
+ * a thread is queued once, holding a handle, however many updates it receives meanwhile.
+ * The number of threads only changes while no updates are being made. */
+static struct {
+	pthread_t	threads[TSDB_MAX_DECIMATE_THREADS];
+	unsigned int	nthreads;			/*< Number of threads (0 if decimating synchronously) */
+	int		stop;				/*< Set to make the threads exit once the queue is empty */
+	tsdb_ctx_t	*head;				/*< Longest waiting context */
+	tsdb_ctx_t	*tail;				/*< Most recently queued context */
+	pthread_mutex_t	mutex;				/*< Protects the queue and stop flag */
+	pthread_cond_t	work;				/*< Signalled when a context is queued or on stop */
+} g_decimate = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+#define TSDB_DECIMATE_ASYNC()		(g_decimate.nthreads != 0)
+
+/* Thread that periodically writes back the metadata of changed nodes */
+static struct {
+	pthread_t	thread;
+	int		running;			/*< Set while the thread exists */
+	int		stop;				/*< Set to make the thread exit */
+	unsigned int	interval;			/*< Time between write-backs (ms) */
+	pthread_mutex_t	mutex;				/*< Protects the stop flag */
+	pthread_cond_t	work;				/*< Signalled on stop */
+} g_flush = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+
+/* Thread that moves nodes from a flat database tree into their shard directories */
+static struct {
+	pthread_t	thread;
+	int		running;			/*< Set while the thread exists */
+	int		stop;				/*< Set to make the thread exit (atomic) */
+} g_migrate;
+#else
+#define TSDB_DECIMATE_ASYNC()		0
+#endif
+
+/* Set if top-level points are waiting to be decimated into the lower layers */
+#define TSDB_IS_PENDING(ctx)		((ctx)->meta->pending_end > (ctx)->meta->pending_start)
+
+static void tsdb_ctx_free(tsdb_ctx_t *ctx);
+static int tsdb_ctx_sync(tsdb_ctx_t *ctx);
+static int tsdb_segment_close(tsdb_ctx_t *ctx, tsdb_segment_t *seg, int sync);
+static int tsdb_segment_sync(tsdb_ctx_t *ctx);
+static int tsdb_decimate_pending(tsdb_ctx_t *ctx);
+static int tsdb_pending_add(tsdb_ctx_t *ctx, uint64_t first, uint64_t end);
+static void tsdb_column_advise(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, uint64_t npoints, tsdb_advice_t advice);
+static uint64_t tsdb_layer_tail(tsdb_ctx_t *ctx, unsigned int layer);
+static int tsdb_cache_invalidate(uint64_t node_id);
+static void tsdb_cache_unlock(void);
+static void tsdb_cache_wait_load(uint64_t node_id);
+
+/* Metadata header as written by versions up to 6, which numbered points with 32 bits */
+typedef struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	node_id;
+	uint32_t	nmetrics;
+	uint32_t	npoints;
+	int64_t		start_time;
+	uint32_t	interval;
+	uint32_t	decimation[TSDB_MAX_LAYERS];
+	uint32_t	flags[TSDB_MAX_METRICS];
+	tsdb_key_info_t	key[TSDB_MAX_KEYS];
+	/* Version 1 */
+	uint32_t	acc_point[TSDB_MAX_LAYERS];
+	/* Version 2 */
+	uint32_t	layout;
+	/* Version 3 */
+	uint32_t	ngaps[TSDB_MAX_LAYERS];
+	struct {
+		uint32_t	start;
+		uint32_t	end;
+	}		gaps[TSDB_MAX_LAYERS][TSDB_MAX_GAPS];
+	/* Version 4 */
+	uint32_t	compression;
+	uint32_t	nsealed[TSDB_MAX_LAYERS];
+	/* Version 5 */
+	uint32_t	pending_start;
+	uint32_t	pending_end;
+	uint32_t	pending_npoints;
+	/* Version 6 */
+	uint64_t	sequence;
+	uint64_t	synced_sequence;
+} tsdb_metadata_v6_t;
+
+/* Size of the metadata header written by each earlier version.  New fields are only
+ * ever appended to the header, except where version 7 widened the point numbers. */
+static const size_t g_metadata_header_size[TSDB_VERSION] = {
+	offsetof(tsdb_metadata_v6_t, acc_point),	/* 0 */
+	offsetof(tsdb_metadata_v6_t, layout),		/* 1 */
+	offsetof(tsdb_metadata_v6_t, ngaps),		/* 2 */
+	offsetof(tsdb_metadata_v6_t, compression),	/* 3 */
+	offsetof(tsdb_metadata_v6_t, pending_start),	/* 4 */
+	offsetof(tsdb_metadata_v6_t, sequence),		/* 5 */
+	sizeof(tsdb_metadata_v6_t),			/* 6 */
+	offsetof(tsdb_metadata_t, capacity),		/* 7 */
+	offsetof(tsdb_metadata_t, retention),		/* 8 */
+};
+
+/* Converts a header written by an earlier version to the current layout.  Fields added
+ * since are zeroed. */
+static void tsdb_metadata_upgrade(tsdb_metadata_t *md, const tsdb_metadata_v6_t *old)
+{
+	unsigned int layer, g;
+	
+	memset(md, 0, sizeof(tsdb_metadata_t));
+	md->magic = old->magic;
+	md->version = old->version;
+	md->node_id = old->node_id;
+	md->nmetrics = old->nmetrics;
+	md->npoints = old->npoints;
+	md->start_time = old->start_time;
+	md->interval = old->interval;
+	memcpy(md->decimation, old->decimation, sizeof(md->decimation));
+	memcpy(md->flags, old->flags, sizeof(md->flags));
+	memcpy(md->key, old->key, sizeof(md->key));
+	md->layout = old->layout;
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		md->ngaps[layer] = old->ngaps[layer];
+		for (g = 0; g < TSDB_MAX_GAPS; g++) {
+			md->gaps[layer][g].start = old->gaps[layer][g].start;
+			md->gaps[layer][g].end = old->gaps[layer][g].end;
+		}
+	}
+	md->compression = old->compression;
+	memcpy(md->nsealed, old->nsealed, sizeof(md->nsealed));
+	md->pending_start = old->pending_start;
+	md->pending_end = old->pending_end;
+	md->pending_npoints = old->pending_npoints;
+	md->sequence = old->sequence;
+	md->synced_sequence = old->synced_sequence;
+}
+
+/* Size of a page of memory, and so of the page cache */
+static inline size_t tsdb_page_size(void)
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Size of a metadata file including the decimation accumulators that follow it */
+static inline size_t tsdb_metadata_size(unsigned int nmetrics)
+{
+	return sizeof(tsdb_metadata_t) + sizeof(tsdb_accum_t) * TSDB_MAX_LAYERS * nmetrics;
+}
+
+/* Reads enough of a node's metadata to find its files, zeroing whatever cannot be trusted */
+static void tsdb_metadata_peek(const char *path, tsdb_metadata_t *md)
+{
+	int fd;
+	
+	memset(md, 0, sizeof(*md));
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if (pread(fd, md, sizeof(*md), 0) < (ssize_t)g_metadata_header_size[7] || md->version < 7 ||
+				md->version > TSDB_VERSION || md->nmetrics > TSDB_MAX_METRICS)
+			md->segment_points = 0;
+		if (md->version < 8)
+			memset(md->capacity, 0, sizeof(md->capacity));
+		close(fd);
+	}
+}
+
+/* Generates the path of a node file either in its shard directory or, where versions
+ * before sharding kept it, in the working directory */
+#define TSDB_NODE_PATH(path, flat, format, node_id, ...) \
+	((flat) ? snprintf(path, TSDB_MAX_PATH, format, node_id, ##__VA_ARGS__) : \
+		TSDB_PATH(path, format, node_id, ##__VA_ARGS__))
+
+/* Calls fn on the path of every file of a node other than its metadata.  fn returns 0
+ * if the file was there - layers are probed until one is missing, and segments are
+ * found from the metadata (including any beyond the end it records). */
+static void tsdb_node_files(uint64_t node_id, const tsdb_metadata_t *md, int flat,
+	int (*fn)(uint64_t node_id, const char *path, void *arg), void *arg)
+{
+	unsigned int layer, metric;
+	uint64_t npoints, segment;
+	char path[TSDB_MAX_PATH];
+	int found;
+	
+	/* Layer data (row or columnar) - stop at the first missing layer */
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		TSDB_NODE_PATH(path, flat, TSDB_TABLE_FORMAT, node_id, layer);
+		DEBUG("Node %016" PRIX64 " layer %u table path: %s\n", node_id, layer, path);
+		found = (fn(node_id, path, arg) == 0);
+		TSDB_NODE_PATH(path, flat, TSDB_BLOCK_FORMAT, node_id, layer);
+		fn(node_id, path, arg);
+		TSDB_NODE_PATH(path, flat, TSDB_INDEX_FORMAT, node_id, layer);
+		fn(node_id, path, arg);
+		for (metric = 0; metric < TSDB_MAX_METRICS; metric++) {
+			TSDB_NODE_PATH(path, flat, TSDB_COLUMN_FORMAT, node_id, layer, metric);
+			if (fn(node_id, path, arg) < 0)
+				break;
+			found = 1;
+		}
+		if (!found)
+			break;
+	}
+	
+	/* Segments */
+	npoints = md->npoints;
+	for (layer = 0; layer < TSDB_MAX_LAYERS && md->segment_points; layer++) {
+		uint64_t held = (md->capacity[layer] && md->capacity[layer] < npoints) ? md->capacity[layer] : npoints;
+		
+		for (metric = 0; metric < ((md->layout == tsdbLayout_Columnar) ? md->nmetrics : 1); metric++) {
+			for (segment = 0; ; segment++) {
+				TSDB_NODE_PATH(path, flat, TSDB_SEGMENT_FORMAT, node_id, layer, metric, segment);
+				found = (fn(node_id, path, arg) == 0);
+				if (!found && segment * md->segment_points >= held)
+					break;
+			}
+		}
+		if (md->decimation[layer] == 0)
+			break;
+		npoints = (npoints + md->decimation[layer] - 1) / md->decimation[layer];
+	}
+}
+
+static int tsdb_unlink_file(uint64_t node_id, const char *path, void *arg)
+{
+	return unlink(path);
+}
+
+/* Creates the shard directories of a node if they do not already exist */
+static int tsdb_shard_mkdir(uint64_t node_id)
+{
+	char path[TSDB_MAX_PATH], *p;
+	
+	snprintf(path, TSDB_MAX_PATH, TSDB_SHARD_FORMAT, TSDB_SHARD(node_id));
+	for (p = path; (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			ERROR("Error creating shard directory %s: %s\n", path, strerror(errno));
+			return -errno;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* Moves one file from the working directory into its node's shard directory.  A file
+ * that a previous, interrupted move already got there still counts as found. */
+static int tsdb_shard_move(uint64_t node_id, const char *path, void *arg)
+{
+	char shard[TSDB_MAX_PATH];
+	int *rc = (int*)arg;
+	
+	snprintf(shard, TSDB_MAX_PATH, TSDB_SHARD_FORMAT "%s", TSDB_SHARD(node_id), path);
+	if (rename(path, shard) == 0)
+		return 0;
+	if (errno == ENOENT)
+		return access(shard, F_OK);
+	ERROR("Error moving %s to %s: %s\n", path, shard, strerror(errno));
+	*rc = -errno;
+	return 0;
+}
+
+/* Moves a node that a version before sharding left in the working directory into its
+ * shard directory.  The metadata goes last, so that a move that is interrupted is
+ * finished the next time.  Must be called with the cache locked and the node not
+ * cached.  Returns 0 if the node was moved or there was nothing to move. */
+static int tsdb_shard_migrate(uint64_t node_id)
+{
+	tsdb_metadata_t md;
+	char path[TSDB_MAX_PATH];
+	int rc = 0;
+	
+	snprintf(path, TSDB_MAX_PATH, TSDB_METADATA_FORMAT, node_id);
+	if (access(path, F_OK) < 0)
+		return (errno == ENOENT) ? 0 : -errno;
+	if ((rc = tsdb_shard_mkdir(node_id)) < 0)
+		return rc;
+	
+	tsdb_metadata_peek(path, &md);
+	tsdb_node_files(node_id, &md, 1, tsdb_shard_move, &rc);
+	if (rc < 0 || tsdb_shard_move(node_id, path, &rc) < 0 || rc < 0) {
+		ERROR("Failed moving node %016" PRIX64 " into its shard directory\n", node_id);
+		return (rc < 0) ? rc : -ENOENT;
+	}
+	INFO("Moved node %016" PRIX64 " into its shard directory\n", node_id);
+	return 0;
+}
+
 int tsdb_create(uint64_t node_id, unsigned int interval, unsigned int nmetrics, 
-	tsdb_pad_mode_t *pad_mode, tsdb_downsample_mode_t *ds_mode, unsigned int *decimation)
+	tsdb_pad_mode_t *pad_mode, tsdb_downsample_mode_t *ds_mode, unsigned int *decimation,
+	tsdb_layout_t layout, tsdb_compression_t compression, unsigned int segment_points,
+	uint64_t *capacity, uint64_t *retention, int packed)
 {
 	tsdb_metadata_t md;
+	tsdb_pack_t *pack;
 	char path[TSDB_MAX_PATH];
-	int n, fd;
+	uint64_t offset;
+	uint8_t *slot;
+	int n, fd, rc;
 	
 	FUNCTION_TRACE;
 	
-	/* Create metadata only if it does not already exist */
-	snprintf(path, TSDB_MAX_PATH, TSDB_METADATA_FORMAT, node_id);
+	if ((unsigned int)layout >= tsdbLayout_Max) {
+		ERROR("Bad table layout\n");
+		return -EINVAL;
+	}
+	if ((unsigned int)compression >= tsdbCompression_Max ||
+		(compression != tsdbCompression_None && layout == tsdbLayout_Columnar)) {
+		ERROR("Bad table compression\n");
+		return -EINVAL;
+	}
+	if (segment_points && compression != tsdbCompression_None) {
+		ERROR("Segmented tables cannot be compressed\n");
+		return -EINVAL;
+	}
+	if (packed && segment_points == 0) {
+		ERROR("Only segmented tables can be packed\n");
+		return -EINVAL;
+	}
+	for (n = 0; n < TSDB_MAX_LAYERS && capacity != NULL; n++) {
+		if (capacity[n] && compression != tsdbCompression_None) {
+			ERROR("Wrapping layers cannot be compressed\n");
+			return -EINVAL;
+		}
+		if (capacity[n] && n < TSDB_MAX_LAYERS - 1 && capacity[n] < decimation[n]) {
+			ERROR("Capacity of layer %d is less than its decimation\n", n);
+			return -EINVAL;
+		}
+		if (n == TSDB_MAX_LAYERS - 1 || decimation[n] == 0)
+			break;
+	}
+	for (n = 0; n < TSDB_MAX_LAYERS && retention != NULL; n++) {
+		if (retention[n] && compression != tsdbCompression_None) {
+			ERROR("Compressed layers cannot release old points\n");
+			return -EINVAL;
+		}
+		if (retention[n] && capacity != NULL && capacity[n]) {
+			ERROR("Layer %d cannot have both a capacity and a retention period\n", n);
+			return -EINVAL;
+		}
+		if (n == TSDB_MAX_LAYERS - 1 || decimation[n] == 0)
+			break;
+	}
+	
+	/* A node of the same ID left by a version before sharding must be found too, as
+	 * must one packed into a container */
+	TSDB_LOCK(&g_cache_mutex);
+	rc = tsdb_shard_migrate(node_id);
+	if (rc == 0 && tsdb_pack_get(node_id, 0, &pack) == 0 &&
+			tsdb_pack_find(pack, node_id, TSDB_EXTENT_METADATA, 0, 0, NULL, NULL) == 0) {
+		ERROR("Node %016" PRIX64 " already exists\n", node_id);
+		rc = -EEXIST;
+	}
+	TSDB_UNLOCK(&g_cache_mutex);
+	if (rc < 0 || (rc = tsdb_shard_mkdir(node_id)) < 0)
+		return rc;
+	TSDB_PATH(path, TSDB_METADATA_FORMAT, node_id);
 	DEBUG("Node %016" PRIX64 " metadata path: %s\n", node_id, path);
-	fd = open(path, O_RDWR | O_EXCL | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0) {
-		ERROR("Error creating metadata %s: %s\n", path, strerror(errno));
-		return -errno;
+	if (packed && access(path, F_OK) == 0) {
+		ERROR("Node %016" PRIX64 " already exists\n", node_id);
+		return -EEXIST;
 	}
 	
 	/* Populate fresh metadata */
@@ -70,17 +543,75 @@ int tsdb_create(uint64_t node_id, unsigned int interval, unsigned int nmetrics,
 	md.npoints = 0;
 	md.start_time = 0;
 	md.interval = (uint32_t)interval;
+	md.layout = (uint32_t)layout;
+	md.compression = (uint32_t)compression;
+	md.segment_points = (uint32_t)segment_points;
 	for (n = 0; n < nmetrics; n++) {
 		md.flags[n] = (
 			((uint32_t)pad_mode[n] << TSDB_PAD_SHIFT) |
-			((uint32_t)ds_mode[n] << TSDB_DOWNSAMPLE_SHIFT));
+			((uint32_t)ds_mode[n] << TSDB_DOWNSAMPLE_SHIFT) |
+			TSDB_FLAG_COMPLETE);
 	}
 	for (n = 0; n < TSDB_MAX_LAYERS; n++) {
 		if (*decimation == 0)
 			break;
 		md.decimation[n] = (uint32_t)*decimation++;
 	}
-	write(fd, &md, sizeof(tsdb_metadata_t));
+	for (n = 0; n < TSDB_MAX_LAYERS; n++) {
+		md.acc_point[n] = TSDB_ACC_INVALID;
+	}
+	for (n = 0; n < TSDB_MAX_LAYERS && capacity != NULL; n++) {
+		md.capacity[n] = capacity[n];
+		if (md.decimation[n] == 0)
+			break;
+	}
+	for (n = 0; n < TSDB_MAX_LAYERS && retention != NULL; n++) {
+		md.retention[n] = retention[n];
+		if (md.decimation[n] == 0)
+			break;
+	}
+	
+	/* Accumulators start out zeroed (and invalid) */
+	if (packed) {
+		slot = (uint8_t*)calloc(1, tsdb_metadata_size(nmetrics));
+		if (slot == NULL) {
+			CRITICAL("Out of memory\n");
+			return -ENOMEM;
+		}
+		memcpy(slot, &md, sizeof(md));
+		
+		/* Containers are closed by tsdb_cache_flush while no packed node is open */
+		TSDB_LOCK(&g_cache_mutex);
+		rc = tsdb_pack_get(node_id, 1, &pack);
+		if (rc == 0)
+			rc = tsdb_pack_alloc(pack, node_id, TSDB_EXTENT_METADATA, 0, 0, tsdb_metadata_size(nmetrics), &offset);
+		if (rc == 0 && pwrite(pack->meta_fd, slot, tsdb_metadata_size(nmetrics), offset) !=
+				(ssize_t)tsdb_metadata_size(nmetrics)) {
+			ERROR("Error writing metadata of node %016" PRIX64 ": %s\n", node_id, strerror(errno));
+			tsdb_pack_free(pack, node_id, TSDB_EXTENT_METADATA, 0, 0);
+			rc = -EIO;
+		}
+		TSDB_UNLOCK(&g_cache_mutex);
+		free(slot);
+		if (rc == -EEXIST)
+			ERROR("Node %016" PRIX64 " already exists\n", node_id);
+		return rc;
+	}
+	
+	/* Create metadata only if it does not already exist */
+	fd = open(path, O_RDWR | O_EXCL | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERROR("Error creating metadata %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	if (write(fd, &md, sizeof(tsdb_metadata_t)) != sizeof(tsdb_metadata_t) ||
+		ftruncate(fd, tsdb_metadata_size(nmetrics)) < 0) {
+		ERROR("Error writing metadata %s: %s\n", path, strerror(errno));
+		n = -errno;
+		close(fd);
+		unlink(path);
+		return n;
+	}
 	close(fd);
 	
 	return 0;
@@ -88,36 +619,65 @@ int tsdb_create(uint64_t node_id, unsigned int interval, unsigned int nmetrics,
 
 int tsdb_delete(uint64_t node_id)
 {
-	unsigned int layer;
+	tsdb_metadata_t md;
+	tsdb_pack_t *pack;
 	char path[TSDB_MAX_PATH];
+	int cached;
+	
+	int rc = 0;
 	
 	FUNCTION_TRACE;
 	
+	/* None of this node's logged updates may be replayed into a new node of the same ID */
+	if ((rc = tsdb_wal_delete(node_id)) < 0)
+		return rc;
+	
+	/* The cache is held locked throughout so that the node cannot be re-opened
+	 * until its files have gone.  A load already under way is let finish first, so
+	 * that its context is cached and can be invalidated. */
+	TSDB_LOCK(&g_cache_mutex);
+	tsdb_cache_wait_load(node_id);
+	cached = tsdb_cache_invalidate(node_id);
+	if ((rc = tsdb_shard_migrate(node_id)) < 0)
+		goto done;
+	
+	/* Free a packed node's extents, unless it was cached, in which case they are freed
+	 * with its context once it is unmapped */
+	TSDB_PATH(path, TSDB_METADATA_FORMAT, node_id);
+	if (access(path, F_OK) < 0 && tsdb_pack_get(node_id, 0, &pack) == 0 &&
+			tsdb_pack_find(pack, node_id, TSDB_EXTENT_METADATA, 0, 0, NULL, NULL) == 0) {
+		DEBUG("Node %016" PRIX64 " is packed in container %u\n", node_id, pack->number);
+		if (!cached)
+			rc = tsdb_pack_free_node(pack, node_id);
+		goto done;
+	}
+	
 	/* Delete metadata file */
-	snprintf(path, TSDB_MAX_PATH, TSDB_METADATA_FORMAT, node_id);
 	DEBUG("Node %016" PRIX64 " metadata path: %s\n", node_id, path);
+	tsdb_metadata_peek(path, &md);
 	if (unlink(path) < 0) {
 		ERROR("Failed to unlink %s\n", path);
-		return -errno;
+		rc = -errno;
+		goto done;
 	}
 	
-	/* Delete layer data - stop on first failure */
-	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {		
-		snprintf(path, TSDB_MAX_PATH, TSDB_TABLE_FORMAT, node_id, layer);
-		DEBUG("Node %016" PRIX64 " layer %u table path: %s\n", node_id, layer, path);	
-		if (unlink(path) < 0)
-			break;
-	}
-	return 0;
+	/* Delete layer data and segments */
+	tsdb_node_files(node_id, &md, 0, tsdb_unlink_file, NULL);
+done:
+	tsdb_cache_unlock();
+	return rc;
 }
 
-tsdb_ctx_t* tsdb_open(uint64_t node_id)
+static tsdb_ctx_t* tsdb_ctx_load(uint64_t node_id)
 {
 	tsdb_ctx_t *ctx;
+	tsdb_metadata_t md;
 	char path[TSDB_MAX_PATH];
 	struct stat st;
-	unsigned int n, layer;
-	uint_fast32_t max_decimation = 0;
+	unsigned int n, layer, column;
+	uint64_t max_decimation = 0, length;
+	size_t skew;
+	void *map;
 	
 	FUNCTION_TRACE;
 	
@@ -126,38 +686,131 @@ tsdb_ctx_t* tsdb_open(uint64_t node_id)
 		CRITICAL("Out of memory\n");
 		return NULL;
 	}
+	ctx->node_id = node_id;
+	ctx->mem_size = sizeof(tsdb_ctx_t);
+#ifdef TSDB_PTHREAD_LOCKING
+	{
+		pthread_rwlockattr_t attr;
+		
+		/* Don't let a steady stream of queries starve updates */
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&ctx->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+		pthread_mutex_init(&ctx->segment_lock, NULL);
+	}
+#endif
 	
 	/* Open and map dataset metadata */
-	snprintf(path, TSDB_MAX_PATH, TSDB_METADATA_FORMAT, node_id);
+	TSDB_PATH(path, TSDB_METADATA_FORMAT, node_id);
 	DEBUG("Node %016" PRIX64 " metadata path: %s\n", node_id, path);
 	ctx->meta_fd = open(path, O_RDWR);
-	if (ctx->meta_fd < 0) {
+	if (ctx->meta_fd < 0 && errno == ENOENT) {
+		/* May have been left by a version before sharding, or be packed into a
+		 * container, which stays open while the node is counted */
+		TSDB_LOCK(&g_cache_mutex);
+		if (tsdb_shard_migrate(node_id) == 0 && (ctx->meta_fd = open(path, O_RDWR)) < 0 &&
+				errno == ENOENT && tsdb_pack_get(node_id, 0, &ctx->pack) == 0) {
+			if (tsdb_pack_find(ctx->pack, node_id, TSDB_EXTENT_METADATA, 0, 0,
+					&ctx->meta_offset, &length) == 0) {
+				__atomic_add_fetch(&g_cache.npacked, 1, __ATOMIC_RELAXED);
+				ctx->meta_fd = ctx->pack->meta_fd;
+			} else {
+				ctx->pack = NULL;
+				errno = ENOENT;
+			}
+		}
+		TSDB_UNLOCK(&g_cache_mutex);
+	}
+	if (ctx->pack != NULL) {
+		/* The container keeps the descriptor */
+		DEBUG("Node %016" PRIX64 " metadata packed at %" PRIu64 "\n", node_id, ctx->meta_offset);
+		st.st_size = (off_t)length;
+	} else if (ctx->meta_fd < 0) {
 		ERROR("Error opening metadata %s: %s\n", path, strerror(errno));
 		goto fail;
+	} else {
+		ctx->nfds++;
+		fstat(ctx->meta_fd, &st);
+	}
+	
+	/* Every version has the fields up to nmetrics in the same place */
+	memset(&md, 0, sizeof(md));
+	if (st.st_size < (off_t)g_metadata_header_size[0] ||
+		pread(ctx->meta_fd, &md, g_metadata_header_size[0], ctx->meta_offset) < 0 ||
+		md.nmetrics > TSDB_MAX_METRICS) {
+		ERROR("Corrupt metadata\n");
+		goto fail;
 	}
-	fstat(ctx->meta_fd, &st);
-	if (st.st_size && st.st_size != sizeof(tsdb_metadata_t)) {
+	ctx->meta_size = tsdb_metadata_size(md.nmetrics);
+	if (ctx->pack != NULL) {
+		/* Packed nodes are always created at the current version, and their slot may
+		 * have been rounded up */
+		if (st.st_size < (off_t)ctx->meta_size) {
+			ERROR("Corrupt metadata\n");
+			goto fail;
+		}
+	} else if (md.magic == TSDB_MAGIC_META && md.version < TSDB_VERSION) {
+		tsdb_metadata_v6_t old;
+		
+		/* Upgrade from an earlier version.  Fields added since are zeroed and the
+		 * accumulators, which may have moved, are discarded. */
+		INFO("Upgrading metadata for node %016" PRIX64 " from version %u to %u\n", node_id,
+			md.version, TSDB_VERSION);
+		memset(&old, 0, sizeof(old));
+		if (pread(ctx->meta_fd, (md.version < 7) ? (void*)&old : (void*)&md,
+				g_metadata_header_size[md.version], 0) < 0) {
+			ERROR("Error reading metadata %s: %s\n", path, strerror(errno));
+			goto fail;
+		}
+		if (md.version < 7)
+			tsdb_metadata_upgrade(&md, &old);
+		for (n = 0; n < TSDB_MAX_LAYERS; n++) {
+			md.acc_point[n] = TSDB_ACC_INVALID;
+		}
+		md.version = TSDB_VERSION;
+		if (ftruncate(ctx->meta_fd, sizeof(md)) < 0 ||
+			pwrite(ctx->meta_fd, &md, sizeof(md), 0) != sizeof(md) ||
+			ftruncate(ctx->meta_fd, ctx->meta_size) < 0) {
+			ERROR("Error upgrading metadata %s: %s\n", path, strerror(errno));
+			goto fail;
+		}
+	} else if (st.st_size != (off_t)ctx->meta_size) {
 		ERROR("Corrupt metadata\n");
 		goto fail;
 	}
-	ctx->meta = mmap(NULL, sizeof(tsdb_metadata_t), PROT_READ | PROT_WRITE,
-		MAP_SHARED, ctx->meta_fd, 0);
-	if (ctx->meta == MAP_FAILED) {
+	skew = ctx->meta_offset & (tsdb_page_size() - 1);
+	map = mmap(NULL, ctx->meta_size + skew, PROT_READ | PROT_WRITE,
+		MAP_SHARED, ctx->meta_fd, ctx->meta_offset - skew);
+	if (map == MAP_FAILED) {
 		ERROR("mmap failed on file %s: %s\n", path, strerror(errno));
 		goto fail;
 	}
+	ctx->meta = (tsdb_metadata_t*)((uint8_t*)map + skew);
+	ctx->accum = (tsdb_accum_t*)(ctx->meta + 1);
+	ctx->mem_size += ctx->meta_size;
 	
 	DEBUG("magic = 0x%08" PRIX32 "\n", ctx->meta->magic);
 	DEBUG("version = %" PRIu32 "\n", ctx->meta->version);
 	DEBUG("node_id = 0x%016" PRIX64 "\n", ctx->meta->node_id);
 	DEBUG("nmetrics = %" PRIu32 "\n", ctx->meta->nmetrics);
-	DEBUG("npoints = %" PRIu32 "\n", ctx->meta->npoints);
+	DEBUG("npoints = %" PRIu64 "\n", ctx->meta->npoints);
+	DEBUG("segment_points = %" PRIu32 "\n", ctx->meta->segment_points);
 	DEBUG("start_time = %" PRIi64 "\n", ctx->meta->start_time);
 	DEBUG("interval = %" PRIu32 "\n", ctx->meta->interval);
 	for (n = 0; n < TSDB_MAX_LAYERS; n++)
 		DEBUG("decimation[%d] = %" PRIu32 "\n", n, ctx->meta->decimation[n]);
 	for (n = 0; n < TSDB_MAX_METRICS; n++)
 		DEBUG("flags[%d] = 0x%08" PRIX32 "\n", n, ctx->meta->flags[n]);
+	for (n = 0; n < TSDB_MAX_LAYERS; n++)
+		DEBUG("acc_point[%d] = 0x%016" PRIX64 "\n", n, ctx->meta->acc_point[n]);
+	DEBUG("layout = %" PRIu32 "\n", ctx->meta->layout);
+	DEBUG("compression = %" PRIu32 "\n", ctx->meta->compression);
+	DEBUG("pending = %" PRIu64 " to %" PRIu64 "\n", ctx->meta->pending_start, ctx->meta->pending_end);
+	for (n = 0; n < TSDB_MAX_LAYERS; n++)
+		DEBUG("capacity[%d] = %" PRIu64 " (end %" PRIu64 ")\n", n, ctx->meta->capacity[n], ctx->meta->ring_end[n]);
+	for (n = 0; n < TSDB_MAX_LAYERS; n++)
+		DEBUG("retention[%d] = %" PRIu64 " (base %" PRIu64 ")\n", n, ctx->meta->retention[n], ctx->meta->base[n]);
 	
 	/* Check metadata for consistency */
 	if (ctx->meta->magic != TSDB_MAGIC_META) {
@@ -172,23 +825,107 @@ tsdb_ctx_t* tsdb_open(uint64_t node_id)
 		ERROR("Incorrect node_id - possible data corruption\n");
 		goto fail;
 	}
-	
-	/* Allocate padding buffer */
-	ctx->padding = malloc(TSDB_MAX_PADDING_BLOCK);
-	if (ctx->padding == NULL) {
-		CRITICAL("Out of memory\n");
+	if (ctx->meta->layout >= tsdbLayout_Max) {
+		ERROR("Bad table layout\n");
+		goto fail;
+	}
+	if (ctx->meta->compression >= tsdbCompression_Max ||
+		(TSDB_IS_COMPRESSED(ctx) && (TSDB_IS_COLUMNAR(ctx) || TSDB_IS_SEGMENTED(ctx)))) {
+		ERROR("Bad table compression\n");
+		goto fail;
+	}
+	for (n = 0; n < TSDB_MAX_LAYERS; n++) {
+		if (TSDB_IS_LIMITED(ctx, n) && TSDB_IS_COMPRESSED(ctx)) {
+			ERROR("Bad table compression\n");
+			goto fail;
+		}
+	}
+	if (ctx->pack != NULL && !TSDB_IS_SEGMENTED(ctx)) {
+		ERROR("Packed node is not segmented\n");
 		goto fail;
 	}
 	
+	/* Segments are opened as they are needed.  The cache is charged up front for all
+	 * the descriptors they may hold, except by packed nodes, which share their
+	 * container's. */
+	if (TSDB_IS_SEGMENTED(ctx)) {
+		size_t size = sizeof(tsdb_segment_t) * TSDB_MAX_LAYERS * TSDB_NCOLUMNS(ctx) * 2;
+		
+		ctx->segments = (tsdb_segment_t*)calloc(1, size);
+		if (ctx->segments == NULL) {
+			CRITICAL("Out of memory\n");
+			goto fail;
+		}
+		ctx->mem_size += size;
+		for (layer = 0; layer < TSDB_MAX_LAYERS && ctx->pack == NULL; layer++) {
+			ctx->nfds += TSDB_NCOLUMNS(ctx) * 2;
+			if (ctx->meta->decimation[layer] == 0)
+				break;
+		}
+	}
+	
 	/* Open table files */
 	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {		
-		snprintf(path, TSDB_MAX_PATH, TSDB_TABLE_FORMAT, node_id, layer);
-		DEBUG("Node %016" PRIX64 " layer %u table path: %s\n", node_id, layer, path);
-		ctx->table_fd[layer] = open(path, O_RDWR | O_CREAT, 0644);
-		if (ctx->table_fd[layer] < 0) {
-			ERROR("Error opening table for node %016" PRIX64 " layer %d: %s\n", 
-				ctx->meta->node_id, layer, strerror(errno));
-			goto fail;
+		for (column = 0; column < TSDB_NCOLUMNS(ctx) && !TSDB_IS_SEGMENTED(ctx); column++) {
+			if (TSDB_IS_COLUMNAR(ctx)) {
+				TSDB_PATH(path, TSDB_COLUMN_FORMAT, node_id, layer, column);
+			} else {
+				TSDB_PATH(path, TSDB_TABLE_FORMAT, node_id, layer);
+			}
+			DEBUG("Node %016" PRIX64 " layer %u table path: %s\n", node_id, layer, path);
+			ctx->table_fd[layer][column] = open(path, O_RDWR | O_CREAT, 0644);
+			if (ctx->table_fd[layer][column] < 0) {
+				ERROR("Error opening table for node %016" PRIX64 " layer %d: %s\n", 
+					ctx->meta->node_id, layer, strerror(errno));
+				goto fail;
+			}
+			ctx->nfds++;
+			
+#ifdef TSDB_MMAP_TABLES
+			/* Map existing table contents.  The mapping is extended as the table grows. */
+			if (fstat(ctx->table_fd[layer][column], &st) < 0) {
+				ERROR("Error reading size of table for node %016" PRIX64 " layer %d: %s\n",
+					ctx->meta->node_id, layer, strerror(errno));
+				goto fail;
+			}
+			if (st.st_size) {
+				ctx->table_map[layer][column] = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, ctx->table_fd[layer][column], 0);
+				if (ctx->table_map[layer][column] == MAP_FAILED) {
+					ctx->table_map[layer][column] = NULL;
+					ERROR("mmap failed on table for node %016" PRIX64 " layer %d: %s\n",
+						ctx->meta->node_id, layer, strerror(errno));
+					goto fail;
+				}
+				ctx->table_size[layer][column] = st.st_size;
+			}
+#endif
+		}
+		
+		if (TSDB_IS_COMPRESSED(ctx)) {
+			/* Open compressed block store and its index */
+			TSDB_PATH(path, TSDB_BLOCK_FORMAT, node_id, layer);
+			ctx->block_fd[layer] = open(path, O_RDWR | O_CREAT, 0644);
+			if (ctx->block_fd[layer] < 0) {
+				ERROR("Error opening block store for node %016" PRIX64 " layer %d: %s\n",
+					ctx->meta->node_id, layer, strerror(errno));
+				goto fail;
+			}
+			ctx->nfds++;
+			if (fstat(ctx->block_fd[layer], &st) < 0) {
+				ERROR("Error reading size of block store for node %016" PRIX64 " layer %d: %s\n",
+					ctx->meta->node_id, layer, strerror(errno));
+				goto fail;
+			}
+			ctx->block_end[layer] = st.st_size;
+			TSDB_PATH(path, TSDB_INDEX_FORMAT, node_id, layer);
+			ctx->index_fd[layer] = open(path, O_RDWR | O_CREAT, 0644);
+			if (ctx->index_fd[layer] < 0) {
+				ERROR("Error opening block index for node %016" PRIX64 " layer %d: %s\n",
+					ctx->meta->node_id, layer, strerror(errno));
+				goto fail;
+			}
+			ctx->nfds++;
 		}
 		
 		/* Determine largest decimation step */
@@ -202,33 +939,114 @@ tsdb_ctx_t* tsdb_open(uint64_t node_id)
 		}
 	}
 	
-	/* Allocate decimation buffer */
+	/* Allocate decimation buffer.  This holds the points contributing to one point in the
+	 * next layer, followed by the valid values of one metric for median selection and
+	 * a hash table for finding modes if any metric needs one. */
 	if (max_decimation > 0) {
-		DEBUG("Largest decimation step %" PRIuFAST32 "\n", max_decimation);
-		ctx->work_buffer = malloc(sizeof(tsdb_data_t) * ctx->meta->nmetrics * max_decimation);
+		size_t size = sizeof(tsdb_data_t) * (ctx->meta->nmetrics + 1) * max_decimation;
+		size_t mode_size = 0;
+		
+		DEBUG("Largest decimation step %" PRIu64 "\n", max_decimation);
+		for (n = 0; n < ctx->meta->nmetrics; n++) {
+			if (TSDB_DS_MODE(ctx, n) == tsdbDownsample_Mode)
+				mode_size = sizeof(tsdb_agg_bucket_t) * tsdb_agg_mode_buckets(max_decimation);
+		}
+		ctx->work_buffer = malloc(size + mode_size);
 		if (ctx->work_buffer == NULL) {
 			CRITICAL("Out of memory\n");
 			goto fail;
 		}
+		ctx->select_buffer = ctx->work_buffer + ctx->meta->nmetrics * max_decimation;
+		if (mode_size)
+			ctx->mode_table = (tsdb_agg_bucket_t*)((uint8_t*)ctx->work_buffer + size);
+		ctx->mem_size += size + mode_size;
+	}
+	
+	/* Start reading the tails of the tables, which most queries are for */
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		for (column = 0; column < TSDB_NCOLUMNS(ctx); column++) {
+			tsdb_column_advise(ctx, layer, column, tsdb_layer_tail(ctx, layer),
+				TSDB_TAIL_SIZE / TSDB_COLUMN_POINT_SIZE(ctx), tsdbAdvice_WillNeed);
+		}
+		if (ctx->meta->decimation[layer] == 0)
+			break;
 	}
 	
 	return ctx;
 fail:
-	tsdb_close(ctx);
+	tsdb_ctx_free(ctx);
 	return NULL;
 }
 
-void tsdb_close(tsdb_ctx_t *ctx)
+/* Repairs a newly loaded node that was not shut down cleanly.  This writes to the node's
+ * files, so must be called only by the thread that loaded it, with the context cached and
+ * locked for writing. */
+static void tsdb_ctx_recover(tsdb_ctx_t *ctx)
 {
 	unsigned int layer;
 	
+	/* A node changed since it was last synced may have tables, and so lower layers, ahead
+	 * of its metadata and accumulators.  The accumulators are discarded and the newest
+	 * point of each lower layer is recomputed. */
+	if (ctx->meta->sequence != ctx->meta->synced_sequence && ctx->meta->npoints &&
+			ctx->meta->decimation[0] > 0) {
+		uint64_t span = 1;
+		
+		INFO("Node %016" PRIX64 " changed after it was last synced\n", ctx->node_id);
+		for (layer = 0; layer < TSDB_MAX_LAYERS && ctx->meta->decimation[layer] > 0; layer++) {
+			ctx->meta->acc_point[layer] = TSDB_ACC_INVALID;
+			if (span < ctx->meta->npoints)
+				span *= ctx->meta->decimation[layer];
+		}
+		if (tsdb_pending_add(ctx, (ctx->meta->npoints - 1) / span * span, ctx->meta->npoints) < 0)
+			ERROR("Decimation of node %016" PRIX64 " failed\n", ctx->node_id);
+	}
+	
+	/* Finish any background decimation that was cut short */
+	if (TSDB_IS_PENDING(ctx)) {
+		INFO("Completing decimation of node %016" PRIX64 "\n", ctx->node_id);
+		if (tsdb_decimate_pending(ctx) < 0)
+			ERROR("Decimation of node %016" PRIX64 " failed\n", ctx->node_id);
+	}
+}
+
+static void tsdb_ctx_free(tsdb_ctx_t *ctx)
+{
+	unsigned int layer, column, n;
+	
 	FUNCTION_TRACE;
 	
+	/* The log can only be emptied once everything it holds is in durable tables, so
+	 * sync any changes before they become unreachable (see tsdb_sync_all).  A deleted
+	 * node's logged updates are never replayed. */
+	if (ctx->dirty && !ctx->stale && tsdb_wal_enabled()) {
+		tsdb_ctx_sync(ctx);
+	}
+	
 	/* Close any open table files */
 	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
-		 if (ctx->table_fd[layer] > 0) {
-			 close(ctx->table_fd[layer]);
-		 }
+		for (column = 0; column < TSDB_MAX_METRICS; column++) {
+#ifdef TSDB_MMAP_TABLES
+			if (ctx->table_map[layer][column] != NULL) {
+				munmap(ctx->table_map[layer][column], ctx->table_size[layer][column]);
+			}
+#endif
+			if (ctx->table_fd[layer][column] > 0) {
+				close(ctx->table_fd[layer][column]);
+			}
+		}
+		if (ctx->block_fd[layer] > 0) {
+			close(ctx->block_fd[layer]);
+		}
+		if (ctx->index_fd[layer] > 0) {
+			close(ctx->index_fd[layer]);
+		}
+	}
+	if (ctx->segments != NULL) {
+		for (n = 0; n < TSDB_MAX_LAYERS * TSDB_NCOLUMNS(ctx) * 2; n++) {
+			tsdb_segment_close(ctx, &ctx->segments[n], 0);
+		}
+		free(ctx->segments);
 	}
 	
 	/* Free decimation block */
@@ -236,81 +1054,2069 @@ void tsdb_close(tsdb_ctx_t *ctx)
 		free(ctx->work_buffer);
 	}
 	
-	/* Free padding block */
-	if (ctx->padding != NULL) {
-		free(ctx->padding);
-	}
-	
 	/* Close metadata */
 	if (ctx->meta != NULL) {
-		munmap(ctx->meta, sizeof(tsdb_metadata_t));
+		size_t skew = ctx->meta_offset & (tsdb_page_size() - 1);
+		
+		munmap((uint8_t*)ctx->meta - skew, ctx->meta_size + skew);
 	}
-	if (ctx->meta_fd > 0) {
+	if (ctx->meta_fd > 0 && ctx->pack == NULL) {
 		close(ctx->meta_fd);
 	}
 	
+	/* A packed node deleted while in use gives up its extents only now, so that they
+	 * cannot be reused while still mapped */
+	if (ctx->pack != NULL) {
+		if (ctx->stale)
+			tsdb_pack_free_node(ctx->pack, ctx->node_id);
+		__atomic_sub_fetch(&g_cache.npacked, 1, __ATOMIC_RELAXED);
+	}
+	
+#ifdef TSDB_PTHREAD_LOCKING
+	pthread_rwlock_destroy(&ctx->lock);
+	pthread_mutex_destroy(&ctx->segment_lock);
+#endif
+	
 	/* Release context */
 	free(ctx);
 }
 
-/* FIXME: Timestamp is passed in to allow for integrity checking the lower layers. Not yet implemented */
-static int tsdb_update_layer(tsdb_ctx_t *ctx, unsigned int layer, uint_fast32_t point, uint_fast32_t npoints,
-	int64_t timestamp, tsdb_data_t *values)
+static inline unsigned int tsdb_cache_hash(uint64_t node_id)
 {
-	unsigned int metric;
-	tsdb_data_t new_values[TSDB_MAX_METRICS];
-	tsdb_data_t *ptr;
+	/* Node IDs are frequently sequential, so mix the bits before masking */
+	return (unsigned int)((node_id ^ (node_id >> 32)) * 2654435761u) & (TSDB_CACHE_HASH_SIZE - 1);
+}
+
+/* The following functions must be called with the cache lock held */
+
+static tsdb_ctx_t* tsdb_cache_lookup(uint64_t node_id)
+{
+	tsdb_ctx_t *ctx;
 	
-	FUNCTION_TRACE;
+	for (ctx = g_cache.hash[tsdb_cache_hash(node_id)]; ctx; ctx = ctx->hash_next) {
+		if (ctx->node_id == node_id)
+			return ctx;
+	}
+	return NULL;
+}
+
+static void tsdb_cache_insert(tsdb_ctx_t *ctx)
+{
+	unsigned int bucket = tsdb_cache_hash(ctx->node_id);
 	
-	DEBUG("Values for %u metrics at %" PRIi64 " at point %" PRIuFAST32 " in layer %d\n", ctx->meta->nmetrics,
-	      timestamp, point, layer);
+	ctx->hash_next = g_cache.hash[bucket];
+	g_cache.hash[bucket] = ctx;
+	g_cache.nfds += ctx->nfds;
+	g_cache.mem_size += ctx->mem_size;
+}
+
+static void tsdb_cache_remove(tsdb_ctx_t *ctx)
+{
+	tsdb_ctx_t **pctx = &g_cache.hash[tsdb_cache_hash(ctx->node_id)];
 	
-	/* Pad missing values */
-	if (point > npoints) {
-		uint_fast32_t npadding = point - npoints;
-		unsigned int pointsperblock = TSDB_MAX_PADDING_BLOCK / (sizeof(tsdb_data_t) * ctx->meta->nmetrics);
+	while (*pctx != ctx)
+		pctx = &(*pctx)->hash_next;
+	*pctx = ctx->hash_next;
+	ctx->hash_next = NULL;
+	g_cache.nfds -= ctx->nfds;
+	g_cache.mem_size -= ctx->mem_size;
+}
+
+static void tsdb_cache_lru_push(tsdb_ctx_t *ctx)
+{
+	ctx->lru_prev = NULL;
+	ctx->lru_next = g_cache.lru_head;
+	if (g_cache.lru_head)
+		g_cache.lru_head->lru_prev = ctx;
+	else
+		g_cache.lru_tail = ctx;
+	g_cache.lru_head = ctx;
+}
+
+static void tsdb_cache_lru_unlink(tsdb_ctx_t *ctx)
+{
+	if (ctx->lru_prev)
+		ctx->lru_prev->lru_next = ctx->lru_next;
+	else
+		g_cache.lru_head = ctx->lru_next;
+	if (ctx->lru_next)
+		ctx->lru_next->lru_prev = ctx->lru_prev;
+	else
+		g_cache.lru_tail = ctx->lru_prev;
+	ctx->lru_prev = ctx->lru_next = NULL;
+}
+
+/* Queues a context that is no longer reachable to be freed by tsdb_cache_unlock.  Freeing
+ * may sync the node's files, which must not hold up the rest of the cache. */
+static void tsdb_cache_drop(tsdb_ctx_t *ctx)
+{
+	ctx->lru_next = g_cache.dropped;
+	g_cache.dropped = ctx;
+	g_cache.nfreeing++;
+}
+
+static void tsdb_cache_evict(int all)
+{
+	tsdb_ctx_t *ctx;
+	
+	while ((ctx = g_cache.lru_tail) != NULL && (all ||
+			g_cache.nfds > g_cache.max_fds || g_cache.mem_size > g_cache.max_mem_size)) {
+		DEBUG("Evicting node %016" PRIX64 " from cache\n", ctx->node_id);
+		tsdb_cache_lru_unlink(ctx);
+		tsdb_cache_remove(ctx);
+		tsdb_cache_drop(ctx);
+	}
+	DEBUG("Cache holds %u fds, %zu bytes\n", g_cache.nfds, g_cache.mem_size);
+}
+
+/* Drops a deleted node from the cache, returning non-zero if its context has yet to be
+ * freed, which happens once it is no longer in use and the cache is unlocked */
+static int tsdb_cache_invalidate(uint64_t node_id)
+{
+	tsdb_ctx_t *ctx = tsdb_cache_lookup(node_id);
+	
+	if (ctx == NULL)
+		return 0;
+	
+	DEBUG("Invalidating cached node %016" PRIX64 "\n", node_id);
+	tsdb_cache_remove(ctx);
+	ctx->stale = 1;
+	if (ctx->refcount == 0) {
+		tsdb_cache_lru_unlink(ctx);
+		tsdb_cache_drop(ctx);
+	}
+	return 1;
+}
+
+/* Unlocks the cache, then frees the contexts dropped while it was locked */
+static void tsdb_cache_unlock(void)
+{
+	tsdb_ctx_t *ctx = g_cache.dropped, *next;
+	unsigned int n = 0;
+	
+	g_cache.dropped = NULL;
+	TSDB_UNLOCK(&g_cache_mutex);
+	if (ctx == NULL)
+		return;
+	for ( ; ctx; ctx = next, n++) {
+		next = ctx->lru_next;
+		tsdb_ctx_free(ctx);
+	}
+	TSDB_LOCK(&g_cache_mutex);
+	g_cache.nfreeing -= n;
+	if (g_cache.nfreeing == 0)
+		TSDB_BROADCAST(&g_cache_freed);
+	TSDB_UNLOCK(&g_cache_mutex);
+}
+
+/* Waits until no other thread is loading a node.  The lock is dropped while waiting. */
+static void tsdb_cache_wait_load(uint64_t node_id)
+{
+	tsdb_loading_t *load = g_cache.loading;
+	
+	while (load != NULL) {
+		if (load->node_id == node_id) {
+			TSDB_WAIT(&g_cache_loaded, &g_cache_mutex);
+			load = g_cache.loading;
+		} else {
+			load = load->next;
+		}
+	}
+}
+
+tsdb_ctx_t* tsdb_open(uint64_t node_id)
+{
+	tsdb_ctx_t *ctx;
+	tsdb_loading_t load, **pload;
+	
+	FUNCTION_TRACE;
+	
+	TSDB_LOCK(&g_cache_mutex);
+	tsdb_cache_wait_load(node_id);
+	ctx = tsdb_cache_lookup(node_id);
+	if (ctx == NULL) {
+		/* Not cached - load without holding the lock so that other nodes can
+		 * be served meanwhile.  Anyone else wanting this node waits for the load. */
+		load.node_id = node_id;
+		load.next = g_cache.loading;
+		g_cache.loading = &load;
+		TSDB_UNLOCK(&g_cache_mutex);
+		ctx = tsdb_ctx_load(node_id);
+		
+		TSDB_LOCK(&g_cache_mutex);
+		pload = &g_cache.loading;
+		while (*pload != &load)
+			pload = &(*pload)->next;
+		*pload = load.next;
+		if (ctx != NULL) {
+			DEBUG("Caching node %016" PRIX64 "\n", node_id);
+			tsdb_cache_insert(ctx);
+			ctx->refcount = 1;
+			
+			/* No other handle can use the node until it has been recovered */
+			TSDB_WRLOCK(ctx);
+		}
+		TSDB_BROADCAST(&g_cache_loaded);
+		TSDB_UNLOCK(&g_cache_mutex);
+		if (ctx != NULL) {
+			tsdb_ctx_recover(ctx);
+			TSDB_RWUNLOCK(ctx);
+		}
+		return ctx;
+	}
+	if (ctx->refcount++ == 0) {
+		/* Was idle - no longer eligible for eviction */
+		tsdb_cache_lru_unlink(ctx);
+	}
+	TSDB_UNLOCK(&g_cache_mutex);
+	return ctx;
+}
+
+void tsdb_close(tsdb_ctx_t *ctx)
+{
+	FUNCTION_TRACE;
+	
+	TSDB_LOCK(&g_cache_mutex);
+	if (--ctx->refcount == 0) {
+		if (ctx->stale) {
+			/* Node was deleted while in use */
+			tsdb_cache_drop(ctx);
+		} else {
+			tsdb_cache_lru_push(ctx);
+			tsdb_cache_evict(0);
+		}
+	}
+	tsdb_cache_unlock();
+}
+
+void tsdb_cache_set_limits(unsigned int max_fds, size_t max_memory)
+{
+	FUNCTION_TRACE;
+	
+	TSDB_LOCK(&g_cache_mutex);
+	g_cache.max_fds = max_fds;
+	g_cache.max_mem_size = max_memory;
+	tsdb_cache_evict(0);
+	tsdb_cache_unlock();
+}
+
+void tsdb_cache_flush(void)
+{
+	FUNCTION_TRACE;
+	
+	TSDB_LOCK(&g_cache_mutex);
+	tsdb_cache_evict(1);
+	tsdb_cache_unlock();
+	
+	TSDB_LOCK(&g_cache_mutex);
+	if (__atomic_load_n(&g_cache.npacked, __ATOMIC_RELAXED) == 0)
+		tsdb_pack_close_all();
+	TSDB_UNLOCK(&g_cache_mutex);
+}
+
+void tsdb_get_page_stats(tsdb_page_stats_t *stats)
+{
+#ifdef TSDB_PAGE_STATS
+	unsigned int layer;
+#endif
+	
+	FUNCTION_TRACE;
+	
+	memset(stats, 0, sizeof(*stats));
+#ifdef TSDB_PAGE_STATS
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		stats->hits[layer] = __atomic_load_n(&g_page_stats.hits[layer], __ATOMIC_RELAXED);
+		stats->misses[layer] = __atomic_load_n(&g_page_stats.misses[layer], __ATOMIC_RELAXED);
+	}
+#endif
+}
+
+/* Writes a context's metadata to stable storage.  The mapping of packed metadata starts
+ * part way into a page. */
+static int tsdb_meta_sync(tsdb_ctx_t *ctx)
+{
+	size_t skew = ctx->meta_offset & (tsdb_page_size() - 1);
+	
+	return msync((uint8_t*)ctx->meta - skew, ctx->meta_size + skew, MS_SYNC);
+}
+
+/* Write all of a context's tables and metadata to stable storage.  Updates the sync
+ * state, so the caller holds the write lock or the only reference. */
+static int tsdb_ctx_sync(tsdb_ctx_t *ctx)
+{
+	unsigned int layer, column;
+	int rc = 0;
+	
+	FUNCTION_TRACE;
+	
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		for (column = 0; column < TSDB_MAX_METRICS; column++) {
+#ifdef TSDB_MMAP_TABLES
+			if (ctx->table_map[layer][column] != NULL &&
+				msync(ctx->table_map[layer][column], ctx->table_size[layer][column], MS_SYNC) < 0) {
+				rc = -errno;
+			}
+#endif
+			if (ctx->table_fd[layer][column] > 0 && fdatasync(ctx->table_fd[layer][column]) < 0) {
+				rc = -errno;
+			}
+		}
+		if (ctx->block_fd[layer] > 0 && fdatasync(ctx->block_fd[layer]) < 0) {
+			rc = -errno;
+		}
+		if (ctx->index_fd[layer] > 0 && fdatasync(ctx->index_fd[layer]) < 0) {
+			rc = -errno;
+		}
+	}
+	if (ctx->segments != NULL) {
+		int err = tsdb_segment_sync(ctx);
+		if (err < 0)
+			rc = err;
+	}
+	
+	/* Metadata last, so that it never describes data that isn't there */
+	if (rc == 0)
+		ctx->meta->synced_sequence = ctx->meta->sequence;
+	if (tsdb_meta_sync(ctx) < 0) {
+		rc = -errno;
+	}
+	if (rc < 0) {
+		ERROR("Sync of node %016" PRIX64 " failed: %s\n", ctx->node_id, strerror(-rc));
+	} else {
+		ctx->dirty = 0;
+		ctx->flushed_sequence = ctx->meta->sequence;
+	}
+	return rc;
+}
+
+/* Records a change to a context.  The metadata is written back by the flusher, except
+ * for the first change since the node was synced, which is written back straight away
+ * so that the metadata on disk shows whenever the tables may be ahead of it. */
+static void tsdb_ctx_changed(tsdb_ctx_t *ctx)
+{
+	ctx->dirty = 1;
+	if (ctx->meta->sequence++ == ctx->meta->synced_sequence)
+		tsdb_meta_sync(ctx);
+}
+
+int tsdb_sync(tsdb_ctx_t *ctx)
+{
+	int rc;
+	
+	FUNCTION_TRACE;
+	
+	/* Sync state is written here, and updates must not dirty the context behind our back */
+	TSDB_WRLOCK(ctx);
+	rc = tsdb_ctx_sync(ctx);
+	TSDB_RWUNLOCK(ctx);
+	return rc;
+}
+
+int tsdb_sync_all(void)
+{
+	tsdb_ctx_t **dirty = NULL, *ctx;
+	unsigned int n, ndirty = 0, bucket;
+	int rc = 0;
+	
+	FUNCTION_TRACE;
+	
+	/* Take a handle on every modified context so that they can be synced without
+	 * holding up the rest of the cache.  Contexts already removed from the cache are
+	 * synced as they are freed, which must finish first. */
+	TSDB_LOCK(&g_cache_mutex);
+	while (g_cache.nfreeing)
+		TSDB_WAIT(&g_cache_freed, &g_cache_mutex);
+	for (bucket = 0; bucket < TSDB_CACHE_HASH_SIZE; bucket++) {
+		for (ctx = g_cache.hash[bucket]; ctx; ctx = ctx->hash_next) {
+			if (ctx->dirty)
+				ndirty++;
+		}
+	}
+	if (ndirty) {
+		dirty = (tsdb_ctx_t**)malloc(sizeof(tsdb_ctx_t*) * ndirty);
+		if (dirty == NULL) {
+			CRITICAL("Out of memory\n");
+			TSDB_UNLOCK(&g_cache_mutex);
+			return -ENOMEM;
+		}
+	}
+	n = 0;
+	for (bucket = 0; bucket < TSDB_CACHE_HASH_SIZE; bucket++) {
+		for (ctx = g_cache.hash[bucket]; ctx; ctx = ctx->hash_next) {
+			if (ctx->dirty) {
+				if (ctx->refcount++ == 0)
+					tsdb_cache_lru_unlink(ctx);
+				dirty[n++] = ctx;
+			}
+		}
+	}
+	TSDB_UNLOCK(&g_cache_mutex);
+	
+	DEBUG("Syncing %u nodes\n", ndirty);
+	for (n = 0; n < ndirty; n++) {
+		int err = tsdb_sync(dirty[n]);
+		if (err < 0)
+			rc = err;
+		tsdb_close(dirty[n]);
+	}
+	free(dirty);
+	return rc;
+}
+
+#ifdef TSDB_PTHREAD_LOCKING
+/* Writes back the metadata of every cached context changed since it was last written,
+ * first releasing any of its points that have expired */
+static void tsdb_flush_all(void)
+{
+	tsdb_ctx_t **changed = NULL, *ctx;
+	unsigned int n, nchanged = 0, bucket;
+	
+	FUNCTION_TRACE;
+	
+	TSDB_LOCK(&g_cache_mutex);
+	for (bucket = 0; bucket < TSDB_CACHE_HASH_SIZE; bucket++) {
+		for (ctx = g_cache.hash[bucket]; ctx; ctx = ctx->hash_next) {
+			if (ctx->meta->sequence != ctx->flushed_sequence)
+				nchanged++;
+		}
+	}
+	if (nchanged == 0) {
+		TSDB_UNLOCK(&g_cache_mutex);
+		return;
+	}
+	changed = (tsdb_ctx_t**)malloc(sizeof(tsdb_ctx_t*) * nchanged);
+	if (changed == NULL) {
+		CRITICAL("Out of memory\n");
+		TSDB_UNLOCK(&g_cache_mutex);
+		return;
+	}
+	n = 0;
+	for (bucket = 0; bucket < TSDB_CACHE_HASH_SIZE && n < nchanged; bucket++) {
+		for (ctx = g_cache.hash[bucket]; ctx && n < nchanged; ctx = ctx->hash_next) {
+			if (ctx->meta->sequence != ctx->flushed_sequence) {
+				if (ctx->refcount++ == 0)
+					tsdb_cache_lru_unlink(ctx);
+				changed[n++] = ctx;
+			}
+		}
+	}
+	nchanged = n;
+	TSDB_UNLOCK(&g_cache_mutex);
+	
+	DEBUG("Writing back metadata of %u nodes\n", nchanged);
+	for (n = 0; n < nchanged; n++) {
+		ctx = changed[n];
+		if (tsdb_expire(ctx) < 0)
+			ERROR("Release of expired points of node %016" PRIX64 " failed\n", ctx->node_id);
+		/* Write lock, as flushed_sequence is also written by tsdb_sync */
+		TSDB_WRLOCK(ctx);
+		if (tsdb_meta_sync(ctx) < 0)
+			ERROR("Metadata write-back of node %016" PRIX64 " failed: %s\n",
+				ctx->node_id, strerror(errno));
+		else
+			ctx->flushed_sequence = ctx->meta->sequence;
+		TSDB_RWUNLOCK(ctx);
+		tsdb_close(ctx);
+	}
+	free(changed);
+}
+
+static void* tsdb_flush_thread(void *arg)
+{
+	struct timespec deadline;
+	
+	pthread_mutex_lock(&g_flush.mutex);
+	while (!g_flush.stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += g_flush.interval / 1000;
+		deadline.tv_nsec += (long)(g_flush.interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!g_flush.stop && pthread_cond_timedwait(&g_flush.work, &g_flush.mutex, &deadline) != ETIMEDOUT);
+		
+		pthread_mutex_unlock(&g_flush.mutex);
+		tsdb_flush_all();
+		pthread_mutex_lock(&g_flush.mutex);
+	}
+	pthread_mutex_unlock(&g_flush.mutex);
+	return NULL;
+}
+#endif
+
+int tsdb_flush_start(unsigned int interval)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	int rc;
+	
+	FUNCTION_TRACE;
+	
+	if (interval == 0 || g_flush.running) {
+		ERROR("Bad metadata flush interval\n");
+		return -EINVAL;
+	}
+	g_flush.stop = 0;
+	g_flush.interval = interval;
+	if ((rc = pthread_create(&g_flush.thread, NULL, tsdb_flush_thread, NULL)) != 0) {
+		ERROR("Error starting metadata flusher: %s\n", strerror(rc));
+		return -rc;
+	}
+	g_flush.running = 1;
+	INFO("Writing back metadata every %u ms\n", interval);
+	return 0;
+#else
+	ERROR("Metadata flusher needs pthreads\n");
+	return -ENOSYS;
+#endif
+}
+
+void tsdb_flush_stop(void)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	FUNCTION_TRACE;
+	
+	if (!g_flush.running)
+		return;
+	
+	/* The thread makes a final pass on the way out */
+	pthread_mutex_lock(&g_flush.mutex);
+	g_flush.stop = 1;
+	pthread_cond_signal(&g_flush.work);
+	pthread_mutex_unlock(&g_flush.mutex);
+	pthread_join(g_flush.thread, NULL);
+	g_flush.running = 0;
+	INFO("Metadata flusher stopped\n");
+#endif
+}
+
+#ifdef TSDB_PTHREAD_LOCKING
+static void* tsdb_migrate_thread(void *arg)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char name[TSDB_MAX_PATH];
+	uint64_t node_id;
+	unsigned int moved = 0;
+	int rc;
+	
+	dir = opendir(".");
+	if (dir == NULL) {
+		ERROR("Error reading database directory: %s\n", strerror(errno));
+		return NULL;
+	}
+	
+	/* Files are renamed out of the directory as it is read, which at worst makes
+	 * the read skip a node that will then be moved when it is opened */
+	while (!__atomic_load_n(&g_migrate.stop, __ATOMIC_RELAXED) && (entry = readdir(dir)) != NULL) {
+		/* Each node's metadata is named after it */
+		node_id = strtoull(entry->d_name, NULL, 16);
+		snprintf(name, TSDB_MAX_PATH, TSDB_METADATA_FORMAT, node_id);
+		if (strcmp(name, entry->d_name) != 0)
+			continue;
+		
+		/* A node that is cached has already been moved, as has one being loaded */
+		TSDB_LOCK(&g_cache_mutex);
+		tsdb_cache_wait_load(node_id);
+		rc = tsdb_cache_lookup(node_id) ? 0 : tsdb_shard_migrate(node_id);
+		TSDB_UNLOCK(&g_cache_mutex);
+		if (rc == 0)
+			moved++;
+	}
+	closedir(dir);
+	INFO("Moved %u nodes into shard directories\n", moved);
+	return NULL;
+}
+#endif
+
+int tsdb_migrate_start(void)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	int rc;
+	
+	FUNCTION_TRACE;
+	
+	if (g_migrate.running)
+		return -EBUSY;
+	g_migrate.stop = 0;
+	if ((rc = pthread_create(&g_migrate.thread, NULL, tsdb_migrate_thread, NULL)) != 0) {
+		ERROR("Error starting shard migration: %s\n", strerror(rc));
+		return -rc;
+	}
+	g_migrate.running = 1;
+	INFO("Moving nodes into shard directories\n");
+	return 0;
+#else
+	ERROR("Shard migration needs pthreads\n");
+	return -ENOSYS;
+#endif
+}
+
+void tsdb_migrate_stop(void)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	FUNCTION_TRACE;
+	
+	if (!g_migrate.running)
+		return;
+	
+	/* Whatever is left is moved as it is opened */
+	__atomic_store_n(&g_migrate.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(g_migrate.thread, NULL);
+	g_migrate.running = 0;
+#endif
+}
+
+/* Number of points in a layer, derived from the number in the top-level */
+static uint64_t tsdb_layer_npoints(tsdb_ctx_t *ctx, unsigned int layer, uint64_t npoints)
+{
+	unsigned int n;
+	
+	for (n = 0; n < layer; n++) {
+		npoints = (npoints + ctx->meta->decimation[n] - 1) / ctx->meta->decimation[n];
+	}
+	return npoints;
+}
+
+#ifdef TSDB_MMAP_TABLES
+/* Extends a table file and its mapping to hold at least the specified number of points */
+static int tsdb_column_grow(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column, uint64_t npoints)
+{
+	size_t size = TSDB_COLUMN_POINT_SIZE(ctx) * npoints;
+	void *map;
+	
+	if (size <= ctx->table_size[layer][column])
+		return 0;
+	
+	/* Grow in large steps to keep remapping infrequent */
+	size = (size + TSDB_TABLE_MAP_CHUNK - 1) & ~((size_t)TSDB_TABLE_MAP_CHUNK - 1);
+	DEBUG("Growing layer %u table %u to %zu bytes\n", layer, column, size);
+	if (ftruncate(ctx->table_fd[layer][column], size) < 0) {
+		ERROR("Table resize error for layer %u: %s\n", layer, strerror(errno));
+		return -errno;
+	}
+	if (ctx->table_map[layer][column] != NULL) {
+		map = mremap(ctx->table_map[layer][column], ctx->table_size[layer][column], size, MREMAP_MAYMOVE);
+	} else {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->table_fd[layer][column], 0);
+	}
+	if (map == MAP_FAILED) {
+		ERROR("Table mmap error for layer %u: %s\n", layer, strerror(errno));
+		return -errno;
+	}
+	ctx->table_map[layer][column] = (tsdb_data_t*)map;
+	ctx->table_size[layer][column] = size;
+	return 0;
+}
+#endif
+
+/* Closes a segment, first syncing it if requested and it has been written since it was
+ * last synced */
+static int tsdb_segment_close(tsdb_ctx_t *ctx, tsdb_segment_t *seg, int sync)
+{
+	int rc = 0;
+	
+	if (seg->fd <= 0)
+		return 0;
+#ifdef TSDB_MMAP_TABLES
+	if (seg->map != NULL) {
+		if (sync && seg->written && msync(seg->map, seg->size, MS_SYNC) < 0)
+			rc = -errno;
+		munmap(seg->map, seg->size);
+		seg->map = NULL;
+		seg->size = 0;
+	}
+#endif
+	if (sync && seg->written && fdatasync(seg->fd) < 0)
+		rc = -errno;
+	if (rc < 0)
+		ERROR("Sync of segment %" PRIu64 " failed: %s\n", seg->segment, strerror(-rc));
+	if (ctx->pack == NULL)
+		close(seg->fd);
+	seg->fd = 0;
+	seg->offset = 0;
+	seg->written = 0;
+	return rc;
+}
+
+/* Syncs every open segment written since it was last synced */
+static int tsdb_segment_sync(tsdb_ctx_t *ctx)
+{
+	tsdb_segment_t *seg = ctx->segments;
+	unsigned int n;
+	int rc = 0;
+	
+	TSDB_LOCK(&ctx->segment_lock);
+	for (n = 0; n < TSDB_MAX_LAYERS * TSDB_NCOLUMNS(ctx) * 2; n++, seg++) {
+		if (!seg->written)
+			continue;
+#ifdef TSDB_MMAP_TABLES
+		if (seg->map != NULL && msync(seg->map, seg->size, MS_SYNC) < 0) {
+			rc = -errno;
+			continue;
+		}
+#endif
+		if (fdatasync(seg->fd) < 0) {
+			rc = -errno;
+			continue;
+		}
+		seg->written = 0;
+	}
+	TSDB_UNLOCK(&ctx->segment_lock);
+	return rc;
+}
+
+/* Opens a segment of a packed node in the slot given, from its extent in the container.
+ * An extent is allocated only for writing. */
+static int tsdb_segment_open_packed(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t segment, int write, tsdb_segment_t *seg, tsdb_segment_t **segp)
+{
+	size_t size = TSDB_COLUMN_POINT_SIZE(ctx) * ctx->meta->segment_points;
+	int rc;
+	
+	rc = tsdb_pack_find(ctx->pack, ctx->node_id, layer, column, segment, &seg->offset, NULL);
+	if (rc == -ENOENT && write)
+		rc = tsdb_pack_alloc(ctx->pack, ctx->node_id, layer, column, segment, size, &seg->offset);
+	if (rc < 0) {
+		if (rc != -ENOENT || write)
+			ERROR("Error opening node %016" PRIX64 " layer %u segment %" PRIu64 ": %s\n",
+				ctx->node_id, layer, segment, strerror(-rc));
+		seg->offset = 0;
+		return rc;
+	}
+	DEBUG("Node %016" PRIX64 " layer %u segment %" PRIu64 " packed at %" PRIu64 "\n",
+		ctx->node_id, layer, segment, seg->offset);
+	seg->fd = ctx->pack->data_fd;
+	seg->segment = segment;
+	
+#ifdef TSDB_MMAP_TABLES
+	/* Extents are whole pages, so each is mapped on its own */
+	seg->map = (tsdb_data_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, seg->offset);
+	if (seg->map == MAP_FAILED) {
+		rc = -errno;
+		seg->map = NULL;
+		ERROR("mmap failed on node %016" PRIX64 " layer %u segment %" PRIu64 ": %s\n",
+			ctx->node_id, layer, segment, strerror(-rc));
+		tsdb_segment_close(ctx, seg, 0);
+		return rc;
+	}
+	seg->size = size;
+#endif
+	*segp = seg;
+	return 0;
+}
+
+/* Finds the segment of a table holding the given point, opening it if necessary.  A
+ * segment is created only for writing, and returns -ENOENT for reading if it has never
+ * been written.  Must be called with the segment lock held. */
+static int tsdb_segment_open(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, int write, tsdb_segment_t **segp)
+{
+	tsdb_segment_t *slots = TSDB_SEGMENT_SLOTS(ctx, layer, column), *seg;
+	uint64_t segment = point / ctx->meta->segment_points;
+	char path[TSDB_MAX_PATH];
+	int rc;
+#ifdef TSDB_MMAP_TABLES
+	size_t size = TSDB_COLUMN_POINT_SIZE(ctx) * ctx->meta->segment_points;
+	struct stat st;
+	void *map;
+#endif
+	
+	/* Reads use the segment being written if it is the right one */
+	seg = &slots[TSDB_SEGMENT_WRITE];
+	if (seg->fd > 0 && seg->segment == segment)
+		goto found;
+	seg = &slots[TSDB_SEGMENT_READ];
+	if (seg->fd > 0 && seg->segment == segment) {
+		if (!write)
+			goto found;
+		tsdb_segment_close(ctx, seg, 0);
+	}
+	
+	/* Replace whichever segment was last used the same way */
+	seg = &slots[write ? TSDB_SEGMENT_WRITE : TSDB_SEGMENT_READ];
+	tsdb_segment_close(ctx, seg, 1);
+	if (ctx->pack != NULL)
+		return tsdb_segment_open_packed(ctx, layer, column, segment, write, seg, segp);
+	TSDB_PATH(path, TSDB_SEGMENT_FORMAT, ctx->node_id, layer, column, segment);
+	DEBUG("Node %016" PRIX64 " layer %u segment path: %s\n", ctx->node_id, layer, path);
+	seg->fd = open(path, write ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+	if (seg->fd < 0) {
+		rc = -errno;
+		seg->fd = 0;
+		if (rc != -ENOENT || write)
+			ERROR("Error opening segment %s: %s\n", path, strerror(-rc));
+		return rc;
+	}
+	seg->segment = segment;
+	
+#ifdef TSDB_MMAP_TABLES
+	/* A segment being written is sized to hold all its points.  Unwritten space
+	 * doesn't occupy the disk. */
+	if (fstat(seg->fd, &st) < 0) {
+		rc = -errno;
+		ERROR("Error reading size of segment %s: %s\n", path, strerror(-rc));
+		tsdb_segment_close(ctx, seg, 0);
+		return rc;
+	}
+	if (write && (size_t)st.st_size < size) {
+		if (ftruncate(seg->fd, size) < 0) {
+			rc = -errno;
+			ERROR("Segment resize error for %s: %s\n", path, strerror(-rc));
+			tsdb_segment_close(ctx, seg, 0);
+			return rc;
+		}
+	} else {
+		size = st.st_size;
+	}
+	if (size) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+		if (map == MAP_FAILED) {
+			rc = -errno;
+			ERROR("mmap failed on segment %s: %s\n", path, strerror(-rc));
+			tsdb_segment_close(ctx, seg, 0);
+			return rc;
+		}
+		seg->map = (tsdb_data_t*)map;
+		seg->size = size;
+	}
+#endif
+found:
+	*segp = seg;
+	return 0;
+}
+
+/* Number of pages spanned by size bytes from offset */
+static inline uint64_t tsdb_page_count(uint64_t offset, uint64_t size)
+{
+	size_t page = tsdb_page_size();
+	
+	return size ? (offset + size + page - 1) / page - offset / page : 0;
+}
+
+/* Adds to the page cache statistics of a layer */
+static inline void tsdb_page_stats_add(unsigned int layer, uint64_t hits, uint64_t misses)
+{
+#ifdef TSDB_PAGE_STATS
+	__atomic_fetch_add(&g_page_stats.hits[layer], hits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&g_page_stats.misses[layer], misses, __ATOMIC_RELAXED);
+#endif
+}
+
+#ifdef TSDB_MMAP_TABLES
+/* Counts the pages of a mapped range of a layer's table that are and are not in the page
+ * cache, before the range is read */
+static void tsdb_page_stats_map(unsigned int layer, const void *addr, size_t size)
+{
+#ifdef TSDB_PAGE_STATS
+	unsigned char vec[256];
+	size_t page = tsdb_page_size(), n, i;
+	uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(page - 1), end = (uintptr_t)addr + size;
+	uint64_t hits = 0, total = 0;
+	
+	while (start < end) {
+		n = (end - start + page - 1) / page;
+		if (n > sizeof(vec))
+			n = sizeof(vec);
+		if (mincore((void*)start, n * page, vec) < 0)
+			break;
+		for (i = 0; i < n; i++)
+			hits += vec[i] & 1;
+		total += n;
+		start += n * page;
+	}
+	tsdb_page_stats_add(layer, hits, total - hits);
+#endif
+}
+#endif
+
+/* Reads from a file of a layer as pread, counting the pages that were and were not in the
+ * page cache.  The read is first tried without waiting for storage, which reads as far as
+ * the first page that is not cached.  The pages from there on count as misses. */
+static ssize_t tsdb_page_pread(unsigned int layer, int fd, void *buf, size_t size, off_t offset)
+{
+#if defined(TSDB_PAGE_STATS) && defined(RWF_NOWAIT)
+	struct iovec iov = { buf, size };
+	ssize_t cached, count;
+	
+	cached = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+	if (cached < 0) {
+		if (errno != EAGAIN)
+			return pread(fd, buf, size, offset);
+		cached = 0;
+	}
+	if ((size_t)cached == size)
+		count = 0;
+	else if ((count = pread(fd, (uint8_t*)buf + cached, size - cached, offset + cached)) < 0)
+		return count;
+	tsdb_page_stats_add(layer, tsdb_page_count(offset, cached),
+		tsdb_page_count(offset, cached + count) - tsdb_page_count(offset, cached));
+	return cached + count;
+#else
+	return pread(fd, buf, size, offset);
+#endif
+}
+
+/* Applies advice to a byte range of a table file and its mapping (if mapped), which starts
+ * at the given position in the file.  Failures are ignored, since advice only changes how
+ * fast the file is read. */
+static void tsdb_file_advise(int fd, uint64_t base, void *map, size_t map_size, uint64_t offset,
+	uint64_t length, tsdb_advice_t advice)
+{
+	static const int fadvice[] = { POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED };
+#ifdef TSDB_MMAP_TABLES
+	static const int madvice[] = { MADV_SEQUENTIAL, MADV_WILLNEED, MADV_DONTNEED };
+	
+	/* Mapped pages have to be unmapped before they can be dropped from the page cache.
+	 * Dirty pages of a shared mapping are kept until written back. */
+	if (map != NULL && offset < map_size) {
+		uint64_t start = offset & ~(uint64_t)(tsdb_page_size() - 1);
+		uint64_t end = (offset + length < map_size) ? offset + length : map_size;
+		
+		madvise((uint8_t*)map + start, end - start, madvice[advice]);
+	}
+#endif
+	posix_fadvise(fd, base + offset, length, fadvice[advice]);
+}
+
+/* Advises the kernel of how points [point, point + npoints) stored in one table file of a
+ * layer will be used.  Segments are only advised while they are open. */
+static void tsdb_storage_advise(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, uint64_t npoints, tsdb_advice_t advice)
+{
+	size_t size = TSDB_COLUMN_POINT_SIZE(ctx);
+	void *map = NULL;
+	size_t map_size = 0;
+	
+	if (npoints == 0)
+		return;
+	if (TSDB_IS_SEGMENTED(ctx)) {
+		tsdb_segment_t *seg = TSDB_SEGMENT_SLOTS(ctx, layer, column);
+		uint64_t first, end;
 		unsigned int n;
+		
+		TSDB_LOCK(&ctx->segment_lock);
+		for (n = 0; n < 2; n++, seg++) {
+			first = seg->segment * ctx->meta->segment_points;
+			end = first + ctx->meta->segment_points;
+			if (seg->fd <= 0 || first >= point + npoints || end <= point)
+				continue;
+			if (end > point + npoints)
+				end = point + npoints;
+			if (first < point)
+				first = point;
+#ifdef TSDB_MMAP_TABLES
+			map = seg->map;
+			map_size = seg->size;
+#endif
+			tsdb_file_advise(seg->fd, seg->offset, map, map_size, size * (first % ctx->meta->segment_points),
+				size * (end - first), advice);
+		}
+		TSDB_UNLOCK(&ctx->segment_lock);
+		return;
+	}
+#ifdef TSDB_MMAP_TABLES
+	map = ctx->table_map[layer][column];
+	map_size = ctx->table_size[layer][column];
+#endif
+	tsdb_file_advise(ctx->table_fd[layer][column], 0, map, map_size, size * point, size * npoints, advice);
+}
+
+/* Reads npoints points from one table of a segmented layer.  Points in segments that
+ * have never been written, or beyond the end of those that have, are unknown. */
+static int tsdb_segment_read(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int npoints, tsdb_data_t *buf)
+{
+	unsigned int width = TSDB_COLUMN_WIDTH(ctx), n, count;
+	uint64_t offset;
+	tsdb_segment_t *seg;
+	int rc = 0;
+	
+	TSDB_LOCK(&ctx->segment_lock);
+	while (npoints) {
+		offset = point % ctx->meta->segment_points;
+		n = (npoints < ctx->meta->segment_points - offset) ? npoints : (unsigned int)(ctx->meta->segment_points - offset);
+		count = 0;
+		rc = tsdb_segment_open(ctx, layer, column, point, 0, &seg);
+		if (rc == 0) {
+#ifdef TSDB_MMAP_TABLES
+			uint64_t available = seg->size / TSDB_COLUMN_POINT_SIZE(ctx);
+			
+			if (offset < available) {
+				count = (n < available - offset) ? n : (unsigned int)(available - offset);
+				tsdb_page_stats_map(layer, seg->map + offset * width, TSDB_COLUMN_POINT_SIZE(ctx) * count);
+				memcpy(buf, seg->map + offset * width, TSDB_COLUMN_POINT_SIZE(ctx) * count);
+			}
+#else
+			ssize_t size = tsdb_page_pread(layer, seg->fd, buf, TSDB_COLUMN_POINT_SIZE(ctx) * n,
+				seg->offset + TSDB_COLUMN_POINT_SIZE(ctx) * offset);
+			
+			if (size < 0) {
+				rc = -errno;
+				ERROR("Segment read error for point %" PRIu64 ": %s\n", point, strerror(-rc));
+				break;
+			}
+			count = size / TSDB_COLUMN_POINT_SIZE(ctx);
+#endif
+		} else if (rc == -ENOENT) {
+			rc = 0;
+		} else {
+			break;
+		}
+		for (count *= width; count < n * width; count++) {
+			buf[count] = NAN;
+		}
+		buf += n * width;
+		point += n;
+		npoints -= n;
+	}
+	TSDB_UNLOCK(&ctx->segment_lock);
+	return rc;
+}
+
+/* Writes npoints points to one table of a segmented layer, creating segments as needed */
+static int tsdb_segment_write(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int npoints, const tsdb_data_t *values)
+{
+	unsigned int width = TSDB_COLUMN_WIDTH(ctx), n;
+	uint64_t offset;
+	tsdb_segment_t *seg;
+	int rc = 0;
+	
+	TSDB_LOCK(&ctx->segment_lock);
+	while (npoints) {
+		offset = point % ctx->meta->segment_points;
+		n = (npoints < ctx->meta->segment_points - offset) ? npoints : (unsigned int)(ctx->meta->segment_points - offset);
+		if ((rc = tsdb_segment_open(ctx, layer, column, point, 1, &seg)) < 0)
+			break;
+#ifdef TSDB_MMAP_TABLES
+		memcpy(seg->map + offset * width, values, TSDB_COLUMN_POINT_SIZE(ctx) * n);
+#else
+		if (pwrite(seg->fd, values, TSDB_COLUMN_POINT_SIZE(ctx) * n,
+				seg->offset + TSDB_COLUMN_POINT_SIZE(ctx) * offset) < 0) {
+			rc = -errno;
+			ERROR("Segment write error for point %" PRIu64 ": %s\n", point, strerror(-rc));
+			break;
+		}
+#endif
+		seg->written = 1;
+		values += n * width;
+		point += n;
+		npoints -= n;
+	}
+	TSDB_UNLOCK(&ctx->segment_lock);
+	return rc;
+}
+
+/* Returns a pointer to up to *npoints points stored from the given position of one table
+ * file of a layer.  In mmap mode this points directly into the mapped table, otherwise the
+ * points are read into the supplied buffer.  *npoints is reduced if fewer points are
+ * available. */
+static const tsdb_data_t* tsdb_storage_get(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int *npoints, tsdb_data_t *buf)
+{
+	if (TSDB_IS_SEGMENTED(ctx)) {
+		int rc = tsdb_segment_read(ctx, layer, column, point, *npoints, buf);
+		
+		if (rc < 0) {
+			errno = -rc;
+			return NULL;
+		}
+		return buf;
+	}
+	
+#ifdef TSDB_MMAP_TABLES
+	uint64_t available = ctx->table_size[layer][column] / TSDB_COLUMN_POINT_SIZE(ctx);
+	
+	if (point >= available) {
+		*npoints = 0;
+		return buf;
+	}
+	if (*npoints > available - point)
+		*npoints = available - point;
+	tsdb_page_stats_map(layer, ctx->table_map[layer][column] + point * TSDB_COLUMN_WIDTH(ctx),
+		TSDB_COLUMN_POINT_SIZE(ctx) * *npoints);
+	return ctx->table_map[layer][column] + point * TSDB_COLUMN_WIDTH(ctx);
+#else
+	ssize_t count;
+	
+	count = tsdb_page_pread(layer, ctx->table_fd[layer][column], buf, TSDB_COLUMN_POINT_SIZE(ctx) * *npoints,
+		TSDB_COLUMN_POINT_SIZE(ctx) * point);
+	if (count < 0) {
+		ERROR("Table read error for point %" PRIu64 ": %s\n", point, strerror(errno));
+		return NULL;
+	}
+	*npoints = count / TSDB_COLUMN_POINT_SIZE(ctx);
+	return buf;
+#endif
+}
+
+/* Writes npoints points to one table file of a layer at the given position, extending it
+ * if necessary */
+static int tsdb_storage_write(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int npoints, const tsdb_data_t *values)
+{
+	if (TSDB_IS_SEGMENTED(ctx))
+		return tsdb_segment_write(ctx, layer, column, point, npoints, values);
+	
+#ifdef TSDB_MMAP_TABLES
+	int rc;
+	
+	if ((rc = tsdb_column_grow(ctx, layer, column, point + npoints)) < 0)
+		return rc;
+	memcpy(ctx->table_map[layer][column] + point * TSDB_COLUMN_WIDTH(ctx), values,
+		TSDB_COLUMN_POINT_SIZE(ctx) * npoints);
+#else
+	if (pwrite(ctx->table_fd[layer][column], values, TSDB_COLUMN_POINT_SIZE(ctx) * npoints,
+			TSDB_COLUMN_POINT_SIZE(ctx) * point) < 0) {
+		ERROR("Table write error writing values for point %" PRIu64 "\n", point);
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+/* Returns a pointer to up to *npoints points from one table file of a layer, as for
+ * tsdb_storage_get.  Points that are no longer held read as unknown values.  Wrapping
+ * layers are read from each point's position in the ring.  The supplied buffer is
+ * needed unless a single run of current points is read from a mapped table. */
+static const tsdb_data_t* tsdb_column_get(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int *npoints, tsdb_data_t *buf)
+{
+	uint64_t capacity = ctx->meta->capacity[layer], end = ctx->meta->ring_end[layer];
+	uint64_t first = tsdb_layer_first(ctx, layer), pos;
+	unsigned int width = TSDB_COLUMN_WIDTH(ctx), remaining, n, count;
+	const tsdb_data_t *ptr;
+	tsdb_data_t *out = buf;
+	
+	if (!TSDB_IS_RING(ctx, layer) && point >= first)
+		return tsdb_storage_get(ctx, layer, column, point, npoints, buf);
+	
+	if (TSDB_IS_RING(ctx, layer)) {
+		/* Nothing has been written beyond the end */
+		if (point >= end) {
+			*npoints = 0;
+			return buf;
+		}
+		if (*npoints > end - point)
+			*npoints = end - point;
+		if (point >= first && point % capacity + *npoints <= capacity) {
+			count = *npoints;
+			ptr = tsdb_storage_get(ctx, layer, column, point % capacity, &count, buf);
+			if (ptr == NULL || count == *npoints)
+				return ptr;
+			if (ptr != buf)
+				memcpy(buf, ptr, TSDB_COLUMN_POINT_SIZE(ctx) * count);
+			for (count *= width; count < *npoints * width; count++) {
+				buf[count] = NAN;
+			}
+			return buf;
+		}
+	}
+	
+	for (remaining = *npoints; remaining; remaining -= n) {
+		if (point < first) {
+			n = (remaining < first - point) ? remaining : (unsigned int)(first - point);
+			count = 0;
+		} else {
+			/* Stop at the end of a ring */
+			n = remaining;
+			pos = point;
+			if (TSDB_IS_RING(ctx, layer)) {
+				pos = point % capacity;
+				if (n > capacity - pos)
+					n = capacity - pos;
+			}
+			count = n;
+			ptr = tsdb_storage_get(ctx, layer, column, pos, &count, out);
+			if (ptr == NULL)
+				return NULL;
+			if (ptr != out)
+				memcpy(out, ptr, TSDB_COLUMN_POINT_SIZE(ctx) * count);
+			if (count < n && !TSDB_IS_RING(ctx, layer)) {
+				/* End of the table */
+				*npoints -= remaining - count;
+				break;
+			}
+		}
+		for (count *= width; count < n * width; count++) {
+			out[count] = NAN;
+		}
+		out += n * width;
+		point += n;
+	}
+	return buf;
+}
+
+/* Writes npoints points to one table file of a layer, extending it if necessary.  Points
+ * that are no longer held, including those of a write to a wrapping layer that the rest
+ * of the write overwrites, are skipped.  Wrapping layers are written at each point's
+ * position in the ring. */
+static int tsdb_column_write(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, unsigned int npoints, const tsdb_data_t *values)
+{
+	uint64_t capacity = ctx->meta->capacity[layer], first, skip, pos;
+	unsigned int n;
+	int rc;
+	
+	if (!TSDB_IS_RING(ctx, layer) && point >= ctx->meta->base[layer])
+		return tsdb_storage_write(ctx, layer, column, point, npoints, values);
+	
+	if (TSDB_IS_RING(ctx, layer) && point + npoints > ctx->meta->ring_end[layer])
+		ctx->meta->ring_end[layer] = point + npoints;
+	first = tsdb_layer_first(ctx, layer);
+	if (point < first) {
+		skip = first - point;
+		if (skip >= npoints)
+			return 0;
+		values += skip * TSDB_COLUMN_WIDTH(ctx);
+		point += skip;
+		npoints -= skip;
+	}
+	while (npoints) {
+		n = npoints;
+		pos = point;
+		if (TSDB_IS_RING(ctx, layer)) {
+			pos = point % capacity;
+			if (n > capacity - pos)
+				n = capacity - pos;
+		}
+		if ((rc = tsdb_storage_write(ctx, layer, column, pos, n, values)) < 0)
+			return rc;
+		values += n * TSDB_COLUMN_WIDTH(ctx);
+		point += n;
+		npoints -= n;
+	}
+	return 0;
+}
+
+/* Advises the kernel of how points [point, point + npoints) of one table file of a layer
+ * will be used, as for tsdb_storage_advise.  Only points still held are advised, at their
+ * positions in the ring if the layer wraps. */
+static void tsdb_column_advise(tsdb_ctx_t *ctx, unsigned int layer, unsigned int column,
+	uint64_t point, uint64_t npoints, tsdb_advice_t advice)
+{
+	uint64_t capacity = ctx->meta->capacity[layer], first = tsdb_layer_first(ctx, layer);
+	uint64_t end = point + npoints, pos, n;
+	
+	if (point < first)
+		point = first;
+	if (!TSDB_IS_RING(ctx, layer)) {
+		if (point < end)
+			tsdb_storage_advise(ctx, layer, column, point, end - point, advice);
+		return;
+	}
+	if (end > ctx->meta->ring_end[layer])
+		end = ctx->meta->ring_end[layer];
+	if (point >= end)
+		return;
+	pos = point % capacity;
+	n = (end - point < capacity - pos) ? end - point : capacity - pos;
+	tsdb_storage_advise(ctx, layer, column, pos, n, advice);
+	if (end - point > n)
+		tsdb_storage_advise(ctx, layer, column, 0, end - point - n, advice);
+}
+
+/* First point of the tail of a layer (see TSDB_TAIL_SIZE) */
+static uint64_t tsdb_layer_tail(tsdb_ctx_t *ctx, unsigned int layer)
+{
+	uint64_t npoints = tsdb_layer_npoints(ctx, layer, ctx->meta->npoints);
+	uint64_t tail = TSDB_TAIL_SIZE / TSDB_COLUMN_POINT_SIZE(ctx);
+	
+	return (npoints > tail) ? npoints - tail : 0;
+}
+
+/* Replaces any values in sparse gaps with unknown values.  ptr points to npoints points of
+ * width values each, which are copied to buf first if any need replacing. */
+static const tsdb_data_t* tsdb_gap_mask(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int npoints, const tsdb_data_t *ptr, tsdb_data_t *buf, unsigned int width)
+{
+	const tsdb_gap_t *gap = ctx->meta->gaps[layer];
+	uint64_t first, last, n;
+	unsigned int g;
+	
+	for (g = 0; g < ctx->meta->ngaps[layer]; g++, gap++) {
+		first = (gap->start > point) ? gap->start : point;
+		last = (gap->end < point + npoints) ? gap->end : point + npoints;
+		if (first >= last)
+			continue;
+		if (ptr != buf) {
+			memcpy(buf, ptr, sizeof(tsdb_data_t) * width * npoints);
+			ptr = buf;
+		}
+		for (n = (first - point) * width; n < (last - point) * width; n++) {
+			buf[n] = NAN;
+		}
+	}
+	return ptr;
+}
+
+/* Sequential bit-level access to an encoded block stream */
+typedef struct {
+	uint8_t		*buf;
+	size_t		pos;		/*< Position in bits */
+	size_t		size;		/*< Size in bits (reader only) */
+} tsdb_bitstream_t;
+
+/* Value bit patterns for XOR encoding */
+#ifdef TSDB_DOUBLE_TYPE
+typedef uint64_t tsdb_bits_t;
+#define TSDB_VALUE_BITS		64
+#define TSDB_LEADING_BITS	6
+#define TSDB_CLZ(x)		__builtin_clzll(x)
+#define TSDB_CTZ(x)		__builtin_ctzll(x)
+#else
+typedef uint32_t tsdb_bits_t;
+#define TSDB_VALUE_BITS		32
+#define TSDB_LEADING_BITS	5
+#define TSDB_CLZ(x)		__builtin_clz(x)
+#define TSDB_CTZ(x)		__builtin_ctz(x)
+#endif
+
+/* Worst case encoded size of a block (bytes): offset table plus each value as a
+ * control code, new window and the full value */
+#define TSDB_BLOCK_MAX_SIZE(ctx)	((ctx)->meta->nmetrics * (sizeof(uint32_t) + \
+	(TSDB_BLOCK_POINTS * (2 + 2 * TSDB_LEADING_BITS + TSDB_VALUE_BITS) + 7) / 8))
+
+static inline void tsdb_bits_put(tsdb_bitstream_t *bs, tsdb_bits_t value, unsigned int nbits)
+{
+	unsigned int used, n;
+	
+	while (nbits) {
+		used = bs->pos & 7;
+		n = (nbits < 8 - used) ? nbits : 8 - used;
+		if (used == 0)
+			bs->buf[bs->pos >> 3] = 0;
+		bs->buf[bs->pos >> 3] |= (uint8_t)(((value >> (nbits - n)) & ((1u << n) - 1)) << (8 - used - n));
+		bs->pos += n;
+		nbits -= n;
+	}
+}
+
+static inline tsdb_bits_t tsdb_bits_get(tsdb_bitstream_t *bs, unsigned int nbits)
+{
+	tsdb_bits_t value = 0;
+	unsigned int used, n;
+	
+	if (bs->pos + nbits > bs->size) {
+		/* Truncated stream - treat as zeros */
+		bs->pos = bs->size;
+		return 0;
+	}
+	while (nbits) {
+		used = bs->pos & 7;
+		n = (nbits < 8 - used) ? nbits : 8 - used;
+		value = (value << n) | ((bs->buf[bs->pos >> 3] >> (8 - used - n)) & ((1u << n) - 1));
+		bs->pos += n;
+		nbits -= n;
+	}
+	return value;
+}
+
+/* Encodes a block of TSDB_BLOCK_POINTS rows.  Each metric is XOR-encoded against the
+ * previous value as its own byte-aligned stream, located through an offset table at the
+ * start of the block.  Identical values (including runs of unknown values) cost one bit.
+ * Returns the encoded size in bytes. */
+static size_t tsdb_block_encode(tsdb_ctx_t *ctx, const tsdb_data_t *rows, uint8_t *out)
+{
+	tsdb_bitstream_t bs;
+	tsdb_bits_t prev, cur, xor;
+	unsigned int metric, n, lead, trail, prev_lead, prev_trail, sig;
+	uint32_t offset;
+	
+	bs.buf = out;
+	bs.pos = sizeof(uint32_t) * ctx->meta->nmetrics * 8;
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		offset = (uint32_t)(bs.pos >> 3);
+		memcpy(out + sizeof(uint32_t) * metric, &offset, sizeof(uint32_t));
+		
+		memcpy(&prev, &rows[metric], sizeof(tsdb_bits_t));
+		tsdb_bits_put(&bs, prev, TSDB_VALUE_BITS);
+		prev_lead = TSDB_VALUE_BITS;
+		prev_trail = 0;
+		for (n = 1; n < TSDB_BLOCK_POINTS; n++) {
+			memcpy(&cur, &rows[n * ctx->meta->nmetrics + metric], sizeof(tsdb_bits_t));
+			xor = cur ^ prev;
+			prev = cur;
+			if (xor == 0) {
+				tsdb_bits_put(&bs, 0, 1);
+				continue;
+			}
+			lead = TSDB_CLZ(xor);
+			trail = TSDB_CTZ(xor);
+			if (lead >= (1u << TSDB_LEADING_BITS))
+				lead = (1u << TSDB_LEADING_BITS) - 1;
+			if (prev_lead + prev_trail < TSDB_VALUE_BITS && lead >= prev_lead && trail >= prev_trail) {
+				/* Meaningful bits fit the previous window */
+				tsdb_bits_put(&bs, 2, 2);
+				tsdb_bits_put(&bs, xor >> prev_trail, TSDB_VALUE_BITS - prev_lead - prev_trail);
+			} else {
+				/* New window */
+				sig = TSDB_VALUE_BITS - lead - trail;
+				tsdb_bits_put(&bs, 3, 2);
+				tsdb_bits_put(&bs, lead, TSDB_LEADING_BITS);
+				tsdb_bits_put(&bs, sig - 1, TSDB_LEADING_BITS);
+				tsdb_bits_put(&bs, xor >> trail, sig);
+				prev_lead = lead;
+				prev_trail = trail;
+			}
+		}
+		
+		/* Byte align the next stream */
+		bs.pos = (bs.pos + 7) & ~(size_t)7;
+	}
+	return bs.pos >> 3;
+}
+
+/* Decodes points first..first+npoints-1 of a block into rows.  If metric is negative all
+ * metrics are decoded, otherwise only that one. */
+static void tsdb_block_decode(tsdb_ctx_t *ctx, const uint8_t *block, size_t size,
+	unsigned int first, unsigned int npoints, tsdb_data_t *rows, int metric)
+{
+	tsdb_bitstream_t bs;
+	tsdb_bits_t value, xor;
+	unsigned int m, n, lead, trail, sig;
+	uint32_t offset;
+	
+	bs.buf = (uint8_t*)block;
+	bs.size = size * 8;
+	for (m = (metric < 0) ? 0 : (unsigned int)metric; m < (unsigned int)ctx->meta->nmetrics; m++) {
+		memcpy(&offset, block + sizeof(uint32_t) * m, sizeof(uint32_t));
+		bs.pos = (size_t)offset * 8;
+		lead = trail = 0;
+		
+		value = tsdb_bits_get(&bs, TSDB_VALUE_BITS);
+		for (n = 0; n < first + npoints; n++) {
+			if (n > 0 && tsdb_bits_get(&bs, 1)) {
+				if (tsdb_bits_get(&bs, 1)) {
+					lead = tsdb_bits_get(&bs, TSDB_LEADING_BITS);
+					sig = tsdb_bits_get(&bs, TSDB_LEADING_BITS) + 1;
+					trail = (lead + sig > TSDB_VALUE_BITS) ? 0 : TSDB_VALUE_BITS - lead - sig;
+				}
+				xor = tsdb_bits_get(&bs, TSDB_VALUE_BITS - lead - trail);
+				value ^= xor << trail;
+			}
+			if (n >= first)
+				memcpy(&rows[(n - first) * ctx->meta->nmetrics + m], &value, sizeof(tsdb_data_t));
+		}
+		if (metric >= 0)
+			break;
+	}
+}
+
+/* Reads points first..first+npoints-1 of a compressed block into rows.  If metric is
+ * negative all metrics are read, otherwise only that one. */
+static int tsdb_block_read(tsdb_ctx_t *ctx, unsigned int layer, uint64_t block,
+	unsigned int first, unsigned int npoints, tsdb_data_t *rows, int metric)
+{
+	tsdb_block_index_t index;
+	uint8_t *data;
+	unsigned int m, n;
+	
+	memset(&index, 0, sizeof(index));
+	if (pread(ctx->index_fd[layer], &index, sizeof(index), sizeof(index) * block) < 0) {
+		ERROR("Block index read error for block %" PRIu64 ": %s\n", block, strerror(errno));
+		return -errno;
+	}
+	if (index.length == 0) {
+		/* Never written (or short read of a sparse index) */
+		for (n = 0; n < npoints; n++) {
+			for (m = 0; m < (unsigned int)ctx->meta->nmetrics; m++) {
+				rows[n * ctx->meta->nmetrics + m] = NAN;
+			}
+		}
+		return 0;
+	}
+	
+	data = (uint8_t*)malloc(index.length);
+	if (data == NULL) {
+		CRITICAL("Out of memory\n");
+		return -ENOMEM;
+	}
+	if (tsdb_page_pread(layer, ctx->block_fd[layer], data, index.length, index.offset) != (ssize_t)index.length) {
+		ERROR("Block read error for block %" PRIu64 "\n", block);
+		free(data);
+		return -EIO;
+	}
+	tsdb_block_decode(ctx, data, index.length, first, npoints, rows, metric);
+	free(data);
+	return 0;
+}
+
+/* Encodes a block of rows and stores it in the layer's block store, in place if it
+ * fits where the previous version was, otherwise at the end.  Space released by a
+ * block that grows is not reused. */
+static int tsdb_block_store(tsdb_ctx_t *ctx, unsigned int layer, uint64_t block, const tsdb_data_t *rows)
+{
+	tsdb_block_index_t index;
+	uint8_t *data;
+	size_t length;
+	
+	data = (uint8_t*)malloc(TSDB_BLOCK_MAX_SIZE(ctx));
+	if (data == NULL) {
+		CRITICAL("Out of memory\n");
+		return -ENOMEM;
+	}
+	length = tsdb_block_encode(ctx, rows, data);
+	DEBUG("Layer %u block %" PRIu64 " encoded in %zu bytes\n", layer, block, length);
+	
+	if (pread(ctx->index_fd[layer], &index, sizeof(index), sizeof(index) * block) != (ssize_t)sizeof(index) ||
+		index.length < length) {
+		index.offset = ctx->block_end[layer];
+		ctx->block_end[layer] += length;
+	}
+	index.length = (uint32_t)length;
+	index.reserved = 0;
+	if (pwrite(ctx->block_fd[layer], data, length, index.offset) != (ssize_t)length ||
+		pwrite(ctx->index_fd[layer], &index, sizeof(index), sizeof(index) * block) != (ssize_t)sizeof(index)) {
+		ERROR("Block write error for block %" PRIu64 ": %s\n", block, strerror(errno));
+		free(data);
+		return -EIO;
+	}
+	free(data);
+	return 0;
+}
+
+/* Compresses the complete blocks of a layer that precede the given (tail) block.  Blocks
+ * lying entirely within a sparse gap are left unwritten. */
+static int tsdb_block_seal(tsdb_ctx_t *ctx, unsigned int layer, uint64_t tail_block)
+{
+	uint64_t block, first_point;
+	const tsdb_data_t *ptr;
+	tsdb_data_t *rows;
+	unsigned int g, n;
+	int rc = 0;
+	
+	if (ctx->meta->nsealed[layer] >= tail_block)
+		return 0;
+	rows = (tsdb_data_t*)malloc(TSDB_ROW_SIZE(ctx) * TSDB_BLOCK_POINTS);
+	if (rows == NULL) {
+		CRITICAL("Out of memory\n");
+		return -ENOMEM;
+	}
+	
+	while ((block = ctx->meta->nsealed[layer]) < tail_block) {
+		first_point = block * TSDB_BLOCK_POINTS;
+		for (g = 0; g < ctx->meta->ngaps[layer]; g++) {
+			if (ctx->meta->gaps[layer][g].start <= first_point &&
+				ctx->meta->gaps[layer][g].end >= first_point + TSDB_BLOCK_POINTS)
+				break;
+		}
+		if (g < ctx->meta->ngaps[layer]) {
+			/* Skip to the block containing the end of the gap */
+			block = ctx->meta->gaps[layer][g].end / TSDB_BLOCK_POINTS;
+			ctx->meta->nsealed[layer] = (block < tail_block) ? block : tail_block;
+			continue;
+		}
+		
+		/* Fetch the raw block, with any gaps as unknown values */
+		n = TSDB_BLOCK_POINTS;
+		ptr = tsdb_column_get(ctx, layer, 0, first_point, &n, rows);
+		if (ptr == NULL) {
+			rc = -errno;
+			break;
+		}
+		ptr = tsdb_gap_mask(ctx, layer, first_point, n, ptr, rows, ctx->meta->nmetrics);
+		if (ptr != rows)
+			memcpy(rows, ptr, TSDB_ROW_SIZE(ctx) * n);
+		for (n *= ctx->meta->nmetrics; n < TSDB_BLOCK_POINTS * ctx->meta->nmetrics; n++) {
+			rows[n] = NAN;
+		}
+		
+		if ((rc = tsdb_block_store(ctx, layer, block, rows)) < 0)
+			break;
+		ctx->meta->nsealed[layer] = block + 1;
+		
+#ifdef FALLOC_FL_PUNCH_HOLE
+		/* Release the raw copy */
+		fallocate(ctx->table_fd[layer][0], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			TSDB_ROW_SIZE(ctx) * first_point, TSDB_ROW_SIZE(ctx) * TSDB_BLOCK_POINTS);
+#endif
+	}
+	free(rows);
+	return rc;
+}
+
+/* Returns up to *npoints complete points from a compressed layer, decoding any that are
+ * in compressed blocks.  If metric is not negative only that metric is valid in the
+ * returned rows. */
+static const tsdb_data_t* tsdb_block_get(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int *npoints, tsdb_data_t *buf, int metric)
+{
+	uint64_t sealed_end = (uint64_t)ctx->meta->nsealed[layer] * TSDB_BLOCK_POINTS;
+	const tsdb_data_t *ptr;
+	unsigned int count, remaining = *npoints;
+	tsdb_data_t *out = buf;
+	int rc;
+	
+	while (remaining && point < sealed_end) {
+		count = TSDB_BLOCK_POINTS - point % TSDB_BLOCK_POINTS;
+		if (count > remaining)
+			count = remaining;
+		if ((rc = tsdb_block_read(ctx, layer, point / TSDB_BLOCK_POINTS, point % TSDB_BLOCK_POINTS,
+				count, out, metric)) < 0) {
+			errno = -rc;
+			return NULL;
+		}
+		point += count;
+		out += count * ctx->meta->nmetrics;
+		remaining -= count;
+	}
+	if (remaining) {
+		/* Uncompressed tail */
+		count = remaining;
+		ptr = tsdb_column_get(ctx, layer, 0, point, &count, out);
+		if (ptr == NULL)
+			return NULL;
+		if (ptr != out)
+			memcpy(out, ptr, TSDB_ROW_SIZE(ctx) * count);
+		remaining -= count;
+	}
+	*npoints -= remaining;
+	return buf;
+}
+
+/* Writes npoints complete points to a compressed layer.  Points in compressed blocks are
+ * updated by re-encoding the block, and any blocks completed by the write are sealed. */
+static int tsdb_block_write(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int npoints, const tsdb_data_t *values)
+{
+	uint64_t sealed_end = (uint64_t)ctx->meta->nsealed[layer] * TSDB_BLOCK_POINTS;
+	uint64_t block;
+	unsigned int count;
+	tsdb_data_t *rows;
+	int rc = 0;
+	
+	if (point < sealed_end) {
+		rows = (tsdb_data_t*)malloc(TSDB_ROW_SIZE(ctx) * TSDB_BLOCK_POINTS);
+		if (rows == NULL) {
+			CRITICAL("Out of memory\n");
+			return -ENOMEM;
+		}
+		while (npoints && point < sealed_end) {
+			block = point / TSDB_BLOCK_POINTS;
+			count = TSDB_BLOCK_POINTS - point % TSDB_BLOCK_POINTS;
+			if (count > npoints)
+				count = npoints;
+			DEBUG("Updating %u points in compressed block %" PRIu64 "\n", count, block);
+			if ((rc = tsdb_block_read(ctx, layer, block, 0, TSDB_BLOCK_POINTS, rows, -1)) < 0)
+				break;
+			memcpy(rows + (point % TSDB_BLOCK_POINTS) * ctx->meta->nmetrics, values,
+				TSDB_ROW_SIZE(ctx) * count);
+			if ((rc = tsdb_block_store(ctx, layer, block, rows)) < 0)
+				break;
+			point += count;
+			values += count * ctx->meta->nmetrics;
+			npoints -= count;
+		}
+		free(rows);
+		if (rc < 0)
+			return rc;
+	}
+	if (npoints) {
+		if ((rc = tsdb_column_write(ctx, layer, 0, point, npoints, values)) < 0)
+			return rc;
+		rc = tsdb_block_seal(ctx, layer, (point + npoints - 1) / TSDB_BLOCK_POINTS);
+	}
+	return rc;
+}
 
-		DEBUG("Padding %" PRIuFAST32 " points\n", npadding);
+/* Writes unknown values to the points between first_point and last_point (exclusive) */
+static int tsdb_table_fill(tsdb_ctx_t *ctx, unsigned int layer, uint64_t first_point,
+	uint64_t last_point)
+{
+	uint64_t npadding;
+	unsigned int column;
+	tsdb_data_t *ptr;
+	int rc;
+	
+	/* Only the points that will still be held by a ring are written */
+	if (TSDB_IS_RING(ctx, layer) && last_point - first_point > ctx->meta->capacity[layer])
+		first_point = last_point - ctx->meta->capacity[layer];
+	npadding = last_point - first_point;
+	
+#ifdef TSDB_MMAP_TABLES
+	if (!TSDB_IS_COMPRESSED(ctx) && !TSDB_IS_SEGMENTED(ctx) && !TSDB_IS_LIMITED(ctx, layer)) {
+		/* Pad in place */
+		for (column = 0; column < TSDB_NCOLUMNS(ctx); column++) {
+			uint64_t n;
+			
+			if ((rc = tsdb_column_grow(ctx, layer, column, last_point)) < 0)
+				return rc;
+			ptr = ctx->table_map[layer][column] + first_point * TSDB_COLUMN_WIDTH(ctx);
+			for (n = npadding * TSDB_COLUMN_WIDTH(ctx); n; n--) {
+				*ptr++ = NAN;
+			}
+		}
+		return 0;
+	}
+#endif
+	{
+		unsigned int pointsperblock = TSDB_MAX_PADDING_BLOCK / TSDB_COLUMN_POINT_SIZE(ctx);
+		unsigned int n;
+		uint64_t point, remaining;
+		tsdb_data_t *padding;
+		
+		/* Padding buffer is only needed while filling a gap */
+		padding = malloc(TSDB_MAX_PADDING_BLOCK);
+		if (padding == NULL) {
+			CRITICAL("Out of memory\n");
+			return -ENOMEM;
+		}
 		
 		/* Fill padding block buffer */
 		if (npadding < pointsperblock)
 			pointsperblock = npadding;
-		ptr = ctx->padding;
-		for (n = 0; n < pointsperblock; n++) {
-			for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++, ptr++) {
-				switch ((tsdb_pad_mode_t)((ctx->meta->flags[metric] >> TSDB_PAD_SHIFT) & TSDB_PAD_MASK)) {
-					case tsdbPad_Unknown:
-						*ptr = NAN;
-						break;
- 					case tsdbPad_Last:
-						DEBUG("FIXME: tsdbPad_Last not implemented\n"); 
-						*ptr = NAN; // FIXME:
-						break;
-					default:
-						ERROR("Bad padding mode\n");
+		ptr = padding;
+		for (n = 0; n < pointsperblock * TSDB_COLUMN_WIDTH(ctx); n++) {
+			*ptr++ = NAN;
+		}
+		
+		/* Write blocks to each table file */
+		for (column = 0; column < TSDB_NCOLUMNS(ctx); column++) {
+			point = first_point;
+			remaining = npadding;
+			do {
+				n = (remaining < pointsperblock) ? remaining : pointsperblock;
+				DEBUG("%u points of %" PRIu64 "\n", n, remaining);
+				if (TSDB_IS_COMPRESSED(ctx)) {
+					rc = tsdb_block_write(ctx, layer, point, n, padding);
+				} else {
+					rc = tsdb_column_write(ctx, layer, column, point, n, padding);
+				}
+				if (rc < 0) {
+					ERROR("Padding write error\n");
+					free(padding);
+					return rc;
 				}
+				point += n;
+				remaining -= n;
+			} while (remaining);
+		}
+		free(padding);
+	}
+	return 0;
+}
+
+/* Removes the points about to be written from any sparse gaps in a layer.  Splitting a
+ * gap when there is no room to record another fills the smaller part instead. */
+static int tsdb_gap_clear(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point, unsigned int npoints)
+{
+	tsdb_gap_t *gaps = ctx->meta->gaps[layer];
+	uint64_t end = point + npoints;
+	unsigned int g = 0;
+	int rc;
+	
+	while (g < ctx->meta->ngaps[layer]) {
+		if (end <= gaps[g].start || point >= gaps[g].end) {
+			/* No overlap */
+			g++;
+			continue;
+		}
+		DEBUG("Write to layer %u overlaps gap %" PRIu64 "-%" PRIu64 "\n", layer, gaps[g].start, gaps[g].end);
+		if (point <= gaps[g].start && end >= gaps[g].end) {
+			/* Gap completely filled - replace with the last one */
+			gaps[g] = gaps[--ctx->meta->ngaps[layer]];
+			continue;
+		}
+		if (point <= gaps[g].start) {
+			gaps[g].start = end;
+		} else if (end >= gaps[g].end) {
+			gaps[g].end = point;
+		} else if (ctx->meta->ngaps[layer] < TSDB_MAX_GAPS) {
+			/* Split */
+			gaps[ctx->meta->ngaps[layer]].start = end;
+			gaps[ctx->meta->ngaps[layer]].end = gaps[g].end;
+			ctx->meta->ngaps[layer]++;
+			gaps[g].end = point;
+		} else if (point - gaps[g].start < gaps[g].end - end) {
+			if ((rc = tsdb_table_fill(ctx, layer, gaps[g].start, point)) < 0)
+				return rc;
+			gaps[g].start = end;
+		} else {
+			if ((rc = tsdb_table_fill(ctx, layer, end, gaps[g].end)) < 0)
+				return rc;
+			gaps[g].end = point;
+		}
+		g++;
+	}
+	return 0;
+}
+
+/* Returns a pointer to up to *npoints complete points (all metrics) from a layer.  For
+ * the columnar layout the points are always assembled in the supplied buffer. */
+static const tsdb_data_t* tsdb_table_get(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int *npoints, tsdb_data_t *buf)
+{
+	const tsdb_data_t *ptr;
+	tsdb_data_t *column = NULL;
+	unsigned int metric, n, count;
+	
+	if (!TSDB_IS_COLUMNAR(ctx)) {
+		if (TSDB_IS_COMPRESSED(ctx)) {
+			ptr = tsdb_block_get(ctx, layer, point, npoints, buf, -1);
+		} else {
+			ptr = tsdb_column_get(ctx, layer, 0, point, npoints, buf);
+		}
+		if (ptr == NULL)
+			return NULL;
+		return tsdb_gap_mask(ctx, layer, point, *npoints, ptr, buf, ctx->meta->nmetrics);
+	}
+	if (*npoints == 0)
+		return buf;
+	
+#ifdef TSDB_MMAP_TABLES
+	if (TSDB_IS_SEGMENTED(ctx) || TSDB_IS_LIMITED(ctx, layer))
+#endif
+	{
+		column = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * *npoints);
+		if (column == NULL) {
+			CRITICAL("Out of memory\n");
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		count = *npoints;
+		ptr = tsdb_column_get(ctx, layer, metric, point, &count, column);
+		if (ptr == NULL) {
+			free(column);
+			return NULL;
+		}
+		if (count < *npoints)
+			*npoints = count;
+		for (n = 0; n < *npoints; n++) {
+			buf[n * ctx->meta->nmetrics + metric] = ptr[n];
+		}
+	}
+	free(column);
+	return tsdb_gap_mask(ctx, layer, point, *npoints, buf, buf, ctx->meta->nmetrics);
+}
+
+/* Returns a pointer to the values of a single metric for up to *npoints points of a layer.
+ * Successive values are *stride apart.  buf must have room for *npoints complete points. */
+static const tsdb_data_t* tsdb_table_get_metric(tsdb_ctx_t *ctx, unsigned int layer, unsigned int metric,
+	uint64_t point, unsigned int *npoints, tsdb_data_t *buf, unsigned int *stride)
+{
+	const tsdb_data_t *ptr;
+	
+	if (TSDB_IS_COLUMNAR(ctx)) {
+		*stride = 1;
+		ptr = tsdb_column_get(ctx, layer, metric, point, npoints, buf);
+		if (ptr == NULL)
+			return NULL;
+		return tsdb_gap_mask(ctx, layer, point, *npoints, ptr, buf, 1);
+	}
+	*stride = ctx->meta->nmetrics;
+	if (TSDB_IS_COMPRESSED(ctx)) {
+		ptr = tsdb_block_get(ctx, layer, point, npoints, buf, (int)metric);
+	} else {
+		ptr = tsdb_column_get(ctx, layer, 0, point, npoints, buf);
+	}
+	if (ptr == NULL)
+		return NULL;
+	return tsdb_gap_mask(ctx, layer, point, *npoints, ptr, buf, ctx->meta->nmetrics) + metric;
+}
+
+/* Reads up to npoints points from a table.  Returns the number of points read, which
+ * may be fewer than requested at the end of the table, or a negative error code. */
+static int tsdb_table_read(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int npoints, tsdb_data_t *values)
+{
+	const tsdb_data_t *ptr;
+	
+	ptr = tsdb_table_get(ctx, layer, point, &npoints, values);
+	if (ptr == NULL)
+		return -errno;
+	if (ptr != values)
+		memcpy(values, ptr, TSDB_ROW_SIZE(ctx) * npoints);
+	return (int)npoints;
+}
+
+/* Writes npoints complete points to a layer, extending it if necessary */
+static int tsdb_table_write(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point,
+	unsigned int npoints, const tsdb_data_t *values)
+{
+	tsdb_data_t *column;
+	unsigned int metric, n;
+	int rc = 0;
+	
+	if (ctx->meta->ngaps[layer] && (rc = tsdb_gap_clear(ctx, layer, point, npoints)) < 0)
+		return rc;
+	if (layer == 0) {
+		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+			for (n = 0; n < npoints && (ctx->meta->flags[metric] & TSDB_FLAG_COMPLETE); n++) {
+				if (isnan(values[n * ctx->meta->nmetrics + metric]))
+					ctx->meta->flags[metric] &= ~TSDB_FLAG_COMPLETE;
 			}
 		}
-		
-		/* Write blocks to table file */
-		if (lseek(ctx->table_fd[layer], sizeof(tsdb_data_t) * npoints * ctx->meta->nmetrics, SEEK_SET) < 0) {
-			ERROR("Padding seek error\n");
-			return -errno;
+	}
+	if (TSDB_IS_COMPRESSED(ctx))
+		return tsdb_block_write(ctx, layer, point, npoints, values);
+	if (!TSDB_IS_COLUMNAR(ctx))
+		return tsdb_column_write(ctx, layer, 0, point, npoints, values);
+	
+	/* Split the points into their columns */
+#ifdef TSDB_MMAP_TABLES
+	if (!TSDB_IS_SEGMENTED(ctx) && !TSDB_IS_LIMITED(ctx, layer)) {
+		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+			if ((rc = tsdb_column_grow(ctx, layer, metric, point + npoints)) < 0)
+				return rc;
+			column = ctx->table_map[layer][metric] + point;
+			for (n = 0; n < npoints; n++) {
+				column[n] = values[n * ctx->meta->nmetrics + metric];
+			}
 		}
-		do {
-			if (npadding < pointsperblock)
-				pointsperblock = npadding;
-			DEBUG("%u points of %" PRIuFAST32 "\n", pointsperblock, npadding);
-			if (write(ctx->table_fd[layer], ctx->padding, 
-				sizeof(tsdb_data_t) * pointsperblock * ctx->meta->nmetrics) < 0) {
-				ERROR("Padding write error\n");
-				return -errno;
+		return 0;
+	}
+#endif
+	if (npoints == 1) {
+		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics && rc == 0; metric++) {
+			rc = tsdb_column_write(ctx, layer, metric, point, 1, &values[metric]);
+		}
+		return rc;
+	}
+	column = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * npoints);
+	if (column == NULL) {
+		CRITICAL("Out of memory\n");
+		return -ENOMEM;
+	}
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics && rc == 0; metric++) {
+		for (n = 0; n < npoints; n++) {
+			column[n] = values[n * ctx->meta->nmetrics + metric];
+		}
+		rc = tsdb_column_write(ctx, layer, metric, point, npoints, column);
+	}
+	free(column);
+	return rc;
+}
+
+/* Fills the points between first_point and last_point (exclusive) with unknown values.
+ * Large gaps are recorded in the metadata and left as holes in the table files. */
+static int tsdb_table_pad(tsdb_ctx_t *ctx, unsigned int layer, uint64_t first_point,
+	uint64_t last_point)
+{
+	uint64_t npadding = last_point - first_point;
+	tsdb_gap_t *gaps = ctx->meta->gaps[layer];
+	unsigned int metric, g, smallest;
+	int rc;
+	
+	DEBUG("Padding %" PRIu64 " points\n", npadding);
+	
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		if (layer == 0)
+			ctx->meta->flags[metric] &= ~TSDB_FLAG_COMPLETE;
+		switch ((tsdb_pad_mode_t)((ctx->meta->flags[metric] >> TSDB_PAD_SHIFT) & TSDB_PAD_MASK)) {
+			case tsdbPad_Unknown:
+				break;
+			case tsdbPad_Last:
+				DEBUG("FIXME: tsdbPad_Last not implemented\n");
+				break;
+			default:
+				ERROR("Bad padding mode\n");
+		}
+	}
+	
+	/* Rings are small enough to fill, and gaps in them would never be reused */
+	if (npadding < TSDB_SPARSE_GAP_POINTS || TSDB_IS_RING(ctx, layer))
+		return tsdb_table_fill(ctx, layer, first_point, last_point);
+	
+	if (ctx->meta->ngaps[layer] == TSDB_MAX_GAPS) {
+		/* Make room by filling in the smallest gap, unless that is this one */
+		for (g = 1, smallest = 0; g < TSDB_MAX_GAPS; g++) {
+			if (gaps[g].end - gaps[g].start < gaps[smallest].end - gaps[smallest].start)
+				smallest = g;
+		}
+		if (gaps[smallest].end - gaps[smallest].start > npadding)
+			return tsdb_table_fill(ctx, layer, first_point, last_point);
+		if ((rc = tsdb_table_fill(ctx, layer, gaps[smallest].start, gaps[smallest].end)) < 0)
+			return rc;
+		gaps[smallest] = gaps[--ctx->meta->ngaps[layer]];
+	}
+	DEBUG("Recording gap %" PRIu64 "-%" PRIu64 " in layer %u\n", first_point, last_point, layer);
+	gaps[ctx->meta->ngaps[layer]].start = first_point;
+	gaps[ctx->meta->ngaps[layer]].end = last_point;
+	ctx->meta->ngaps[layer]++;
+	return 0;
+}
+
+/* Reclaims the space held by points [first_point, last_point) of a layer, which must
+ * already be masked by its base.  Only whole chunks of table files, or whole segments,
+ * are released, so part of the range may be left until the next release. */
+static int tsdb_table_release(tsdb_ctx_t *ctx, unsigned int layer, uint64_t first_point,
+	uint64_t last_point)
+{
+	char path[TSDB_MAX_PATH];
+	unsigned int column, slot;
+	uint64_t segment;
+	off_t start, end;
+	int rc = 0;
+	
+	for (column = 0; column < TSDB_NCOLUMNS(ctx); column++) {
+		if (TSDB_IS_SEGMENTED(ctx)) {
+			tsdb_segment_t *slots = TSDB_SEGMENT_SLOTS(ctx, layer, column);
+			
+			TSDB_LOCK(&ctx->segment_lock);
+			for (segment = first_point / ctx->meta->segment_points;
+					segment < last_point / ctx->meta->segment_points; segment++) {
+				for (slot = 0; slot < 2; slot++) {
+					if (slots[slot].fd > 0 && slots[slot].segment == segment)
+						tsdb_segment_close(ctx, &slots[slot], 0);
+				}
+				if (ctx->pack != NULL) {
+					int err = tsdb_pack_free(ctx->pack, ctx->node_id, layer, column, segment);
+					
+					if (err < 0 && err != -ENOENT)
+						rc = err;
+					continue;
+				}
+				TSDB_PATH(path, TSDB_SEGMENT_FORMAT, ctx->node_id, layer, column, segment);
+				DEBUG("Releasing segment %s\n", path);
+				if (unlink(path) < 0 && errno != ENOENT) {
+					ERROR("Failed to unlink %s: %s\n", path, strerror(errno));
+					rc = -errno;
+				}
 			}
-			npadding -= pointsperblock;
-		} while (npadding);
+			TSDB_UNLOCK(&ctx->segment_lock);
+			continue;
+		}
 		
+		/* Holes keep the positions of the remaining points */
+		start = (off_t)(TSDB_COLUMN_POINT_SIZE(ctx) * first_point) & ~((off_t)TSDB_RELEASE_CHUNK - 1);
+		end = (off_t)(TSDB_COLUMN_POINT_SIZE(ctx) * last_point) & ~((off_t)TSDB_RELEASE_CHUNK - 1);
+		if (end <= start)
+			continue;
+		DEBUG("Releasing bytes %lld to %lld of layer %u table %u\n", (long long)start, (long long)end,
+			layer, column);
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (fallocate(ctx->table_fd[layer][column], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				start, end - start) < 0 && errno != EOPNOTSUPP) {
+			ERROR("Release of layer %u table %u failed: %s\n", layer, column, strerror(errno));
+			rc = -errno;
+		}
+#endif
+	}
+	return rc;
+}
+
+/* Merges values into a single point of a layer, padding any gap before it.  NAN values
+ * leave the existing value in place.  npoints is the number of points already in the layer.
+ * If old_values is not NULL it receives the point as it was before the update (all NAN
+ * for a new point) and new_values receives the point as written. */
+static int tsdb_write_point(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point, uint64_t npoints,
+	const tsdb_data_t *values, tsdb_data_t *old_values, tsdb_data_t *new_values)
+{
+	unsigned int metric;
+	tsdb_data_t merged_values[TSDB_MAX_METRICS];
+	int rc;
+	
+	if (new_values == NULL)
+		new_values = merged_values;
+	
+	/* Pad missing values */
+	if (point > npoints) {
+		if ((rc = tsdb_table_pad(ctx, layer, npoints, point)) < 0)
+			return rc;
 	}
 	
 	/* Default unknown points to NAN */
@@ -318,207 +3124,760 @@ static int tsdb_update_layer(tsdb_ctx_t *ctx, unsigned int layer, uint_fast32_t
 		new_values[metric] = NAN;
 	}
 	
-	if (point < ctx->meta->npoints) {
-		/* Updating existing point - read current values */
-		if (lseek(ctx->table_fd[layer], sizeof(tsdb_data_t) * point * ctx->meta->nmetrics, SEEK_SET) < 0) {
-			ERROR("Table seek error reading values for point %" PRIuFAST32 "\n", point);
-			return -errno;
-		}
-		if (read(ctx->table_fd[layer], new_values, sizeof(tsdb_data_t) * ctx->meta->nmetrics) < 0) {
-			ERROR("Table read error reading values for point %" PRIuFAST32 "\n", point);
-			return -errno;
-		}
+	if (point < npoints) {
+		/* Updating existing point - read current values */
+		if ((rc = tsdb_table_read(ctx, layer, point, 1, new_values)) < 0) {
+			ERROR("Table read error reading values for point %" PRIu64 "\n", point);
+			return rc;
+		}
+	}
+	
+	if (old_values != NULL)
+		memcpy(old_values, new_values, TSDB_ROW_SIZE(ctx));
+	
+	/* Fill in any non-NAN new values */
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++, values++) {
+		if (!isnan(*values)) {
+			new_values[metric] = *values;
+		}
+	}
+	
+	/* Write point back to file */
+	if ((rc = tsdb_table_write(ctx, layer, point, 1, new_values)) < 0) {
+		ERROR("Table write error writing values for point %" PRIu64 "\n", point);
+		return rc;
+	}
+	return 0;
+}
+
+/* Accumulators for a layer (one per metric) */
+#define TSDB_ACCUM(ctx, layer)		((ctx)->accum + (layer) * (ctx)->meta->nmetrics)
+
+/* Produces the decimated value for a metric from its accumulator */
+static tsdb_data_t tsdb_accum_value(tsdb_ctx_t *ctx, unsigned int metric, const tsdb_accum_t *acc)
+{
+	if (acc->count == 0) {
+		/* Next value is unknown */
+		return NAN;
+	}
+	switch (TSDB_DS_MODE(ctx, metric)) {
+		case tsdbDownsample_Mean:
+			return (tsdb_data_t)(acc->sum / (double)acc->count);
+		case tsdbDownsample_Sum:
+			return (tsdb_data_t)acc->sum;
+		case tsdbDownsample_Min:
+			return (tsdb_data_t)acc->min;
+		case tsdbDownsample_Max:
+			return (tsdb_data_t)acc->max;
+		case tsdbDownsample_Median:
+		case tsdbDownsample_Mode:
+			/* Need all of the values - see tsdb_decimate */
+			return NAN;
+		default:
+			ERROR("Bad downsampling mode\n");
+	}
+	return NAN;
+}
+
+/* Updates the accumulators of a layer for a single changed point and produces the values
+ * for the corresponding point in the next layer, without re-reading the other points that
+ * contribute to it.  This covers appending to (or filling gaps in or rewriting) the newest
+ * point of the next layer, which is how each append reaches the layers below the first.
+ * npoints is the number of points in the layer before the update.
+ * Returns -1 if the accumulators cannot be used, in which case they are invalidated and
+ * the caller must fall back to tsdb_decimate. */
+static int tsdb_accum_update(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point, uint64_t npoints,
+	const tsdb_data_t *old_values, const tsdb_data_t *new_values, tsdb_data_t *next_values)
+{
+	tsdb_accum_t *acc = TSDB_ACCUM(ctx, layer);
+	uint64_t next_point = point / ctx->meta->decimation[layer];
+	unsigned int metric;
+	
+	if (next_point * ctx->meta->decimation[layer] >= npoints) {
+		/* First point of a new next layer point - start afresh */
+		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+			acc[metric].sum = 0.0;
+			acc[metric].min = INFINITY;
+			acc[metric].max = -INFINITY;
+			acc[metric].count = 0;
+		}
+		ctx->meta->acc_point[layer] = next_point;
+	} else if (ctx->meta->acc_point[layer] != next_point) {
+		/* Not the point described by the accumulators */
+		goto fail;
+	}
+	
+	/* A changed value is applied as the difference from the old one.  Only a minimum or
+	 * maximum moved back from its extreme needs the other points, as does the next value
+	 * of a median or mode metric, even if that metric is unchanged. */
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		tsdb_data_t old_value = old_values[metric], new_value = new_values[metric];
+		
+		switch (TSDB_DS_MODE(ctx, metric)) {
+			case tsdbDownsample_Mean:
+			case tsdbDownsample_Sum:
+				break;
+			case tsdbDownsample_Min:
+				if (!isnan(old_value) && old_value <= acc[metric].min &&
+						(isnan(new_value) || new_value > old_value))
+					goto fail;
+				break;
+			case tsdbDownsample_Max:
+				if (!isnan(old_value) && old_value >= acc[metric].max &&
+						(isnan(new_value) || new_value < old_value))
+					goto fail;
+				break;
+			default:
+				goto fail;
+		}
+	}
+	
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		tsdb_data_t old_value = old_values[metric], new_value = new_values[metric];
+		
+		if (old_value != new_value && !(isnan(old_value) && isnan(new_value))) {
+			if (!isnan(old_value)) {
+				acc[metric].sum -= old_value;
+				acc[metric].count--;
+			}
+			if (!isnan(new_value)) {
+				acc[metric].sum += new_value;
+				if (new_value < acc[metric].min)
+					acc[metric].min = new_value;
+				if (new_value > acc[metric].max)
+					acc[metric].max = new_value;
+				acc[metric].count++;
+			}
+		}
+		next_values[metric] = tsdb_accum_value(ctx, metric, &acc[metric]);
+	}
+	return 0;
+fail:
+	ctx->meta->acc_point[layer] = TSDB_ACC_INVALID;
+	return -1;
+}
+
+/* Combines the points of a layer that contribute to the given point in the next layer
+ * down.  npoints is the number of points in the source layer.  If the point is the newest
+ * in the next layer the layer's accumulators are rebuilt from the result.  Returns 1,
+ * leaving the point in the next layer as it is, if some of the points have already been
+ * overwritten in a wrapping layer. */
+static int tsdb_decimate(tsdb_ctx_t *ctx, unsigned int layer, uint64_t next_point, uint64_t npoints,
+	tsdb_data_t *next_values)
+{
+	uint64_t first_point;
+	const tsdb_data_t *rows = NULL, *ptr;
+	unsigned int metric, count, n, stride;
+	tsdb_accum_t acc[TSDB_MAX_METRICS];
+	
+	/* Fetch contributing points - only those that exist in this layer.  Rows are
+	 * fetched once for all metrics, columns one metric at a time. */
+	first_point = next_point * ctx->meta->decimation[layer];
+	if (TSDB_EXPIRED(ctx, layer, first_point)) {
+		DEBUG("Points from %" PRIu64 " in layer %u have expired\n", first_point, layer);
+		return 1;
+	}
+	count = ctx->meta->decimation[layer];
+	if (count > npoints - first_point)
+		count = npoints - first_point;
+	DEBUG("Decimate %u points starting at %" PRIu64 "\n", count, first_point);
+	if (!TSDB_IS_COLUMNAR(ctx)) {
+		rows = tsdb_table_get(ctx, layer, first_point, &count, ctx->work_buffer);
+		stride = ctx->meta->nmetrics;
+		if (rows == NULL) {
+			ERROR("Table read error while decimating\n");
+			return -errno;
+		}
+	}
+	
+	/* Accumulate all valid values, with the kernel chosen once for each metric */
+	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
+		tsdb_agg_fn_t aggregate = tsdb_agg_select(TSDB_DS_MODE(ctx, metric));
+		
+		acc[metric].sum = 0.0;
+		acc[metric].min = INFINITY;
+		acc[metric].max = -INFINITY;
+		acc[metric].count = 0;
+		acc[metric].reserved = 0;
+		
+		n = count;
+		if (rows != NULL) {
+			ptr = rows + metric;
+		} else {
+			ptr = tsdb_table_get_metric(ctx, layer, metric, first_point, &n, ctx->work_buffer, &stride);
+			if (ptr == NULL) {
+				ERROR("Table read error while decimating\n");
+				return -errno;
+			}
+		}
+		aggregate(ptr, n, stride, &acc[metric]);
+		
+		/* Complete the decimation function according to the option selected in the flags
+		 * for each metric */
+		switch (TSDB_DS_MODE(ctx, metric)) {
+			case tsdbDownsample_Median:
+				next_values[metric] = tsdb_agg_median(ptr, n, stride, ctx->select_buffer);
+				break;
+			case tsdbDownsample_Mode:
+				next_values[metric] = tsdb_agg_mode(ptr, n, stride, ctx->mode_table);
+				break;
+			default:
+				next_values[metric] = tsdb_accum_value(ctx, metric, &acc[metric]);
+		}
+		DEBUG("Metric %u found %u usable points (agg = %f)\n", metric, acc[metric].count,
+			next_values[metric]);
+	}
+	
+	/* Keep the accumulators for the newest point so that appends can be applied to them */
+	if (next_point == (npoints - 1) / ctx->meta->decimation[layer]) {
+		memcpy(TSDB_ACCUM(ctx, layer), acc, sizeof(tsdb_accum_t) * ctx->meta->nmetrics);
+		ctx->meta->acc_point[layer] = next_point;
+	}
+	return 0;
+}
+
+/* FIXME: Timestamp is passed in to allow for integrity checking the lower layers. Not yet implemented */
+static int tsdb_update_layer(tsdb_ctx_t *ctx, unsigned int layer, uint64_t point, uint64_t npoints,
+	int64_t timestamp, tsdb_data_t *values)
+{
+	tsdb_data_t next_values[TSDB_MAX_METRICS];
+	tsdb_data_t old_values[TSDB_MAX_METRICS], new_values[TSDB_MAX_METRICS];
+	int rc;
+	
+	FUNCTION_TRACE;
+	
+	DEBUG("Values for %u metrics at %" PRIi64 " at point %" PRIu64 " in layer %d\n", ctx->meta->nmetrics,
+	      timestamp, point, layer);
+	
+	if ((rc = tsdb_write_point(ctx, layer, point, npoints, values, old_values, new_values)) < 0)
+		return rc;
+	
+	/* Decimate - incrementally where possible */
+	if (ctx->meta->decimation[layer] > 0) {
+		if (tsdb_accum_update(ctx, layer, point, npoints, old_values, new_values, next_values) < 0) {
+			DEBUG("Accumulators unusable for point %" PRIu64 " in layer %d\n", point, layer);
+			if (point >= npoints)
+				npoints = point + 1;
+			if ((rc = tsdb_decimate(ctx, layer, point / ctx->meta->decimation[layer], npoints, next_values)) != 0)
+				return (rc < 0) ? rc : 0;
+		}
+		
+		/* Recurse down */
+		return tsdb_update_layer(ctx, layer + 1,
+			point / ctx->meta->decimation[layer],
+			tsdb_layer_npoints(ctx, layer + 1, ctx->meta->npoints),
+			timestamp, next_values);
+	}
+	
+	return 0;
+}
+
+/* Brings the lower layers up to date with the top-level points waiting to be decimated.
+ * Each affected point of each lower layer is recomputed once.  Must be called with the
+ * context locked for writing. */
+static int tsdb_decimate_pending(tsdb_ctx_t *ctx)
+{
+	tsdb_data_t next_values[TSDB_MAX_METRICS];
+	uint64_t first, end, point, layer_npoints, next_npoints;
+	unsigned int layer;
+	int rc;
+	
+	if (!TSDB_IS_PENDING(ctx))
+		return 0;
+	tsdb_ctx_changed(ctx);
+	
+	/* The lower layers were padded to match the number of top-level points when the
+	 * range was started, and have not been touched since.  Points in the range may be
+	 * newer than npoints while an update is in progress. */
+	first = ctx->meta->pending_start;
+	end = ctx->meta->pending_end;
+	DEBUG("Decimating points %" PRIu64 " to %" PRIu64 "\n", first, end - 1);
+	layer_npoints = (ctx->meta->npoints > end) ? ctx->meta->npoints : end;
+	for (layer = 0; layer < TSDB_MAX_LAYERS - 1 && ctx->meta->decimation[layer] > 0; layer++) {
+		first /= ctx->meta->decimation[layer];
+		end = (end + ctx->meta->decimation[layer] - 1) / ctx->meta->decimation[layer];
+		next_npoints = tsdb_layer_npoints(ctx, layer + 1, ctx->meta->pending_npoints);
+		for (point = first; point < end; point++) {
+			if ((rc = tsdb_decimate(ctx, layer, point, layer_npoints, next_values)) < 0)
+				return rc;
+			if (rc == 0 && (rc = tsdb_write_point(ctx, layer + 1, point, next_npoints, next_values, NULL, NULL)) < 0)
+				return rc;
+			if (point >= next_npoints)
+				next_npoints = point + 1;
+		}
+		layer_npoints = next_npoints;
+	}
+	/* The end is kept as the number of top-level points the lower layers now describe */
+	ctx->meta->pending_start = ctx->meta->pending_end;
+	return 0;
+}
+
+/* Records top-level points [first, end) as waiting to be decimated into the lower layers.
+ * Must be called before npoints is updated to include them. */
+static int tsdb_pending_add(tsdb_ctx_t *ctx, uint64_t first, uint64_t end)
+{
+	int rc;
+	
+	if (ctx->meta->decimation[0] == 0)
+		return 0;
+	if (TSDB_IS_PENDING(ctx) && (first > ctx->meta->pending_end + TSDB_DECIMATE_MAX_GAP ||
+			end + TSDB_DECIMATE_MAX_GAP < ctx->meta->pending_start)) {
+		/* Too far away to share the range */
+		DEBUG("Update at point %" PRIu64 " is far from pending decimation\n", first);
+		if ((rc = tsdb_decimate_pending(ctx)) < 0)
+			return rc;
+	}
+	if (!TSDB_IS_PENDING(ctx)) {
+		ctx->meta->pending_npoints = (ctx->meta->npoints > ctx->meta->pending_end) ?
+			ctx->meta->npoints : ctx->meta->pending_end;
+		ctx->meta->pending_start = first;
+		ctx->meta->pending_end = end;
+	} else {
+		if (first < ctx->meta->pending_start)
+			ctx->meta->pending_start = first;
+		if (end > ctx->meta->pending_end)
+			ctx->meta->pending_end = end;
+	}
+	return 0;
+}
+
+#ifdef TSDB_PTHREAD_LOCKING
+/* Queues a context with pending decimation for a background thread, if not already
+ * waiting.  The caller must hold a handle. */
+static void tsdb_decimate_queue(tsdb_ctx_t *ctx)
+{
+	pthread_mutex_lock(&g_decimate.mutex);
+	if (!ctx->queued) {
+		/* Keep the context cached until it has been decimated */
+		TSDB_LOCK(&g_cache_mutex);
+		ctx->refcount++;
+		TSDB_UNLOCK(&g_cache_mutex);
+		
+		ctx->queued = 1;
+		ctx->queue_next = NULL;
+		if (g_decimate.tail)
+			g_decimate.tail->queue_next = ctx;
+		else
+			g_decimate.head = ctx;
+		g_decimate.tail = ctx;
+		pthread_cond_signal(&g_decimate.work);
+	}
+	pthread_mutex_unlock(&g_decimate.mutex);
+}
+
+static void* tsdb_decimate_thread(void *arg)
+{
+	tsdb_ctx_t *ctx;
+	
+	FUNCTION_TRACE;
+	
+	pthread_mutex_lock(&g_decimate.mutex);
+	for (;;) {
+		while (!g_decimate.stop && g_decimate.head == NULL)
+			pthread_cond_wait(&g_decimate.work, &g_decimate.mutex);
+		if (g_decimate.head == NULL) {
+			/* Stopping and nothing left to do */
+			break;
+		}
+		ctx = g_decimate.head;
+		g_decimate.head = ctx->queue_next;
+		if (g_decimate.head == NULL)
+			g_decimate.tail = NULL;
+		ctx->queued = 0;
+		pthread_mutex_unlock(&g_decimate.mutex);
+		
+		/* Updates arriving from here on queue the context again */
+		TSDB_WRLOCK(ctx);
+		if (!ctx->stale && tsdb_decimate_pending(ctx) < 0)
+			ERROR("Decimation of node %016" PRIX64 " failed\n", ctx->node_id);
+		TSDB_RWUNLOCK(ctx);
+		tsdb_close(ctx);
+		
+		pthread_mutex_lock(&g_decimate.mutex);
+	}
+	pthread_mutex_unlock(&g_decimate.mutex);
+	return NULL;
+}
+#else
+#define tsdb_decimate_queue(ctx)
+#endif
+
+int tsdb_decimate_start(unsigned int nthreads)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	unsigned int n;
+	int rc;
+	
+	FUNCTION_TRACE;
+	
+	if (nthreads == 0 || nthreads > TSDB_MAX_DECIMATE_THREADS || g_decimate.nthreads) {
+		ERROR("Bad number of decimation threads\n");
+		return -EINVAL;
 	}
-	
-	/* Fill in any non-NAN new values */
-	ptr = values;
-	for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++, ptr++) {
-		if (!isnan(*ptr)) {
-			new_values[metric] = *ptr;
+	g_decimate.stop = 0;
+	for (n = 0; n < nthreads; n++) {
+		if ((rc = pthread_create(&g_decimate.threads[n], NULL, tsdb_decimate_thread, NULL)) != 0) {
+			ERROR("Error starting decimation thread: %s\n", strerror(rc));
+			g_decimate.nthreads = n;
+			tsdb_decimate_stop();
+			return -rc;
 		}
 	}
+	g_decimate.nthreads = nthreads;
+	INFO("Decimating in the background with %u threads\n", nthreads);
+	return 0;
+#else
+	ERROR("Background decimation needs pthreads\n");
+	return -ENOSYS;
+#endif
+}
+
+void tsdb_decimate_stop(void)
+{
+#ifdef TSDB_PTHREAD_LOCKING
+	unsigned int n;
 	
-	/* Write point back to file */
-	if (lseek(ctx->table_fd[layer], sizeof(tsdb_data_t) * point * ctx->meta->nmetrics, SEEK_SET) < 0) {
-		ERROR("Table seek error writing values for point %" PRIuFAST32 "\n", point);
-		return -errno;
-	}
-	if (write(ctx->table_fd[layer], new_values, sizeof(tsdb_data_t) * ctx->meta->nmetrics) < 0) {
-		ERROR("Table write error writing values for point %" PRIuFAST32 "\n", point);
-		return -errno;
-	}
+	FUNCTION_TRACE;
 	
-	/* Decimate */
-	if (ctx->meta->decimation[layer] > 0) {
-		uint_fast32_t first_point;
-		tsdb_data_t next_values[TSDB_MAX_METRICS];
-		int count;
-		unsigned int valid_count[TSDB_MAX_METRICS];
-		
-		/* Read contributing points to decimation buffer */
-		first_point = (point / ctx->meta->decimation[layer]) * ctx->meta->decimation[layer];
-		DEBUG("Decimate %" PRIu32 " points starting at %" PRIuFAST32 "\n",
-		      ctx->meta->decimation[layer], first_point);
-		if (lseek(ctx->table_fd[layer], sizeof(tsdb_data_t) * first_point * ctx->meta->nmetrics, SEEK_SET) < 0) {
-			ERROR("Table seek error while decimating\n");
-			return -errno;
-		}
-		count = read(ctx->table_fd[layer], ctx->work_buffer, sizeof(tsdb_data_t) * ctx->meta->decimation[layer] * ctx->meta->nmetrics);
-		if (count < 0) {
-			ERROR("Table read error while decimating\n");
-			return -errno;
-		}
-		
-		/* Calculate decimated values */
-		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
-			valid_count[metric] = 0;
-			switch ((tsdb_downsample_mode_t)((ctx->meta->flags[metric] >> TSDB_DOWNSAMPLE_SHIFT) & TSDB_DOWNSAMPLE_MASK)) {
-				case tsdbDownsample_Min:
-					next_values[metric] = INFINITY;
-					break;
-				case tsdbDownsample_Max:
-					next_values[metric] = -INFINITY;
-				default:
-					next_values[metric] = 0.0;
-			}
-		}
-		count = count / sizeof(tsdb_data_t) / ctx->meta->nmetrics;
-		ptr = ctx->work_buffer;
-		while (count--) {
-			for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++, ptr++) {
-				if (isnan(*ptr)) {
-					/* Skip unknown values */
-					continue;
-				}
-				/* Perform decimation according to the option selected in the
-				* flags for this metric */
-				switch ((tsdb_downsample_mode_t)((ctx->meta->flags[metric] >> TSDB_DOWNSAMPLE_SHIFT) & TSDB_DOWNSAMPLE_MASK)) {
-					case tsdbDownsample_Mean:
-					case tsdbDownsample_Sum:
-						next_values[metric] += *ptr;
-						break;
-					case tsdbDownsample_Median:
-						ERROR("FIXME: MEDIAN not implemented\n"); // FIXME:
-						break;
-					case tsdbDownsample_Mode:
-						ERROR("FIXME: MODE not implemented\n"); // FIXME:
-						break;
-					case tsdbDownsample_Min:
-						if (*ptr < next_values[metric])
-							next_values[metric] = *ptr;
-						break;
-					case tsdbDownsample_Max:
-						if (*ptr > next_values[metric])
-							next_values[metric] = *ptr;
-						break;
-					default:
-						ERROR("Bad downsampling mode\n");
-				}
-				valid_count[metric]++;
-			}
-		}
-		
-		for (metric = 0; metric < (unsigned int)ctx->meta->nmetrics; metric++) {
-			if (valid_count[metric]) {
-				/* Complete the decimation function */
-				switch ((tsdb_downsample_mode_t)((ctx->meta->flags[metric] >> TSDB_DOWNSAMPLE_SHIFT) & TSDB_DOWNSAMPLE_MASK)) {
-					case tsdbDownsample_Mean:
-						next_values[metric] /= (double)valid_count[metric];
-						break;
-					case tsdbDownsample_Median:
-					case tsdbDownsample_Mode:
-					case tsdbDownsample_Sum:
-					case tsdbDownsample_Min:
-					case tsdbDownsample_Max:
-						break;
-					default:
-						ERROR("Bad downsampling mode\n");
+	if (g_decimate.nthreads == 0)
+		return;
+	
+	/* The threads empty the queue before exiting */
+	pthread_mutex_lock(&g_decimate.mutex);
+	g_decimate.stop = 1;
+	pthread_cond_broadcast(&g_decimate.work);
+	pthread_mutex_unlock(&g_decimate.mutex);
+	for (n = 0; n < g_decimate.nthreads; n++)
+		pthread_join(g_decimate.threads[n], NULL);
+	g_decimate.nthreads = 0;
+	INFO("Background decimation stopped\n");
+#endif
+}
+
+/* Compare function for sorting point indices */
+static int tsdb_compare_points(const void *a, const void *b)
+{
+	uint64_t pa = *(const uint64_t*)a, pb = *(const uint64_t*)b;
+	
+	return (pa > pb) - (pa < pb);
+}
+
+int tsdb_expire(tsdb_ctx_t *ctx)
+{
+	uint64_t layer_interval, span, base;
+	unsigned int layer, g;
+	int rc = 0, err;
+	
+	FUNCTION_TRACE;
+	
+	TSDB_WRLOCK(ctx);
+	
+	/* Points cannot go until they have been decimated into the next layer */
+	if (ctx->stale || TSDB_IS_PENDING(ctx))
+		goto done;
+	
+	span = ctx->meta->npoints * ctx->meta->interval;
+	layer_interval = ctx->meta->interval;
+	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		if (ctx->meta->retention[layer] && span > ctx->meta->retention[layer]) {
+			/* The base is kept on the start of a point in the next layer, so that the
+			 * points it is decimated from are all present or all released */
+			base = (span - ctx->meta->retention[layer]) / layer_interval;
+			if (ctx->meta->decimation[layer])
+				base -= base % ctx->meta->decimation[layer];
+			if (base > ctx->meta->base[layer]) {
+				uint64_t first_point = ctx->meta->base[layer];
+				
+				DEBUG("Releasing points %" PRIu64 " to %" PRIu64 " of layer %u\n", first_point,
+					base - 1, layer);
+				tsdb_ctx_changed(ctx);
+				ctx->meta->base[layer] = base;
+				if ((err = tsdb_table_release(ctx, layer, first_point, base)) < 0)
+					rc = err;
+				
+				/* Forget gaps that have been released */
+				for (g = 0; g < ctx->meta->ngaps[layer]; ) {
+					if (ctx->meta->gaps[layer][g].end <= base)
+						ctx->meta->gaps[layer][g] = ctx->meta->gaps[layer][--ctx->meta->ngaps[layer]];
+					else
+						g++;
 				}
-			} else {
-				/* Next value is unknown */
-				next_values[metric] = NAN;
 			}
-			DEBUG("Metric %u found %u usable points (agg = %f)\n", metric, valid_count[metric],
-				next_values[metric]);
 		}
-		
-		/* Recurse down */
-		tsdb_update_layer(ctx, layer + 1, 
-			point / ctx->meta->decimation[layer],
-			/* npoints needs to be rounded up */
-			(npoints + ctx->meta->decimation[layer] - 1) / ctx->meta->decimation[layer], 
-			timestamp, next_values);
+		if (ctx->meta->decimation[layer] == 0)
+			break;
+		layer_interval *= ctx->meta->decimation[layer];
 	}
-	
-	return 0;
+done:
+	TSDB_RWUNLOCK(ctx);
+	return rc;
 }
 
 int64_t tsdb_get_latest(tsdb_ctx_t *ctx)
 {
-	uint_fast32_t point;
+	uint64_t point;
 	int64_t timestamp;
 	
 	FUNCTION_TRACE;
 	
+	TSDB_RDLOCK(ctx);
+	
 	/* Determine timestamp for last slot */
 	if (ctx->meta->npoints == 0) {
 		ERROR("Database is empty!\n");
+		TSDB_RWUNLOCK(ctx);
 		return TSDB_NO_TIMESTAMP;
 	}
 	point = ctx->meta->npoints - 1;
 	timestamp = ctx->meta->start_time + (point * ctx->meta->interval);
-	DEBUG("Latest values at point %" PRIuFAST32 " (%" PRIi64 " s)\n", point, timestamp);
+	TSDB_RWUNLOCK(ctx);
+	
+	DEBUG("Latest values at point %" PRIu64 " (%" PRIi64 " s)\n", point, timestamp);
 	return timestamp;
 }
 
 int tsdb_update_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values)
 {
-	uint_fast32_t point;
+	int64_t start_time;
+	uint64_t point;
+	uint64_t lsn = 0;
 	int rc = 0;
 	
 	FUNCTION_TRACE;
 
-	/* FIXME: Locking! */
+	/* Updates are serialised against each other and against queries.  Each is logged
+	 * once validated and before it touches the tables, under the lock so that the log
+	 * order is the order the updates are applied. */
+	tsdb_wal_begin();
+	TSDB_WRLOCK(ctx);
 	
 	/* For a new file this point represents the start of the database */
 	*timestamp = (*timestamp / ctx->meta->interval) * ctx->meta->interval; /* round down */
-	if (ctx->meta->npoints == 0) {
-		ctx->meta->start_time = *timestamp;
-	}
+	start_time = (ctx->meta->npoints == 0) ? *timestamp : ctx->meta->start_time;
 	
 	/* Sanity checks */
-	if (*timestamp < ctx->meta->start_time) {
+	if (*timestamp < start_time) {
 		ERROR("Timestamp in the past\n");
-		return -ENOENT;
+		rc = -ENOENT;
+		goto done;
 	}	
 	
 	/* Determine position of point in the top-level */
-	point = (*timestamp - ctx->meta->start_time) / ctx->meta->interval;
+	point = (*timestamp - start_time) / ctx->meta->interval;
+	if (TSDB_EXPIRED(ctx, 0, point)) {
+		ERROR("Timestamp has expired\n");
+		rc = -ENOENT;
+		goto done;
+	}
+	
+	if ((rc = tsdb_wal_append(ctx->node_id, ctx->meta->nmetrics, timestamp, values, 1, &lsn)) < 0)
+		goto done;
+	ctx->meta->start_time = start_time;
 	
-	/* Update layers */
-	rc = tsdb_update_layer(ctx, 0, point, ctx->meta->npoints, *timestamp, values);
+	/* Update layers - only the top-level if decimating in the background */
+	tsdb_ctx_changed(ctx);
+	if (TSDB_DECIMATE_ASYNC()) {
+		rc = tsdb_write_point(ctx, 0, point, ctx->meta->npoints, values, NULL, NULL);
+		if (rc == 0)
+			rc = tsdb_pending_add(ctx, point, point + 1);
+	} else {
+		rc = tsdb_decimate_pending(ctx);
+		if (rc == 0)
+			rc = tsdb_update_layer(ctx, 0, point, ctx->meta->npoints, *timestamp, values);
+	}
 	if (rc == 0) {
 		/* Update metadata with new number of top-level points */		
 		if (point >= ctx->meta->npoints)
 			ctx->meta->npoints = point + 1;
 
-		/* Flush metadata */
-		msync(ctx->meta, sizeof(tsdb_metadata_t), MS_ASYNC);
+		if (TSDB_DECIMATE_ASYNC())
+			tsdb_decimate_queue(ctx);
+	}
+done:
+	TSDB_RWUNLOCK(ctx);
+	
+	/* Wait for the log record to become durable if required */
+	if (tsdb_wal_commit(lsn) < 0 && rc == 0)
+		rc = -EIO;
+	return rc;
+}
+
+int tsdb_update_values_batch(tsdb_ctx_t *ctx, int64_t *timestamps, tsdb_data_t *values, unsigned int count)
+{
+	uint64_t *points = NULL;
+	uint64_t npoints, layer_npoints, next_npoints, newest;
+	tsdb_data_t *run_values = NULL, *ptr;
+	tsdb_data_t next_values[TSDB_MAX_METRICS];
+	unsigned int n, run, metric, layer, nbuckets;
+	int64_t start_time;
+	uint64_t lsn = 0;
+	int rc = 0;
+	
+	FUNCTION_TRACE;
+	
+	if (count == 0)
+		return 0;
+	
+	points = (uint64_t*)malloc(sizeof(uint64_t) * count);
+	run_values = (tsdb_data_t*)malloc(TSDB_ROW_SIZE(ctx) * count);
+	if (points == NULL || run_values == NULL) {
+		CRITICAL("Out of memory\n");
+		free(points);
+		free(run_values);
+		return -ENOMEM;
+	}
+	
+	tsdb_wal_begin();
+	TSDB_WRLOCK(ctx);
+	
+	/* For a new file the first point represents the start of the database */
+	for (n = 0; n < count; n++) {
+		timestamps[n] = (timestamps[n] / ctx->meta->interval) * ctx->meta->interval; /* round down */
+	}
+	start_time = (ctx->meta->npoints == 0) ? timestamps[0] : ctx->meta->start_time;
+	
+	/* Validate the whole batch before writing anything.  No point may be older than a
+	 * wrapping top-level will hold once the whole batch has been written. */
+	newest = ctx->meta->ring_end[0];
+	for (n = 0; n < count; n++) {
+		if (timestamps[n] < start_time) {
+			ERROR("Timestamp in the past\n");
+			rc = -ENOENT;
+			goto done;
+		}
+		points[n] = (timestamps[n] - start_time) / ctx->meta->interval;
+		if (points[n] >= newest)
+			newest = points[n] + 1;
+	}
+	for (n = 0; n < count; n++) {
+		if (TSDB_EXPIRED(ctx, 0, points[n]) ||
+				(TSDB_IS_RING(ctx, 0) && points[n] + ctx->meta->capacity[0] < newest)) {
+			ERROR("Timestamp has expired\n");
+			rc = -ENOENT;
+			goto done;
+		}
+	}
+	
+	/* Log the update before touching the tables, in the order updates are applied */
+	if ((rc = tsdb_wal_append(ctx->node_id, ctx->meta->nmetrics, timestamps, values, count, &lsn)) < 0)
+		goto done;
+	ctx->meta->start_time = start_time;
+	tsdb_ctx_changed(ctx);
+	
+	/* Write the top-level in runs of consecutive points, each with a single read of any
+	 * existing points and a single write.  Runs are applied in order, so a point that
+	 * appears more than once is updated in the same way as by repeated single updates. */
+	npoints = ctx->meta->npoints;
+	for (n = 0; n < count; n += run) {
+		unsigned int nexisting = 0;
+		
+		for (run = 1; n + run < count && points[n + run] == points[n] + run; run++);
+		DEBUG("Run of %u points from point %" PRIu64 "\n", run, points[n]);
+		
+		if (points[n] > npoints) {
+			if ((rc = tsdb_table_pad(ctx, 0, npoints, points[n])) < 0)
+				goto done;
+			npoints = points[n];
+		}
+		if (points[n] < npoints) {
+			nexisting = (npoints - points[n] < run) ? npoints - points[n] : run;
+			if ((rc = tsdb_table_read(ctx, 0, points[n], nexisting, run_values)) < 0)
+				goto done;
+		}
+		ptr = run_values + nexisting * ctx->meta->nmetrics;
+		for (metric = (run - nexisting) * ctx->meta->nmetrics; metric; metric--) {
+			*ptr++ = NAN;
+		}
+		
+		/* Merge in any non-NAN new values */
+		ptr = run_values;
+		for (metric = 0; metric < run * ctx->meta->nmetrics; metric++, ptr++) {
+			if (!isnan(values[n * ctx->meta->nmetrics + metric])) {
+				*ptr = values[n * ctx->meta->nmetrics + metric];
+			}
+		}
+		if ((rc = tsdb_table_write(ctx, 0, points[n], run, run_values)) < 0)
+			goto done;
+		if (points[n] + run > npoints)
+			npoints = points[n] + run;
+	}
+	
+	/* Work out which points of each lower layer were affected and recompute each once.  The
+	 * old npoints is still in the metadata here so the lower layers can be padded correctly. */
+	nbuckets = count;
+	for (n = 1; n < nbuckets; n++) {
+		if (points[n] < points[n - 1]) {
+			qsort(points, nbuckets, sizeof(uint64_t), tsdb_compare_points);
+			break;
+		}
+	}
+	if (TSDB_DECIMATE_ASYNC()) {
+		/* Leave them to the background, in runs of nearby points */
+		for (n = 0; n < nbuckets; n += run) {
+			for (run = 1; n + run < nbuckets && points[n + run] - points[n + run - 1] <= TSDB_DECIMATE_MAX_GAP; run++);
+			if ((rc = tsdb_pending_add(ctx, points[n], points[n + run - 1] + 1)) < 0)
+				goto done;
+		}
+		nbuckets = 0;
+	} else if ((rc = tsdb_decimate_pending(ctx)) < 0) {
+		goto done;
+	}
+	layer_npoints = npoints;
+	for (layer = 0; layer < TSDB_MAX_LAYERS - 1 && ctx->meta->decimation[layer] > 0; layer++) {
+		unsigned int nnext = 0;
+		
+		/* Indices in the next layer, de-duplicated (input is sorted) */
+		for (n = 0; n < nbuckets; n++) {
+			uint64_t next_point = points[n] / ctx->meta->decimation[layer];
+			if (nnext == 0 || points[nnext - 1] != next_point)
+				points[nnext++] = next_point;
+		}
+		nbuckets = nnext;
+		
+		next_npoints = tsdb_layer_npoints(ctx, layer + 1, ctx->meta->npoints);
+		DEBUG("Updating %u points in layer %u\n", nbuckets, layer + 1);
+		for (n = 0; n < nbuckets; n++) {
+			if ((rc = tsdb_decimate(ctx, layer, points[n], layer_npoints, next_values)) < 0)
+				goto done;
+			if (rc == 0 && (rc = tsdb_write_point(ctx, layer + 1, points[n], next_npoints, next_values, NULL, NULL)) < 0)
+				goto done;
+			if (points[n] >= next_npoints)
+				next_npoints = points[n] + 1;
+		}
+		layer_npoints = next_npoints;
 	}
 	
+	/* Update metadata with new number of top-level points */
+	rc = 0;
+	ctx->meta->npoints = npoints;
+	if (TSDB_DECIMATE_ASYNC())
+		tsdb_decimate_queue(ctx);
+	
+done:
+	TSDB_RWUNLOCK(ctx);
+	free(points);
+	free(run_values);
+	
+	/* Wait for the log record to become durable if required */
+	if (tsdb_wal_commit(lsn) < 0 && rc == 0)
+		rc = -EIO;
 	return rc;
 }
 
 int tsdb_get_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values)
 {
-	uint_fast32_t point;
+	uint64_t point;
+	int rc;
 	
 	FUNCTION_TRACE;
 	
+	TSDB_RDLOCK(ctx);
+	
 	/* Sanity check */
 	if (*timestamp < ctx->meta->start_time) {
 		ERROR("Timestamp in the past\n");
-		return -ENOENT;
+		rc = -ENOENT;
+		goto done;
 	}
 
 	/* Determine position of point in the top-level */
@@ -526,34 +3885,148 @@ int tsdb_get_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values)
 	point = (*timestamp - ctx->meta->start_time) / ctx->meta->interval;
 	if (point >= ctx->meta->npoints) {
 		ERROR("Timestamp in the future\n");
-		return -ENOENT;
+		rc = -ENOENT;
+		goto done;
+	}
+	if (TSDB_EXPIRED(ctx, 0, point)) {
+		ERROR("Timestamp has expired\n");
+		rc = -ENOENT;
+		goto done;
 	}
 
 	/* Read values */
-	if (lseek(ctx->table_fd[0], sizeof(tsdb_data_t) * point * ctx->meta->nmetrics, SEEK_SET) < 0) {
-		ERROR("Table seek error for point %" PRIuFAST32 ": %s\n", point, strerror(errno));		
-		return -errno;
+	if ((rc = tsdb_table_read(ctx, 0, point, 1, values)) > 0) {
+		rc = 0;
 	}
-	if (read(ctx->table_fd[0], values, sizeof(tsdb_data_t) * ctx->meta->nmetrics) < 0) {
-		ERROR("Table read error for point %" PRIuFAST32 ": %s\n", point, strerror(errno));		
-		return -errno;
+
+done:
+	TSDB_RWUNLOCK(ctx);
+	return rc;
+}
+
+/* Receives each output point of a series scan, with one value (NaN if unknown) and
+ * accumulator for each requested metric */
+typedef void (*tsdb_series_emit_t)(void *arg, int64_t timestamp, const tsdb_data_t *values,
+	const tsdb_accum_t *acc);
+
+/* Position in a layer of a scan through one table file */
+typedef struct {
+	const tsdb_data_t	*data;			/*< Values for point start */
+	uint64_t		start;			/*< First point available */
+	uint64_t		end;			/*< Point after the last available */
+	unsigned int		stride;			/*< Distance between points in data */
+	tsdb_data_t		*buffer;		/*< Part of the scan buffer for this file */
+	uint64_t		first;			/*< First point read (UINT64_MAX before the first read) */
+} tsdb_scan_t;
+
+/* Range of points of one layer read for an output step */
+typedef struct {
+	unsigned int		layer;
+	uint64_t		first;
+	uint64_t		end;			/*< Point after the last */
+	int			tree;			/*< Part of a tree plan (else a single layer) */
+} tsdb_series_range_t;
+
+/* Adds the aggregate of a range of points from a coarser layer, each standing for weight
+ * points of the finest layer read for the output step, to an accumulator.  Only means
+ * need weighting, and assume that all of the input points were valid (a coarser point
+ * does not record how many of those beneath it were - see TSDB_FLAG_COMPLETE). */
+static void tsdb_accum_merge(tsdb_accum_t *acc, const tsdb_accum_t *part, tsdb_downsample_mode_t mode,
+	uint64_t weight)
+{
+	if (mode == tsdbDownsample_Mean) {
+		acc->sum += part->sum * weight;
+		acc->count += part->count * weight;
+	} else {
+		acc->sum += part->sum;
+		acc->count += part->count;
 	}
+	if (part->min < acc->min)
+		acc->min = part->min;
+	if (part->max > acc->max)
+		acc->max = part->max;
+}
 
-	return 0;
+/* What a series scan produces for each output step */
+typedef enum {
+	tsdbSeries_Aggregate = 0,		/*< Each metric's downsampling mode */
+	tsdbSeries_Envelope,			/*< Minimum, maximum, mean and count */
+	tsdbSeries_Lttb,			/*< A representative input point (one metric only) */
+	tsdbSeries_Linear,			/*< Linear interpolation at the output timestamp */
+	tsdbSeries_Step,			/*< The last input point at or before the output timestamp */
+} tsdb_series_mode_t;
+
+/* Returns the series mode selected by tsdb_get_series flags, or -EINVAL if more than one
+ * mode is requested */
+static int tsdb_series_mode(int flags)
+{
+	switch (flags & (TSDB_SERIES_LTTB | TSDB_SERIES_LINEAR | TSDB_SERIES_STEP)) {
+		case 0:
+			return tsdbSeries_Aggregate;
+		case TSDB_SERIES_LTTB:
+			return tsdbSeries_Lttb;
+		case TSDB_SERIES_LINEAR:
+			return tsdbSeries_Linear;
+		case TSDB_SERIES_STEP:
+			return tsdbSeries_Step;
+		default:
+			ERROR("Conflicting series flags\n");
+			return -EINVAL;
+	}
 }
 
-/* TODO: There is room for improvement here.  Where the desired timepoint lies between samples
- * it would be nice to attempt some interpolation */
-int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int64_t end, 
-	unsigned int npoints, int flags, tsdb_series_point_t *points)
+/* Produces a series for one or more metrics.  Called with the context locked.  For an
+ * envelope the accumulators are complete and values are the means.  For LTTB the
+ * timestamps are those of the chosen input points.  Interpolated series are gathered
+ * into arrays as the table is scanned and then interpolated in one pass before being
+ * emitted.
+ *
+ * Aggregates are planned using the layers as a tree: the points of each decimated layer
+ * are nodes whose children are the points of the layer above that they were decimated
+ * from.  Each output step is read as the fewest nodes that exactly cover it - whole nodes
+ * of the coarsest layer fine enough for the output interval in the middle, and finer
+ * nodes towards the edges (including the newest, partly decimated, points).  This reads
+ * far less than layer 0 would, without the error of a single coarse layer whose points
+ * straddle the step boundaries.  Means of metrics with unknown top-level points cannot be
+ * weighted exactly this way, so if any are requested each step is read from the finest
+ * layer holding it instead.  Metrics whose modes cannot be merged between layers (median
+ * and mode) and the other kinds of series read from a single layer.  Layers
+ * that no longer hold the start of the range, having released it after their retention
+ * period or overwritten it in their ring, are left out altogether, so that older parts
+ * of the range are served from a coarser layer rather than read as missing.
+ *
+ * Each table file is read ahead one scan buffer at a time while the scan runs.  With
+ * TSDB_SERIES_ONCE in flags, whatever was read before the tail of each file is dropped
+ * from the page cache at the end. */
+static int tsdb_series_scan(tsdb_ctx_t *ctx, const unsigned int *metric_ids, unsigned int nseries,
+	int64_t start, int64_t end, unsigned int npoints, int flags, tsdb_series_mode_t mode,
+	tsdb_series_emit_t emit, void *arg)
 {
-	uint_fast32_t layer_interval, out_interval;
-	uint_fast32_t point;
-	tsdb_data_t *layer_values, *ptr;
-	unsigned int layer;
-	unsigned int n, naverage, actual_naverage, actual_npoints;
-	
-	FUNCTION_TRACE;
+	uint64_t layer_interval, out_interval;
+	uint64_t point, step_point, step_end, span_end[TSDB_MAX_LAYERS], weight[TSDB_MAX_LAYERS];
+	uint64_t nread[TSDB_MAX_LAYERS], width, last_point, finest_interval, step_interval;
+	tsdb_scan_t scans[TSDB_MAX_LAYERS][TSDB_MAX_METRICS];
+	tsdb_series_range_t ranges[2 * TSDB_MAX_LAYERS + 1];
+	tsdb_data_t *scan_buffer = NULL;
+	const tsdb_data_t *ptr;
+	unsigned int layer, finest = 0, s, c, l, r, nranges, nscans, offset[TSDB_MAX_METRICS];
+	unsigned int n, naverage, actual_npoints, scan_points;
+	unsigned int nselect[TSDB_MAX_METRICS], select_size = 0, sample = 1;
+	tsdb_downsample_mode_t ds_mode[TSDB_MAX_METRICS];
+	tsdb_agg_fn_t aggregate[TSDB_MAX_METRICS];
+	tsdb_accum_t acc[TSDB_MAX_METRICS];
+	tsdb_data_t values[TSDB_MAX_METRICS];
+	tsdb_data_t *select_buffer = NULL;
+	tsdb_agg_bucket_t *mode_table = NULL;
+	uint64_t *select_index = NULL;
+	tsdb_data_t *interp_y0 = NULL, *interp_y1 = NULL, *interp_frac = NULL;
+	int64_t *interp_timestamps = NULL;
+	unsigned int next = 0, npending = 0, anchored = 0, ninterp = 0, interp_size = npoints;
+	int interpolate = (mode == tsdbSeries_Linear || mode == tsdbSeries_Step);
+	double ax = 0.0, ay = 0.0, cx;
+	int64_t last, oldest, held[TSDB_MAX_LAYERS];
+	int rc, valid, need_select = 0, need_mode = 0, need_buffer, tree = 0, single = 0, refine = 0;
+	int tree_series[TSDB_MAX_METRICS];
 	
 	/* Apply automatic limits where start/end not specified */
 	if (start == TSDB_NO_TIMESTAMP) {
@@ -566,16 +4039,26 @@ int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int6
 	/* Sanity check */
 	if (end < start) {
 		ERROR("End time must be later than start\n");
-		return -EINVAL;
+		rc = -EINVAL;
+		goto done;
 	}
-	if (metric_id >= ctx->meta->nmetrics) {
-		ERROR("Requested metric is out of range\n");
-		return -ENOENT;
+	if (nseries == 0 || nseries > TSDB_MAX_METRICS || (mode == tsdbSeries_Lttb && nseries > 1)) {
+		ERROR("Bad number of metrics\n");
+		rc = -EINVAL;
+		goto done;
+	}
+	for (s = 0; s < nseries; s++) {
+		if (metric_ids[s] >= ctx->meta->nmetrics) {
+			ERROR("Requested metric is out of range\n");
+			rc = -ENOENT;
+			goto done;
+		}
 	}
 	if (npoints == 0) {
 		/* Request for zero points is not an error - just return 0 as requested */
 		INFO("Request for no points\n");
-		return 0;
+		rc = 0;
+		goto done;
 	}
 
 	/* Determine best layer to use for sourcing the result */
@@ -586,7 +4069,7 @@ int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int6
 		DEBUG("Returning single point at %" PRIi64 "\n", start);
 	} else {
 		out_interval = (end - start) / (npoints - 1); /* 1 less interval than points */
-		DEBUG("Requested %u points on interval %" PRIuFAST32 "\n", npoints, out_interval);
+		DEBUG("Requested %u points on interval %" PRIu64 "\n", npoints, out_interval);
 		if ((end - start) < (npoints - 1)) {
 			/* Minimum interval for output points is 1 second */
 			npoints = end - start + 1;
@@ -595,83 +4078,557 @@ int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int6
 		}
 	}
 	{
-		struct tm *tmp;
+		struct tm tm;
 		char timestr[100];
 		time_t t = (time_t)start;
-		tmp = localtime(&t);
-		strftime(timestr, sizeof(timestr), "%F %T", tmp);
+		localtime_r(&t, &tm);
+		strftime(timestr, sizeof(timestr), "%F %T", &tm);
 		DEBUG("Start time is: %s\n", timestr);
 	}
 	layer_interval = ctx->meta->interval;
+	weight[0] = 1;
 	for (layer = 0; layer < TSDB_MAX_LAYERS; layer++) {
+		if (mode == tsdbSeries_Envelope) {
+			/* Decimated layers cannot provide the minimum and maximum */
+			break;
+		}
 		if (ctx->meta->decimation[layer] == 0) {
 			/* This is the last layer - we have to use it */
 			break;
 		}
+		if (tsdb_layer_first(ctx, layer) &&
+				start < ctx->meta->start_time + (int64_t)(tsdb_layer_first(ctx, layer) * layer_interval)) {
+			/* This layer has released the start or wrapped past it, so use a coarser
+			 * one that still holds the older steps */
+			layer_interval *= ctx->meta->decimation[layer];
+			weight[layer + 1] = weight[layer] * ctx->meta->decimation[layer];
+			continue;
+		}
+		if (mode == tsdbSeries_Lttb && out_interval / layer_interval <= TSDB_SCAN_MAX_SELECT) {
+			/* Pick from the finest layer whose buckets can be held for selection */
+			break;
+		}
 		if (layer_interval * ctx->meta->decimation[layer] > out_interval) {
 			/* Next layer is downsampled too much, so use this one */
 			break;
 		}
 		layer_interval *= ctx->meta->decimation[layer];
+		weight[layer + 1] = weight[layer] * ctx->meta->decimation[layer];
 	}
 	naverage = (out_interval > layer_interval) ? out_interval / layer_interval : 1;
-	DEBUG("Using layer %u with interval %" PRIuFAST32 " decimation ratio = %u\n", layer, layer_interval, 
-		naverage);
+	if (interpolate) {
+		/* Only the input points either side of (or at) each output point are read */
+		naverage = (mode == tsdbSeries_Linear) ? 2 : 1;
+	}
 	
-	/* Allocate storage for values loaded from input layer */
-	layer_values = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * ctx->meta->nmetrics * naverage);
-	if (layer_values == NULL) {
-		CRITICAL("Out of memory\n");
-		return -ENOMEM;
+	/* The edges of each step are refined no further than the finest layer that, like
+	 * those above it, still holds the start of the step.  Layers that have lost even the
+	 * last step are not read at all. */
+	last = start + (int64_t)(npoints - 1) * out_interval;
+	if (last >= ctx->meta->start_time + ctx->meta->npoints * ctx->meta->interval)
+		last = ctx->meta->start_time + ctx->meta->npoints * ctx->meta->interval - 1;
+	for (l = 0; l <= layer; l++)
+		held[l] = ctx->meta->start_time + (int64_t)(tsdb_layer_first(ctx, l) * ctx->meta->interval * weight[l]);
+	for (finest = layer; finest > 0 && last >= held[finest - 1]; finest--)
+		;
+	
+	/* Row tables are scanned once for all of the metrics, columns one per metric.  A
+	 * single metric of a row table is fetched alone so that only it is decoded from
+	 * compressed blocks. */
+	nscans = TSDB_IS_COLUMNAR(ctx) ? nseries : 1;
+	for (s = 0; s < nseries; s++) {
+		offset[s] = (TSDB_IS_COLUMNAR(ctx) || nseries == 1) ? 0 : metric_ids[s];
+		ds_mode[s] = (mode != tsdbSeries_Aggregate) ? tsdbDownsample_Mean : TSDB_DS_MODE(ctx, metric_ids[s]);
+		aggregate[s] = (mode == tsdbSeries_Envelope) ? tsdb_agg_select_all() : tsdb_agg_select(ds_mode[s]);
+		if (mode == tsdbSeries_Lttb || ds_mode[s] == tsdbDownsample_Median || ds_mode[s] == tsdbDownsample_Mode)
+			need_select = 1;
+		if (ds_mode[s] == tsdbDownsample_Mode)
+			need_mode = 1;
+		tree_series[s] = (mode == tsdbSeries_Aggregate && layer > finest &&
+			ds_mode[s] != tsdbDownsample_Median && ds_mode[s] != tsdbDownsample_Mode);
+		tree |= tree_series[s];
+		single |= !tree_series[s];
+		if (tree_series[s] && ds_mode[s] == tsdbDownsample_Mean &&
+				!(ctx->meta->flags[metric_ids[s]] & TSDB_FLAG_COMPLETE))
+			refine = 1;
+	}
+	DEBUG("Using layer %u with interval %" PRIu64 " decimation ratio = %u%s\n", layer, layer_interval,
+		naverage, refine ? " with the finest layer for exact means" :
+		tree ? " with finer layers at the edges" : "");
+	
+	/* Input points are streamed through a fixed size scan buffer, so memory use does not
+	 * depend on the range or number of points requested.  Reads are aligned to the scan
+	 * size (which is a whole number of compressed blocks where possible) and cover only
+	 * the span of input points that contribute to the output. */
+	scan_points = TSDB_SCAN_BUFFER_SIZE / nscans / (tree ? layer - finest + 1 : 1) / TSDB_COLUMN_POINT_SIZE(ctx);
+	if (scan_points > TSDB_BLOCK_POINTS)
+		scan_points -= scan_points % TSDB_BLOCK_POINTS;
+	finest_interval = ctx->meta->interval * weight[finest];
+	width = (out_interval > finest_interval) ? out_interval / finest_interval : 1;
+	last_point = (last >= ctx->meta->start_time) ? (last - ctx->meta->start_time) / finest_interval + width : 0;
+	for (l = tree ? finest : layer; l <= layer; l++) {
+		span_end[l] = tree ? (last_point + weight[l] / weight[finest] - 1) / (weight[l] / weight[finest]) : 0;
+		if (l == layer && single && last >= ctx->meta->start_time &&
+				span_end[l] < (last - ctx->meta->start_time) / layer_interval + naverage)
+			span_end[l] = (last - ctx->meta->start_time) / layer_interval + naverage;
+		if (span_end[l] > tsdb_layer_npoints(ctx, l, ctx->meta->npoints))
+			span_end[l] = tsdb_layer_npoints(ctx, l, ctx->meta->npoints);
+		nread[l] = 0;
 	}
 	
-	/* Generate output points by averaging all available input points between the start
-	 * and end times for each output step.  Output timestamps are rounded down onto the
-	 * input interval - there is no interpolation. */
+	/* Mapped tables are used in place unless gaps or expired points have to be masked,
+	 * blocks decoded, segments switched or rings unwrapped */
+#ifdef TSDB_MMAP_TABLES
+	need_buffer = TSDB_IS_COMPRESSED(ctx) || TSDB_IS_SEGMENTED(ctx);
+	for (l = tree ? finest : layer; l <= layer; l++)
+		need_buffer |= (ctx->meta->ngaps[l] != 0) || TSDB_IS_LIMITED(ctx, l);
+#else
+	need_buffer = 1;
+#endif
+	if (need_buffer) {
+		scan_buffer = (tsdb_data_t*)malloc(TSDB_SCAN_BUFFER_SIZE);
+		if (scan_buffer == NULL) {
+			CRITICAL("Out of memory\n");
+			rc = -ENOMEM;
+			goto done;
+		}
+	}
+	for (l = tree ? finest : layer, n = 0; l <= layer; l++) {
+		for (c = 0; c < nscans; c++, n++) {
+			scans[l][c].data = NULL;
+			scans[l][c].start = scans[l][c].end = 0;
+			scans[l][c].stride = 1;
+			scans[l][c].buffer = scan_buffer ? scan_buffer + n * scan_points * TSDB_COLUMN_WIDTH(ctx) : NULL;
+			scans[l][c].first = UINT64_MAX;
+		}
+	}
+	
+	/* Work areas for medians and modes are allocated once for the whole series (this runs
+	 * concurrently with other queries, so the context's work buffer cannot be used).  Very
+	 * wide output steps are sampled evenly to keep within TSDB_SCAN_MAX_SELECT values.
+	 * LTTB holds two steps (buckets) with the position of each value. */
+	if (need_select) {
+		sample = (naverage + TSDB_SCAN_MAX_SELECT - 1) / TSDB_SCAN_MAX_SELECT;
+		select_size = (naverage + sample - 1) / sample;
+		select_buffer = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * select_size * (nseries + (mode == tsdbSeries_Lttb)));
+		if (need_mode)
+			mode_table = (tsdb_agg_bucket_t*)malloc(sizeof(tsdb_agg_bucket_t) * tsdb_agg_mode_buckets(select_size));
+		if (mode == tsdbSeries_Lttb)
+			select_index = (uint64_t*)malloc(sizeof(uint64_t) * select_size * 2);
+		if (select_buffer == NULL || (need_mode && mode_table == NULL) ||
+				(mode == tsdbSeries_Lttb && select_index == NULL)) {
+			CRITICAL("Out of memory\n");
+			rc = -ENOMEM;
+			goto done;
+		}
+	}
+	
+	if (interpolate) {
+		interp_y0 = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * interp_size * nseries);
+		interp_y1 = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * interp_size * nseries);
+		interp_frac = (tsdb_data_t*)malloc(sizeof(tsdb_data_t) * interp_size);
+		interp_timestamps = (int64_t*)malloc(sizeof(int64_t) * interp_size);
+		if (interp_y0 == NULL || interp_y1 == NULL || interp_frac == NULL || interp_timestamps == NULL) {
+			CRITICAL("Out of memory\n");
+			rc = -ENOMEM;
+			goto done;
+		}
+	}
+	
+	/* Steps before the oldest point still held by the layer have no data */
+	oldest = ctx->meta->start_time + (int64_t)(tsdb_layer_first(ctx, layer) * layer_interval);
+	
+	/* Generate output points by combining all available input points between the start
+	 * and end times for each output step, in the same way as each metric is downsampled.
+	 * Output timestamps are rounded down onto the input interval unless interpolating. */
 	for (actual_npoints = 0; npoints; npoints--, start += out_interval) {
 		/* Determine if this point is in-range of the input table */
-		if (start < ctx->meta->start_time || 
+		if (start < oldest || 
 			start >= ctx->meta->start_time + ctx->meta->npoints * ctx->meta->interval) {
 			/* No - there is no data at this time point */
 			continue;
 		}
 		
 		/* There may be data for this point in the table.  Calculate the range of input points
-		 * covered by the output period and read them for averaging */
-		point = (start - ctx->meta->start_time) / layer_interval;
-		if (lseek(ctx->table_fd[layer], sizeof(tsdb_data_t) * point * ctx->meta->nmetrics, SEEK_SET) < 0) {
-			ERROR("Table seek error for point %" PRIuFAST32 ": %s\n", point, strerror(errno));
-			return -errno;
+		 * covered by the output period and aggregate them as they are scanned */
+		nranges = 0;
+		if (tree) {
+			/* Climb the tree while there are whole nodes of the next layer in the middle,
+			 * from the finest layer holding the start of the step */
+			for (l = layer; l > finest && start >= held[l - 1]; l--)
+				;
+			step_interval = ctx->meta->interval * weight[l];
+			step_point = (start - ctx->meta->start_time) / step_interval;
+			step_end = step_point + ((out_interval > step_interval) ? out_interval / step_interval : 1);
+			if (step_end > span_end[l])
+				step_end = span_end[l];
+			for ( ; l < layer && step_point < step_end && !refine; l++) {
+				uint64_t up_first = (step_point + ctx->meta->decimation[l] - 1) / ctx->meta->decimation[l];
+				uint64_t up_end = step_end / ctx->meta->decimation[l];
+				
+				if (up_first >= up_end)
+					break;
+				if (step_point < up_first * ctx->meta->decimation[l])
+					ranges[nranges++] = (tsdb_series_range_t){ l, step_point, up_first * ctx->meta->decimation[l], 1 };
+				if (up_end * ctx->meta->decimation[l] < step_end)
+					ranges[nranges++] = (tsdb_series_range_t){ l, up_end * ctx->meta->decimation[l], step_end, 1 };
+				step_point = up_first;
+				step_end = up_end;
+			}
+			ranges[nranges++] = (tsdb_series_range_t){ l, step_point, step_end, 1 };
 		}
-		if (read(ctx->table_fd[layer], layer_values, sizeof(tsdb_data_t) * naverage * ctx->meta->nmetrics) < 0) {
-			ERROR("Table read error for point %" PRIuFAST32 ": %s\n", point, strerror(errno));
-			return -errno;
+		if (single) {
+			step_point = (start - ctx->meta->start_time) / layer_interval;
+			step_end = (step_point + naverage < span_end[layer]) ? step_point + naverage : span_end[layer];
+			ranges[nranges++] = (tsdb_series_range_t){ layer, step_point, step_end, 0 };
+		}
+		for (s = 0; s < nseries; s++) {
+			acc[s].sum = 0.0;
+			acc[s].min = INFINITY;
+			acc[s].max = -INFINITY;
+			acc[s].count = 0;
+			nselect[s] = 0;
+			if (interpolate)
+				interp_y0[s * interp_size + ninterp] = interp_y1[s * interp_size + ninterp] = NAN;
+		}
+		for (r = 0; r < nranges; r++) {
+			l = ranges[r].layer;
+			for (point = ranges[r].first; point < ranges[r].end; point += n) {
+				n = ranges[r].end - point;
+				for (c = 0; c < nscans; c++) {
+					tsdb_scan_t *scan = &scans[l][c];
+					
+					if (TSDB_IS_COLUMNAR(ctx) && tree_series[c] != ranges[r].tree)
+						continue;
+					if (point < scan->start || point >= scan->end) {
+						/* Refill the scan buffer, and have the kernel read the
+						 * next part of a longer span while this one is used */
+						unsigned int count = scan_points - point % scan_points;
+						unsigned int column = TSDB_IS_COLUMNAR(ctx) ? metric_ids[c] : 0;
+						
+						if (count > span_end[l] - point)
+							count = span_end[l] - point;
+						if (span_end[l] - point > count) {
+							if (scan->first == UINT64_MAX) {
+								tsdb_column_advise(ctx, l, column, point, span_end[l] - point,
+									tsdbAdvice_Sequential);
+							}
+							tsdb_column_advise(ctx, l, column, point + count,
+								(span_end[l] - point - count < scan_points) ?
+								span_end[l] - point - count : scan_points, tsdbAdvice_WillNeed);
+						}
+						if (scan->first == UINT64_MAX)
+							scan->first = point;
+						if (TSDB_IS_COLUMNAR(ctx) || nseries == 1) {
+							scan->data = tsdb_table_get_metric(ctx, l, metric_ids[c], point, &count,
+								scan->buffer, &scan->stride);
+						} else {
+							scan->data = tsdb_table_get(ctx, l, point, &count, scan->buffer);
+							scan->stride = ctx->meta->nmetrics;
+						}
+						if (scan->data == NULL) {
+							rc = -errno;
+							goto done;
+						}
+						DEBUG("Scanned %u points from %" PRIu64 " in layer %u\n", count, point, l);
+						scan->start = point;
+						scan->end = point + count;
+						nread[l] += count;
+					}
+					if (scan->end - point < n)
+						n = scan->end - point;
+				}
+				if (n == 0) {
+					/* Table is short */
+					break;
+				}
+				
+				/* Aggregate the part of the step that is in the buffers, ignoring any NAN points */
+				for (s = 0; s < nseries; s++) {
+					tsdb_scan_t *scan = &scans[l][TSDB_IS_COLUMNAR(ctx) ? s : 0];
+					unsigned int i;
+					
+					if (tree_series[s] != ranges[r].tree)
+						continue;
+					ptr = scan->data + (point - scan->start) * scan->stride + offset[s];
+					if (ranges[r].tree && l != ranges[0].layer) {
+						/* Merge nodes from a coarser layer than the edge of the step */
+						tsdb_accum_t part = { 0.0, INFINITY, -INFINITY, 0, 0 };
+						
+						aggregate[s](ptr, n, scan->stride, &part);
+						tsdb_accum_merge(&acc[s], &part, ds_mode[s], weight[l] / weight[ranges[0].layer]);
+						continue;
+					}
+					if (interpolate) {
+						for (i = 0; i < n; i++)
+							(point + i == ranges[r].first ? interp_y0 : interp_y1)[s * interp_size + ninterp] =
+								ptr[i * scan->stride];
+						continue;
+					}
+					aggregate[s](ptr, n, scan->stride, &acc[s]);
+					if (mode != tsdbSeries_Lttb && ds_mode[s] != tsdbDownsample_Median &&
+							ds_mode[s] != tsdbDownsample_Mode)
+						continue;
+					for (i = (sample - (point - ranges[r].first) % sample) % sample; i < n; i += sample) {
+						if (isnan(ptr[i * scan->stride]))
+							continue;
+						if (select_index)
+							select_index[next * select_size + nselect[s]] = point + i;
+						select_buffer[(s + next) * select_size + nselect[s]++] = ptr[i * scan->stride];
+					}
+				}
+			}
+		}
+		
+		if (interpolate) {
+			/* Position between the input points.  The interval is exact at input points,
+			 * where the following point need not be known. */
+			interp_frac[ninterp] = (mode == tsdbSeries_Linear) ?
+				(tsdb_data_t)((start - ctx->meta->start_time) % layer_interval) / layer_interval : 0;
+			if (interp_frac[ninterp] == 0) {
+				for (s = 0; s < nseries; s++)
+					interp_y1[s * interp_size + ninterp] = interp_y0[s * interp_size + ninterp];
+			}
+			interp_timestamps[ninterp++] = start;
+			continue;
 		}
 		
-		/* Generate average ignoring any NAN points */
-		points->timestamp = start;
-		points->value = 0.0;
-		ptr = layer_values + metric_id;
-		actual_naverage = 0;
-		for (n = naverage; n; n--, ptr += ctx->meta->nmetrics) {
-			if (!isnan(*ptr)) {
-				points->value += *ptr;
-				actual_naverage++;
+		if (mode == tsdbSeries_Lttb) {
+			/* Choose the point of the pending bucket forming the largest triangle with the
+			 * previous choice and the mean of this bucket.  Empty buckets are passed over. */
+			if (nselect[0] == 0)
+				continue;
+			if (npending) {
+				const tsdb_data_t *pending = select_buffer + (next ^ 1) * select_size;
+				const uint64_t *pending_index = select_index + (next ^ 1) * select_size;
+				unsigned int i;
+				
+				for (i = 0, cx = 0.0; i < nselect[0]; i++)
+					cx += select_index[next * select_size + i];
+				cx /= nselect[0];
+				i = anchored ? tsdb_agg_lttb(pending, pending_index, npending, ax, ay,
+					cx, acc[0].sum / acc[0].count) : 0;
+				ax = pending_index[i];
+				ay = pending[i];
+				anchored = 1;
+				emit(arg, ctx->meta->start_time + (int64_t)(pending_index[i] * layer_interval), &pending[i], acc);
+				actual_npoints++;
 			}
+			npending = nselect[0];
+			next ^= 1;
+			continue;
+		}
+		
+		valid = 0;
+		for (s = 0; s < nseries; s++) {
+			DEBUG("Metric %u aggregated %u points\n", metric_ids[s], acc[s].count);
+			if (acc[s].count == 0)
+				values[s] = NAN;
+			else if (mode == tsdbSeries_Envelope)
+				values[s] = (tsdb_data_t)(acc[s].sum / (double)acc[s].count);
+			else if (ds_mode[s] == tsdbDownsample_Median)
+				values[s] = tsdb_agg_median(select_buffer + s * select_size, nselect[s], 1,
+					select_buffer + s * select_size);
+			else if (ds_mode[s] == tsdbDownsample_Mode)
+				values[s] = tsdb_agg_mode(select_buffer + s * select_size, nselect[s], 1, mode_table);
+			else
+				values[s] = tsdb_accum_value(ctx, metric_ids[s], &acc[s]);
+			if (!isnan(values[s]))
+				valid = 1;
 		}
-		DEBUG("averaged %u points\n", actual_naverage);
-		if (actual_naverage) {
+		if (valid) {
 			/* A valid point was generated */
-			points->value /= (double)actual_naverage;
-			points++;
+			emit(arg, start, values, acc);
 			actual_npoints++;
 		}
 	}
 	
-	free(layer_values);
+	if (interpolate) {
+		/* Interpolate each metric over the whole output at once */
+		for (s = 0; s < nseries && mode == tsdbSeries_Linear; s++)
+			tsdb_agg_lerp(interp_y0 + s * interp_size, interp_y1 + s * interp_size, interp_frac,
+				interp_y0 + s * interp_size, ninterp);
+		for (n = 0; n < ninterp; n++) {
+			valid = 0;
+			for (s = 0; s < nseries; s++) {
+				values[s] = interp_y0[s * interp_size + n];
+				if (!isnan(values[s]))
+					valid = 1;
+			}
+			if (valid) {
+				emit(arg, interp_timestamps[n], values, acc);
+				actual_npoints++;
+			}
+		}
+	}
+	
+	if (npending) {
+		/* LTTB keeps the first and last input points */
+		const tsdb_data_t *pending = select_buffer + (next ^ 1) * select_size;
+		const uint64_t *pending_index = select_index + (next ^ 1) * select_size;
+		unsigned int i = anchored ? npending - 1 : 0;
+		
+		emit(arg, ctx->meta->start_time + (int64_t)(pending_index[i] * layer_interval), &pending[i], acc);
+		actual_npoints++;
+	}
+	
+	for (l = tree ? finest : layer; l <= layer; l++)
+		DEBUG("Read %" PRIu64 " points (%zu bytes) from layer %u\n", nread[l],
+			(size_t)nread[l] * TSDB_COLUMN_POINT_SIZE(ctx) * nscans, l);
+	
+	/* A one-off scan leaves only the tails, which are read all the time, cached */
+	if (flags & TSDB_SERIES_ONCE) {
+		for (l = tree ? finest : layer; l <= layer; l++) {
+			uint64_t tail = tsdb_layer_tail(ctx, l);
+			
+			for (c = 0; c < nscans; c++) {
+				uint64_t last = (scans[l][c].end < tail) ? scans[l][c].end : tail;
+				
+				if (scans[l][c].first < last) {
+					tsdb_column_advise(ctx, l, TSDB_IS_COLUMNAR(ctx) ? metric_ids[c] : 0,
+						scans[l][c].first, last - scans[l][c].first, tsdbAdvice_DontNeed);
+				}
+			}
+		}
+	}
 	DEBUG("generated %u points\n", actual_npoints);
+	rc = (int)actual_npoints;
+	
+done:
+	free(scan_buffer);
+	free(select_buffer);
+	free(select_index);
+	free(mode_table);
+	free(interp_y0);
+	free(interp_y1);
+	free(interp_frac);
+	free(interp_timestamps);
+	return rc;
+}
+
+/* Locks a context for a series query, first completing any decimation still waiting for
+ * a background thread so that the lower layers are never read out of date */
+static int tsdb_series_lock(tsdb_ctx_t *ctx)
+{
+	int rc;
+	
+	TSDB_RDLOCK(ctx);
+	while (TSDB_IS_PENDING(ctx)) {
+		TSDB_RWUNLOCK(ctx);
+		TSDB_WRLOCK(ctx);
+		rc = tsdb_decimate_pending(ctx);
+		TSDB_RWUNLOCK(ctx);
+		if (rc < 0)
+			return rc;
+		TSDB_RDLOCK(ctx);
+	}
+	return 0;
+}
+
+static void tsdb_series_emit_point(void *arg, int64_t timestamp, const tsdb_data_t *values,
+	const tsdb_accum_t *acc)
+{
+	tsdb_series_point_t **points = (tsdb_series_point_t**)arg;
+	
+	(*points)->timestamp = timestamp;
+	(*points)->value = values[0];
+	(*points)++;
+}
+
+int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int64_t end, 
+	unsigned int npoints, int flags, tsdb_series_point_t *points)
+{
+	int rc, mode;
+	
+	FUNCTION_TRACE;
+	
+	if ((mode = tsdb_series_mode(flags)) < 0)
+		return mode;
+	
+	if ((rc = tsdb_series_lock(ctx)) < 0)
+		return rc;
+	rc = tsdb_series_scan(ctx, &metric_id, 1, start, end, npoints, flags, (tsdb_series_mode_t)mode,
+		tsdb_series_emit_point, &points);
+	TSDB_RWUNLOCK(ctx);
+	return rc;
+}
+
+/* Output arrays for tsdb_get_series_multi */
+typedef struct {
+	int64_t		*timestamps;
+	tsdb_data_t	*values;
+	unsigned int	nseries;
+} tsdb_series_multi_t;
+
+static void tsdb_series_emit_multi(void *arg, int64_t timestamp, const tsdb_data_t *values,
+	const tsdb_accum_t *acc)
+{
+	tsdb_series_multi_t *out = (tsdb_series_multi_t*)arg;
+	
+	*out->timestamps++ = timestamp;
+	memcpy(out->values, values, sizeof(tsdb_data_t) * out->nseries);
+	out->values += out->nseries;
+}
+
+int tsdb_get_series_multi(tsdb_ctx_t *ctx, const unsigned int *metric_ids, unsigned int nseries,
+	int64_t start, int64_t end, unsigned int npoints, int flags, int64_t *timestamps, tsdb_data_t *values)
+{
+	tsdb_series_multi_t out = { timestamps, values, nseries };
+	int rc, mode;
+	
+	FUNCTION_TRACE;
+	
+	if ((mode = tsdb_series_mode(flags)) < 0)
+		return mode;
+	
+	if ((rc = tsdb_series_lock(ctx)) < 0)
+		return rc;
+	rc = tsdb_series_scan(ctx, metric_ids, nseries, start, end, npoints, flags, (tsdb_series_mode_t)mode,
+		tsdb_series_emit_multi, &out);
+	TSDB_RWUNLOCK(ctx);
+	return rc;
+}
+
+/* Output arrays for tsdb_get_series_envelope */
+typedef struct {
+	int64_t		*timestamps;
+	tsdb_envelope_t	*envelopes;
+	unsigned int	nseries;
+} tsdb_series_envelope_t;
+
+static void tsdb_series_emit_envelope(void *arg, int64_t timestamp, const tsdb_data_t *values,
+	const tsdb_accum_t *acc)
+{
+	tsdb_series_envelope_t *out = (tsdb_series_envelope_t*)arg;
+	unsigned int s;
+	
+	*out->timestamps++ = timestamp;
+	for (s = 0; s < out->nseries; s++, out->envelopes++) {
+		out->envelopes->count = acc[s].count;
+		if (acc[s].count) {
+			out->envelopes->min = (tsdb_data_t)acc[s].min;
+			out->envelopes->max = (tsdb_data_t)acc[s].max;
+		} else {
+			out->envelopes->min = out->envelopes->max = NAN;
+		}
+		out->envelopes->mean = values[s];
+	}
+}
+
+int tsdb_get_series_envelope(tsdb_ctx_t *ctx, const unsigned int *metric_ids, unsigned int nseries,
+	int64_t start, int64_t end, unsigned int npoints, int flags, int64_t *timestamps, tsdb_envelope_t *envelopes)
+{
+	tsdb_series_envelope_t out = { timestamps, envelopes, nseries };
+	int rc;
 	
-	return actual_npoints;
+	FUNCTION_TRACE;
+	
+	if ((rc = tsdb_series_lock(ctx)) < 0)
+		return rc;
+	rc = tsdb_series_scan(ctx, metric_ids, nseries, start, end, npoints, flags, tsdbSeries_Envelope,
+		tsdb_series_emit_envelope, &out);
+	TSDB_RWUNLOCK(ctx);
+	return rc;
 }
 
 int tsdb_get_key(tsdb_ctx_t *ctx, tsdb_key_id_t key_id, tsdb_key_t *key)
@@ -685,13 +4642,16 @@ int tsdb_get_key(tsdb_ctx_t *ctx, tsdb_key_id_t key_id, tsdb_key_t *key)
 
 	DEBUG("Request for node %016" PRIX64 " key %d\n", ctx->meta->node_id, (int)key_id);
 
+	TSDB_RDLOCK(ctx);
 	if (ctx->meta->key[(int)key_id].flags == 0) {
+		TSDB_RWUNLOCK(ctx);
 		INFO("No key defined\n");
 		return -ENOENT;
 	}
 
 	/* Return stored key */
 	memcpy(key, &ctx->meta->key[(int)key_id].key, sizeof(tsdb_key_t));
+	TSDB_RWUNLOCK(ctx);
 	return 0;
 }
 
@@ -706,6 +4666,7 @@ int tsdb_set_key(tsdb_ctx_t *ctx, tsdb_key_id_t key_id, tsdb_key_t *key)
 
 	DEBUG("Update to node %016" PRIX64 " key %d\n", ctx->meta->node_id, (int)key_id);
 
+	TSDB_WRLOCK(ctx);
 	if (key) {
 		/* Store new key */
 		ctx->meta->key[(int)key_id].flags = TSDB_KEY_IN_USE;
@@ -714,9 +4675,8 @@ int tsdb_set_key(tsdb_ctx_t *ctx, tsdb_key_id_t key_id, tsdb_key_t *key)
 		/* Erase stored key */
 		memset(&ctx->meta->key[(int)key_id], 0, sizeof(tsdb_key_info_t));
 	}
-
-	/* Flush metadata */
-	msync(ctx->meta, sizeof(tsdb_metadata_t), MS_ASYNC);
+	tsdb_ctx_changed(ctx);
+	TSDB_RWUNLOCK(ctx);
 
 	return 0;
 }
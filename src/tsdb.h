@@ -29,17 +29,25 @@
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #define TSDB_PTHREAD_LOCKING
 
+/* Access table files through shared memory mappings instead of read/write calls */
+#define TSDB_MMAP_TABLES
+
+/* Count the table pages read that were and were not already in the page cache (see
+ * tsdb_get_page_stats).  Each read costs an extra system call. */
+#define TSDB_PAGE_STATS
+
 #ifdef TSDB_PTHREAD_LOCKING
 #include <pthread.h>
 #endif
 
 #define TSDB_MAGIC_META		0x42445354 // TSDB (little-endian)
 
-#define TSDB_VERSION		0
+#define TSDB_VERSION		9
 
 /* Flags to specify what to do when padding unavailable data points */
 typedef enum {
@@ -62,6 +70,24 @@ typedef enum {
 #define TSDB_DOWNSAMPLE_SHIFT	8
 #define TSDB_DOWNSAMPLE_MASK	15
 
+/* Set in a metric's flags from creation until one of its top-level points is stored with
+ * an unknown value.  Nodes created by earlier versions never have it. */
+#define TSDB_FLAG_COMPLETE	(1 << 16)
+
+/* Arrangement of the data in a node's table files */
+typedef enum {
+	tsdbLayout_Row = 0,		/*< One file per layer holding all metrics for each point */
+	tsdbLayout_Columnar,		/*< One file per metric per layer */
+	tsdbLayout_Max
+} tsdb_layout_t;
+
+/* Encoding of the data in a node's table files */
+typedef enum {
+	tsdbCompression_None = 0,	/*< Raw values */
+	tsdbCompression_Gorilla,	/*< Completed blocks XOR-encoded (row layout only) */
+	tsdbCompression_Max
+} tsdb_compression_t;
+
 /* Key flags */
 #define TSDB_KEY_IN_USE			(1 << 0)
 
@@ -93,10 +119,27 @@ typedef enum {
 #define TSDB_METADATA_FORMAT	"%016" PRIX64 ".tsdb"
 /* Format for table data filename ((uint64_t)node id, (unsigned int)layer) */
 #define TSDB_TABLE_FORMAT	"%016" PRIX64 "_%u_.dat"
+/* Format for columnar data filename ((uint64_t)node id, (unsigned int)layer, (unsigned int)metric) */
+#define TSDB_COLUMN_FORMAT	"%016" PRIX64 "_%u_%u.dat"
+/* Format for compressed block store and block index filenames ((uint64_t)node id, (unsigned int)layer) */
+#define TSDB_BLOCK_FORMAT	"%016" PRIX64 "_%u_.blk"
+#define TSDB_INDEX_FORMAT	"%016" PRIX64 "_%u_.idx"
+/* Format for segment filename ((uint64_t)node id, (unsigned int)layer, (unsigned int)metric
+ * (0 if not columnar), (uint64_t)segment) */
+#define TSDB_SEGMENT_FORMAT	"%016" PRIX64 "_%u_%u_%" PRIu64 ".seg"
 
 /* Max size for generated paths */
 #define TSDB_MAX_PATH		256
 
+/* Node files are kept in two levels of directories named by the lowest two bytes of the
+ * node id, so that no directory holds more than a fraction of a large store.  Format for
+ * the directories ((unsigned int)first level, (unsigned int)second level) */
+#define TSDB_SHARD_FORMAT	"%02X/%02X/"
+#define TSDB_SHARD(node_id)	(unsigned int)((node_id) & 0xff), (unsigned int)(((node_id) >> 8) & 0xff)
+/* Generates the path of a node file from one of the filename formats above */
+#define TSDB_PATH(path, format, node_id, ...) \
+	snprintf(path, TSDB_MAX_PATH, TSDB_SHARD_FORMAT format, TSDB_SHARD(node_id), (uint64_t)(node_id), ##__VA_ARGS__)
+
 /* Maximum number of metrics per data set */
 #define TSDB_MAX_METRICS	32
 /* Maximum number of layers per data set */
@@ -105,26 +148,134 @@ typedef enum {
 /* Maximum size of padding buffer */
 #define TSDB_MAX_PADDING_BLOCK	(1024 * 1024)
 
+/* Size of the buffer through which series queries stream table data (bytes) */
+#define TSDB_SCAN_BUFFER_SIZE	(256 * 1024)
+/* Maximum number of values considered for the median, mode or LTTB choice of one output
+ * point of a series.  Wider output points are sampled evenly. */
+#define TSDB_SCAN_MAX_SELECT	16384
+
+/* tsdb_get_series flags */
+/* Return representative input points chosen by Largest-Triangle-Three-Buckets instead of
+ * aggregates */
+#define TSDB_SERIES_LTTB	(1 << 0)
+/* Return values at exactly the requested output timestamps, interpolated linearly between
+ * the input points either side */
+#define TSDB_SERIES_LINEAR	(1 << 1)
+/* Return values at exactly the requested output timestamps, holding the last input point
+ * at or before each */
+#define TSDB_SERIES_STEP	(1 << 2)
+/* The range will not be read again soon (as for an export), so the pages read for it are
+ * dropped from the page cache afterwards, apart from the tail of each table */
+#define TSDB_SERIES_ONCE	(1 << 3)
+
+/* Gaps of at least this many points are left as holes in the table files and
+ * recorded in the metadata instead of being padded */
+#define TSDB_SPARSE_GAP_POINTS	1024
+/* Maximum number of sparse gaps recorded for each layer */
+#define TSDB_MAX_GAPS		16
+
+/* Number of points in each compressed block.  A block of a row-layout table should be
+ * a whole number of pages so that its raw space can be released once compressed. */
+#define TSDB_BLOCK_POINTS	1024
+
+/* Table files and their mappings are grown in steps of this size (must be a multiple
+ * of the page size) */
+#define TSDB_TABLE_MAP_CHUNK	(1024 * 1024)
+/* Space held by points that have passed their layer's retention period is released from
+ * table files in aligned steps of this size (must be a multiple of the page size) */
+#define TSDB_RELEASE_CHUNK	(64 * 1024)
+/* The newest part (bytes) of each table file, which most queries read, is prefetched when
+ * a node is opened and kept in the page cache by TSDB_SERIES_ONCE */
+#define TSDB_TAIL_SIZE		(256 * 1024)
+
+/* Default limits for the cache of open contexts.  Idle contexts are evicted
+ * least-recently-used first when either limit is exceeded. */
+#define TSDB_CACHE_MAX_FDS	512
+#define TSDB_CACHE_MAX_MEMORY	(64 * 1024 * 1024)
+/* Number of hash buckets for cached context lookup (must be a power of 2) */
+#define TSDB_CACHE_HASH_SIZE	1024
+
+/* Maximum number of background decimation threads */
+#define TSDB_MAX_DECIMATE_THREADS	16
+/* Top-level points waiting for background decimation are recorded as a single range.  An
+ * update further than this many points from the range has the range decimated first,
+ * instead of widening it over points that have not changed. */
+#define TSDB_DECIMATE_MAX_GAP	4096
+
+/* Default time (ms) between metadata write-backs by the flusher */
+#define TSDB_FLUSH_DEFAULT_INTERVAL	1000
+
 /* Special value for passing a "don't care" timestamp by value */
 #define TSDB_NO_TIMESTAMP	INT64_MAX
 
-/* NOTE: A 32-bit value for npoints is considered sufficient since this would
- * allow for over 135 years worth of 1 second data! */
+/* Value of acc_point in the metadata for a layer without valid accumulators */
+#define TSDB_ACC_INVALID	UINT64_MAX
+
+/* Range of points [start, end) in a layer that has never been written */
+typedef struct {
+	uint64_t	start;
+	uint64_t	end;
+} tsdb_gap_t;
 
-/* Data set metadata */
+/* Data set metadata.  Version 7 widened point numbers to 64 bits and added segment_points,
+ * so earlier headers are converted rather than extended when they are loaded. */
 typedef struct {
 	uint32_t	magic;				/*< Magic number - indicates TSDB metadata file */
 	uint32_t	version;			/*< Version identifier */
 	uint64_t	node_id;			/*< Node ID (should match filename) */
 	uint32_t	nmetrics;			/*< Number of metrics in this data set */
-	uint32_t	npoints;			/*< Number of points we expect to find in the top-level table */
+	uint32_t	segment_points;			/*< Number of points in each segment file (0 for one file per layer) */
+	uint64_t	npoints;			/*< Number of points we expect to find in the top-level table */
 	int64_t		start_time;			/*< Timestamp of first entry in table (relative to epoch) */
 	uint32_t	interval;			/*< Interval in seconds between entries at the top-level */
 	uint32_t	decimation[TSDB_MAX_LAYERS];	/*< Number of points to combine when downsampling to each lower layer */
 	uint32_t	flags[TSDB_MAX_METRICS];	/*< Flags (for each metric) */
 	tsdb_key_info_t	key[TSDB_MAX_KEYS];	/*< MAC keystore */
+	/* Version 1 */
+	uint64_t	acc_point[TSDB_MAX_LAYERS];	/*< Point in the next layer described by each layer's accumulators */
+	/* Version 2 */
+	uint32_t	layout;				/*< Table file layout \see tsdb_layout_t */
+	/* Version 3 */
+	uint32_t	ngaps[TSDB_MAX_LAYERS];		/*< Number of sparse gaps in each layer */
+	tsdb_gap_t	gaps[TSDB_MAX_LAYERS][TSDB_MAX_GAPS];	/*< Unwritten ranges (unordered) that read as unknown */
+	/* Version 4 */
+	uint32_t	compression;			/*< Table encoding \see tsdb_compression_t */
+	uint32_t	nsealed[TSDB_MAX_LAYERS];	/*< Number of leading blocks of each layer held compressed */
+	/* Version 5 */
+	uint64_t	pending_start;			/*< First top-level point waiting to be decimated into the lower layers */
+	uint64_t	pending_end;			/*< Point after the last waiting (none if not after pending_start) */
+	uint64_t	pending_npoints;		/*< Number of top-level points when the lower layers were last complete */
+	/* Version 6 */
+	uint64_t	sequence;			/*< Incremented by every change to the node */
+	uint64_t	synced_sequence;		/*< Value of sequence when the tables were last synced */
+	/* Version 8 */
+	uint64_t	capacity[TSDB_MAX_LAYERS];	/*< Number of points each layer holds before wrapping (0 if unbounded) */
+	uint64_t	ring_end[TSDB_MAX_LAYERS];	/*< Point after the newest written to each wrapping layer */
+	/* Version 9 */
+	uint64_t	retention[TSDB_MAX_LAYERS];	/*< Seconds of data each layer keeps before the newest point (0 to keep all) */
+	uint64_t	base[TSDB_MAX_LAYERS];		/*< First point of each layer not yet released */
 } tsdb_metadata_t;
 
+/* Running aggregate of the points in one layer that contribute to the newest point in the
+ * next layer down.  The metadata file is followed by one of these per metric for each
+ * layer that is downsampled.  Only the fields used by the metric's downsampling mode are
+ * maintained incrementally. */
+typedef struct {
+	double		sum;				/*< Sum of valid values */
+	double		min;				/*< Smallest valid value */
+	double		max;				/*< Largest valid value */
+	uint32_t	count;				/*< Number of valid values */
+	uint32_t	reserved;
+} tsdb_accum_t;
+
+/* Location of a compressed block in a layer's block store.  A zero length block is
+ * entirely unknown values. */
+typedef struct {
+	uint64_t	offset;
+	uint32_t	length;
+	uint32_t	reserved;
+} tsdb_block_index_t;
+
 /* Type for data points */
 #ifdef TSDB_DOUBLE_TYPE
 typedef double tsdb_data_t;
@@ -132,16 +283,46 @@ typedef double tsdb_data_t;
 typedef float tsdb_data_t;
 #endif
 
-typedef struct {
+typedef struct tsdb_ctx {
 	int 		meta_fd;			/*< File descriptor for metadata */
-	int 		table_fd[TSDB_MAX_LAYERS];	/*< File descriptors for each data layer */
+	int 		table_fd[TSDB_MAX_LAYERS][TSDB_MAX_METRICS];	/*< File descriptors for each data layer (one per metric if columnar) */
 	tsdb_metadata_t	*meta;				/*< Pointer to mmapped metadata */
-	tsdb_data_t	*padding;			/*< Pre-allocated padding buffer */
+	size_t		meta_size;			/*< Size of metadata mapping including accumulators */
+	tsdb_accum_t	*accum;				/*< Pointer to mmapped accumulators (nmetrics per layer) */
 	tsdb_data_t	*work_buffer;			/*< Pre-allocated work buffer */
+	tsdb_data_t	*select_buffer;			/*< Part of work buffer for finding medians */
+	struct tsdb_agg_bucket *mode_table;		/*< Part of work buffer for finding modes (or NULL) */
+#ifdef TSDB_MMAP_TABLES
+	tsdb_data_t	*table_map[TSDB_MAX_LAYERS][TSDB_MAX_METRICS];	/*< Shared mapping of each table file (or NULL) */
+	size_t		table_size[TSDB_MAX_LAYERS][TSDB_MAX_METRICS];	/*< Size of each table file and its mapping (bytes) */
+#endif
+	int		block_fd[TSDB_MAX_LAYERS];	/*< Compressed block store for each layer (if compressed) */
+	int		index_fd[TSDB_MAX_LAYERS];	/*< Block index for each layer (if compressed) */
+	uint64_t	block_end[TSDB_MAX_LAYERS];	/*< Size of each block store (bytes) */
+	struct tsdb_segment *segments;			/*< Segments held open, two for each table (if segmented) */
+	struct tsdb_pack *pack;				/*< Container packing the node (or NULL if it has its own files) */
+	uint64_t	meta_offset;			/*< Position of the metadata in its file (non-zero only if packed) */
 	
 #ifdef TSDB_PTHREAD_LOCKING
-	pthread_mutex_t	mutex;				/*< Mutex for locking in multi-threaded applications */
+	pthread_rwlock_t lock;				/*< Allows many concurrent readers or a single writer */
+	pthread_mutex_t	segment_lock;			/*< Serialises use of the open segments, which readers change too */
 #endif
+
+	/* Context cache management - private to tsdb.c */
+	uint64_t	node_id;			/*< Node ID the context was opened for */
+	unsigned int	refcount;			/*< Number of handles currently held by callers */
+	unsigned int	nfds;				/*< Number of file descriptors held open */
+	size_t		mem_size;			/*< Heap memory held by the context */
+	int		stale;				/*< Set if the node was deleted while in use */
+	int		dirty;				/*< Set if modified since last synced */
+	uint64_t	flushed_sequence;		/*< Metadata sequence number last written back */
+	struct tsdb_ctx	*hash_next;			/*< Next context in the same hash bucket */
+	struct tsdb_ctx	*lru_prev;			/*< Previous (more recently used) idle context */
+	struct tsdb_ctx	*lru_next;			/*< Next (less recently used) idle context */
+	
+	/* Background decimation - private to tsdb.c */
+	int		queued;				/*< Set while waiting for a decimation thread */
+	struct tsdb_ctx	*queue_next;			/*< Next context waiting for a decimation thread */
 } tsdb_ctx_t;
 
 /* Name/value pairs for returning series */
@@ -150,6 +331,14 @@ typedef struct {
 	tsdb_data_t	value;
 } tsdb_series_point_t;
 
+/* Summary of the input points covered by one output point of an envelope series */
+typedef struct {
+	tsdb_data_t	min;				/*< Smallest valid value (NaN if count is 0) */
+	tsdb_data_t	max;				/*< Largest valid value (NaN if count is 0) */
+	tsdb_data_t	mean;				/*< Mean of valid values (NaN if count is 0) */
+	uint32_t	count;				/*< Number of valid input points */
+} tsdb_envelope_t;
+
 /*!
  * \brief		Creates a new time series database
  * \param node_id	Node to create
@@ -158,10 +347,36 @@ typedef struct {
  * \param pad_mode	Array per metric \see tsdb_pad_mode_t
  * \param ds_mode	Array per metric \see tsdb_downsample_mode_t
  * \param decimation	Pointer to an array containing number of points to combine for each lower layer
+ * \param layout	Arrangement of the table files \see tsdb_layout_t.  A columnar layout
+ *			makes series queries for one metric read only that metric's data.
+ * \param compression	Encoding of the table files \see tsdb_compression_t.  Compressed
+ *			tables keep all but the newest block of each layer XOR-encoded.
+ *			Compression cannot be combined with the columnar layout.
+ * \param segment_points	Number of points in each segment file, or 0 to keep each layer
+ *			(or column) in a single file.  Segments cover a fixed span of time,
+ *			so old data can be dropped a file at a time.  Segmentation cannot be
+ *			combined with compression.
+ * \param capacity	Pointer to an array containing the number of points to keep in each
+ *			layer (0 to keep all of them), or NULL to keep everything.  A layer
+ *			with a capacity is a ring that overwrites its oldest points, so its
+ *			size on disk is fixed.  Points that have been overwritten read as
+ *			unknown and can no longer be updated.  Each capacity must be at least
+ *			the layer's decimation, and cannot be combined with compression.
+ * \param retention	Pointer to an array containing the number of seconds of data to keep
+ *			in each layer, counting back from the newest point (0 to keep all of
+ *			it), or NULL to keep everything.  Older points are released by
+ *			tsdb_expire.  A layer cannot have both a capacity and a retention
+ *			period, and retention cannot be combined with compression.
+ * \param packed	Non-zero to pack the node into a container shared with other nodes
+ *			instead of giving it files of its own.  Its metadata takes a slot in
+ *			the container and each segment an extent, so the node needs no
+ *			descriptors of its own.  Only segmented nodes can be packed.
  * \return		0 or negative error code
  */
 int tsdb_create(uint64_t node_id, unsigned int interval, unsigned int nmetrics,
-	tsdb_pad_mode_t *pad_mode, tsdb_downsample_mode_t *ds_mode, unsigned int *decimation);
+	tsdb_pad_mode_t *pad_mode, tsdb_downsample_mode_t *ds_mode, unsigned int *decimation,
+	tsdb_layout_t layout, tsdb_compression_t compression, unsigned int segment_points,
+	uint64_t *capacity, uint64_t *retention, int packed);
 
 /*!
  * \brief		Deletes an existing time series database
@@ -172,17 +387,149 @@ int tsdb_delete(uint64_t node_id);
 
 /*!
  * \brief 		Opens an existing time series database
+ *
+ * Contexts are cached process-wide, so repeated opens of the same node do not
+ * touch the filesystem.  The returned handle is reference counted and may be
+ * shared between threads - each API call takes the node's lock internally, so
+ * queries run concurrently while updates are serialised.
+ *
  * \param node_id	Node to open
  * \return		Pointer to context structure or null on error
  */
 tsdb_ctx_t* tsdb_open(uint64_t node_id);
 
 /*!
- * \brief		Closes a time series database opened by a call to tsdb_open
+ * \brief		Releases a handle obtained by a call to tsdb_open
+ *
+ * The context remains cached until it is evicted to keep within the limits set by
+ * tsdb_cache_set_limits, or until the node is deleted.
+ *
  * \param ctx		Pointer to context structure returned by tsdb_open
  */
 void tsdb_close(tsdb_ctx_t *ctx);
 
+/*!
+ * \brief		Sets the limits for the cache of open contexts
+ * \param max_fds	Maximum number of file descriptors held by cached contexts
+ * \param max_memory	Maximum memory (bytes) held by cached contexts
+ */
+void tsdb_cache_set_limits(unsigned int max_fds, size_t max_memory);
+
+/*!
+ * \brief		Closes all cached contexts that are not currently in use
+ *
+ * The containers of packed nodes are closed too once no packed node is open.
+ */
+void tsdb_cache_flush(void);
+
+/* Page cache statistics for the table files of each layer */
+typedef struct {
+	uint64_t	hits[TSDB_MAX_LAYERS];		/*< Pages read that were already in the page cache */
+	uint64_t	misses[TSDB_MAX_LAYERS];	/*< Pages read that had to be fetched from storage */
+} tsdb_page_stats_t;
+
+/*!
+ * \brief		Returns the page cache statistics of all nodes since the process started
+ *
+ * Pages are counted as points are read from the table files, so a page read several
+ * times counts several times.  The hits against the misses of each layer show how much
+ * of it is worth holding in memory.  Compressed blocks are counted when they are decoded.
+ * The counts are zero unless TSDB_PAGE_STATS is defined, and do not include files read
+ * through read calls where the file system cannot report whether it would have to wait.
+ *
+ * \param stats		Pointer to the statistics to be filled in
+ */
+void tsdb_get_page_stats(tsdb_page_stats_t *stats);
+
+/*!
+ * \brief		Writes a node's tables and metadata to stable storage
+ * \param ctx		Pointer to context structure returned by tsdb_open
+ * \return		0 or negative error code
+ */
+int tsdb_sync(tsdb_ctx_t *ctx);
+
+/*!
+ * \brief		Writes every cached node modified since it was last synced to stable storage
+ *
+ * Nodes evicted from the cache while the write-ahead log is in use are synced as
+ * they are closed, so after this call all updates made so far are durable.
+ *
+ * \return		0 or negative error code
+ */
+int tsdb_sync_all(void);
+
+/*!
+ * \brief		Releases the points of each layer that have passed its retention period
+ *
+ * The released points read as unknown and can no longer be updated.  Their space is
+ * reclaimed by punching holes in the table files, which keeps the positions of the
+ * remaining points, or by deleting whole segments of segmented nodes.  Series queries
+ * for times that a layer no longer holds are answered from a coarser layer.  Nothing
+ * is released while decimation is pending for the node.
+ *
+ * \param ctx		Pointer to context structure returned by tsdb_open
+ * \return		0 or negative error code
+ */
+int tsdb_expire(tsdb_ctx_t *ctx);
+
+/*!
+ * \brief		Starts writing back modified metadata periodically in the background
+ *
+ * Updates do not write back the metadata themselves.  Without the flusher it is written
+ * back when the node is synced, or whenever the kernel chooses.  Nodes found on opening
+ * to have changed since they were last synced have the newest points of their lower
+ * layers recomputed, as their tables may be ahead of the metadata.  Changed nodes with
+ * a retention period also have their expired points released (see tsdb_expire).
+ *
+ * \param interval	Time (ms) between write-backs
+ * \return		0 or negative error code
+ */
+int tsdb_flush_start(unsigned int interval);
+
+/*!
+ * \brief		Stops the metadata flusher, writing back any metadata still modified
+ */
+void tsdb_flush_stop(void);
+
+/*!
+ * \brief		Starts moving nodes from a flat database tree into their shard directories
+ *
+ * Versions before sharding kept every node's files in the database directory itself.
+ * Such a node is moved the first time it is opened, or created over, so the store can
+ * be used straight away.  This moves the rest in the background, one node at a time,
+ * while the store is in use.
+ *
+ * \return		0 or negative error code
+ */
+int tsdb_migrate_start(void);
+
+/*!
+ * \brief		Stops moving nodes into their shard directories if not already finished
+ */
+void tsdb_migrate_stop(void);
+
+/*!
+ * \brief		Starts decimating the lower resolution layers in the background
+ *
+ * Once started, updates write only the top-level table and the metadata.  Nodes with new
+ * points are queued to a pool of threads that bring their lower layers up to date, with
+ * any further updates made while a node is waiting handled by the same pass.  Series
+ * queries complete any decimation still pending for a node before reading it.  Must be
+ * called before any updates are made.
+ *
+ * \param nthreads	Number of decimation threads (at most TSDB_MAX_DECIMATE_THREADS)
+ * \return		0 or negative error code
+ */
+int tsdb_decimate_start(unsigned int nthreads);
+
+/*!
+ * \brief		Completes all queued decimation and stops the background threads
+ *
+ * Updates made afterwards decimate synchronously again.  Must not be called while
+ * updates are being made.
+ */
+void tsdb_decimate_stop(void);
+
 /*!
  * \brief		Returns the UNIX timestamp of the latest time point
  * \param ctx		Pointer to context structure returned by tsdb_open
@@ -198,7 +545,8 @@ int64_t tsdb_get_latest(tsdb_ctx_t *ctx);
  * possible to omit metrics by passing the value NaN.  In this case the update function will leave
  * any pre-existing value in place.
  * 
- * Downsampling to lower resolution layers is handled automatically.
+ * Downsampling to lower resolution layers is handled automatically, in the background
+ * if tsdb_decimate_start has been called.
  * 
  * \param ctx		Pointer to context structure returned by tsdb_open
  * \param timestamp	Pointer to variable with the UNIX timestamp of the time point being
@@ -211,6 +559,24 @@ int64_t tsdb_get_latest(tsdb_ctx_t *ctx);
  */
 int tsdb_update_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values);
 
+/*!
+ * \brief		Update a block of time points
+ *
+ * Equivalent to calling tsdb_update_values for each time point in turn, but runs of
+ * consecutive time points are written together and each affected point in the lower
+ * resolution layers is only recalculated once, after all of the new values are in place.
+ * The whole block is validated before anything is written.
+ *
+ * \param ctx		Pointer to context structure returned by tsdb_open
+ * \param timestamps	Pointer to an array of UNIX timestamps, one for each time point.  The
+ * 			timestamps are rounded down to the nearest interval in place.
+ * \param values	Pointer to an array of values, with ctx->meta->nmetrics values in metric
+ * 			order for each time point
+ * \param count		Number of time points in the block
+ * \return		0 on success or a negative error code
+ */
+int tsdb_update_values_batch(tsdb_ctx_t *ctx, int64_t *timestamps, tsdb_data_t *values, unsigned int count);
+
 /*!
  * \brief		Returns the latest values for all metrics in the data set
  * 
@@ -230,12 +596,30 @@ int tsdb_get_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values);
  * The function will return the requested number of data points covering the specified
  * time range.
  *
+ * With TSDB_SERIES_LTTB the range is split into npoints buckets and one input point is
+ * picked from each, keeping the first and last, from the finest layer whose buckets are no
+ * wider than TSDB_SCAN_MAX_SELECT points.  Timestamps are those of the picked points.
+ *
+ * With TSDB_SERIES_LINEAR or TSDB_SERIES_STEP the output timestamps are exactly start,
+ * start + (end - start) / (npoints - 1), ... and each value is interpolated from the
+ * layer that would otherwise have been aggregated.  A linearly interpolated value is
+ * unknown (and the point omitted) if either neighbouring input point is.
+ *
+ * If the layer that would be read has released the start of the range (see
+ * tsdb_expire), the next coarser layer that still holds it is read instead.  Output
+ * points older than the oldest point held by the layer read, including those that have
+ * wrapped out of a ring, are omitted.
+ *
+ * Ranges longer than the scan buffer are read sequentially, with the kernel asked to read
+ * each part ahead of the scan.
+ *
  * \param ctx		Pointer to context structure returned by tsdb_open
  * \param metric_id	ID of metric to return
  * \param start		UNIX timestamp for the start of the period of interest (or TSDB_NO_TIMESTAMP)
  * \param end		UNIX timestamp for the end of the period of interest (or TSDB_NO_TIMESTAMP)
  * \param npoints	Number of data points to output
- * \param flags		Flags (reserved)
+ * \param flags		One of TSDB_SERIES_LTTB, TSDB_SERIES_LINEAR, TSDB_SERIES_STEP, or 0,
+ *			optionally with TSDB_SERIES_ONCE
  * \param values	Pointer to an array to be updated with the result set.  It
  * 			must be large enough to hold npoints.
  * \return		Number of points returned on success or a negative error code
@@ -243,6 +627,56 @@ int tsdb_get_values(tsdb_ctx_t *ctx, int64_t *timestamp, tsdb_data_t *values);
 int tsdb_get_series(tsdb_ctx_t *ctx, unsigned int metric_id, int64_t start, int64_t end, 
 	unsigned int npoints, int flags, tsdb_series_point_t *points);
 
+/*!
+ * \brief		Returns arrays of values for several metrics of one data set
+ *
+ * Equivalent to calling tsdb_get_series for each metric, but the data is scanned only
+ * once.  An output point is returned if any of the metrics has data for it.
+ *
+ * \param ctx		Pointer to context structure returned by tsdb_open
+ * \param metric_ids	Pointer to an array of IDs of the metrics to return
+ * \param nseries	Number of metrics requested (at most TSDB_MAX_METRICS)
+ * \param start		UNIX timestamp for the start of the period of interest (or TSDB_NO_TIMESTAMP)
+ * \param end		UNIX timestamp for the end of the period of interest (or TSDB_NO_TIMESTAMP)
+ * \param npoints	Number of data points to output
+ * \param flags		TSDB_SERIES_LINEAR, TSDB_SERIES_STEP or 0, optionally with
+ *			TSDB_SERIES_ONCE (see tsdb_get_series)
+ * \param timestamps	Pointer to an array to be updated with the timestamp of each output
+ *			point.  It must be large enough to hold npoints.
+ * \param values	Pointer to an array to be updated with nseries values for each output
+ *			point, in the order of metric_ids.  Metrics with no data for a point
+ *			are NaN.  It must be large enough to hold npoints * nseries.
+ * \return		Number of points returned on success or a negative error code
+ */
+int tsdb_get_series_multi(tsdb_ctx_t *ctx, const unsigned int *metric_ids, unsigned int nseries,
+	int64_t start, int64_t end, unsigned int npoints, int flags, int64_t *timestamps, tsdb_data_t *values);
+
+/*!
+ * \brief		Returns the minimum, maximum, mean and count of several metrics of one
+ *			data set over each output point
+ *
+ * Unlike tsdb_get_series, which returns one aggregate (the metric's downsampling mode)
+ * for each output point, this preserves the extremes for rendering charts.  Decimated
+ * layers hold only that one aggregate, so envelopes are always computed from the
+ * undecimated layer, scanned once for all of the metrics.
+ *
+ * \param ctx		Pointer to context structure returned by tsdb_open
+ * \param metric_ids	Pointer to an array of IDs of the metrics to return
+ * \param nseries	Number of metrics requested (at most TSDB_MAX_METRICS)
+ * \param start		UNIX timestamp for the start of the period of interest (or TSDB_NO_TIMESTAMP)
+ * \param end		UNIX timestamp for the end of the period of interest (or TSDB_NO_TIMESTAMP)
+ * \param npoints	Number of data points to output
+ * \param flags		TSDB_SERIES_ONCE or 0
+ * \param timestamps	Pointer to an array to be updated with the timestamp of each output
+ *			point.  It must be large enough to hold npoints.
+ * \param envelopes	Pointer to an array to be updated with nseries envelopes for each
+ *			output point, in the order of metric_ids.  It must be large enough
+ *			to hold npoints * nseries.
+ * \return		Number of points returned on success or a negative error code
+ */
+int tsdb_get_series_envelope(tsdb_ctx_t *ctx, const unsigned int *metric_ids, unsigned int nseries,
+	int64_t start, int64_t end, unsigned int npoints, int flags, int64_t *timestamps, tsdb_envelope_t *envelopes);
+
 /*!
  * \brief			Returns a key from the database metadata
  *
@@ -0,0 +1,489 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* NaN-aware aggregation kernels.
+ *
+ * Each implementation is written once as an always-inlined body taking a set of
+ * operations, from which the per-mode kernels are generated with the unused
+ * operations compiled out.  NaNs are masked rather than branched on: they are
+ * zeroed for the sum, replaced by +/-infinity for the min/max, and the ordered
+ * comparison mask itself is subtracted from the per-lane counts. */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "tsdb.h"
+#include "tsdb_agg.h"
+#include "logging.h"
+
+#if defined(TSDB_SIMD_KERNELS) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TSDB_AGG_X86
+#include <immintrin.h>
+#endif
+
+/* Operations performed by a kernel in addition to counting */
+#define AGG_SUM			(1 << 0)
+#define AGG_MIN			(1 << 1)
+#define AGG_MAX			(1 << 2)
+
+#define AGG_INLINE		static inline __attribute__((always_inline))
+
+/* Linear interpolation kernel */
+typedef void (*tsdb_agg_lerp_fn_t)(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n);
+
+/* Kernel for each downsampling mode */
+typedef struct {
+	tsdb_agg_fn_t	count;
+	tsdb_agg_fn_t	sum;
+	tsdb_agg_fn_t	min;
+	tsdb_agg_fn_t	max;
+	tsdb_agg_fn_t	all;				/*< Sum, minimum and maximum for envelopes */
+	tsdb_agg_lerp_fn_t lerp;
+	const char	*isa;
+} tsdb_agg_kernels_t;
+
+static tsdb_agg_kernels_t g_kernels;
+static pthread_once_t g_kernels_once = PTHREAD_ONCE_INIT;
+
+/* Scalar aggregation of the remaining values after a vector loop */
+AGG_INLINE void agg_scalar(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc,
+	int ops, double sum, tsdb_data_t min, tsdb_data_t max, uint32_t count)
+{
+	for ( ; n; n--, p += stride) {
+		if (isnan(*p))
+			continue;
+		if (ops & AGG_SUM)
+			sum += *p;
+		if ((ops & AGG_MIN) && *p < min)
+			min = *p;
+		if ((ops & AGG_MAX) && *p > max)
+			max = *p;
+		count++;
+	}
+	if (ops & AGG_SUM)
+		acc->sum += sum;
+	if ((ops & AGG_MIN) && min < acc->min)
+		acc->min = min;
+	if ((ops & AGG_MAX) && max > acc->max)
+		acc->max = max;
+	acc->count += count;
+}
+
+#define AGG_KERNELS(isa, body) \
+	static void agg_##isa##_count(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ body(p, n, stride, acc, 0); } \
+	static void agg_##isa##_sum(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ body(p, n, stride, acc, AGG_SUM); } \
+	static void agg_##isa##_min(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ body(p, n, stride, acc, AGG_MIN); } \
+	static void agg_##isa##_max(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ body(p, n, stride, acc, AGG_MAX); } \
+	static void agg_##isa##_all(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ body(p, n, stride, acc, AGG_SUM | AGG_MIN | AGG_MAX); }
+
+AGG_INLINE void agg_generic(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc, int ops)
+{
+	agg_scalar(p, n, stride, acc, ops, 0.0, INFINITY, -INFINITY, 0);
+}
+AGG_KERNELS(scalar, agg_generic)
+
+static void lerp_scalar(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	for ( ; n; n--, y0++, y1++, frac++, out++)
+		*out = *y0 + *frac * (*y1 - *y0);
+}
+
+#ifdef TSDB_AGG_X86
+
+#ifndef TSDB_DOUBLE_TYPE
+
+/* SSE2 - 4 floats per step, summed as 2 pairs of doubles */
+AGG_INLINE void agg_sse2(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc, int ops)
+{
+	__m128d sum_lo = _mm_setzero_pd(), sum_hi = _mm_setzero_pd();
+	__m128 min = _mm_set1_ps(INFINITY), max = _mm_set1_ps(-INFINITY);
+	__m128 pinf = min, ninf = max;
+	__m128i count = _mm_setzero_si128();
+	double sums[2];
+	float mins[4], maxs[4];
+	uint32_t counts[4];
+
+	for ( ; n >= 4; n -= 4, p += 4 * stride) {
+		__m128 x = (stride == 1) ? _mm_loadu_ps(p) : _mm_set_ps(p[3 * stride], p[2 * stride], p[stride], p[0]);
+		__m128 valid = _mm_cmpord_ps(x, x);
+		if (ops & AGG_SUM) {
+			__m128 xs = _mm_and_ps(x, valid);
+			sum_lo = _mm_add_pd(sum_lo, _mm_cvtps_pd(xs));
+			sum_hi = _mm_add_pd(sum_hi, _mm_cvtps_pd(_mm_movehl_ps(xs, xs)));
+		}
+		if (ops & AGG_MIN)
+			min = _mm_min_ps(min, _mm_or_ps(_mm_and_ps(valid, x), _mm_andnot_ps(valid, pinf)));
+		if (ops & AGG_MAX)
+			max = _mm_max_ps(max, _mm_or_ps(_mm_and_ps(valid, x), _mm_andnot_ps(valid, ninf)));
+		count = _mm_sub_epi32(count, _mm_castps_si128(valid));
+	}
+
+	_mm_storeu_pd(sums, _mm_add_pd(sum_lo, sum_hi));
+	_mm_storeu_ps(mins, min);
+	_mm_storeu_ps(maxs, max);
+	_mm_storeu_si128((__m128i*)counts, count);
+	agg_scalar(p, n, stride, acc, ops, sums[0] + sums[1],
+		fminf(fminf(mins[0], mins[1]), fminf(mins[2], mins[3])),
+		fmaxf(fmaxf(maxs[0], maxs[1]), fmaxf(maxs[2], maxs[3])),
+		counts[0] + counts[1] + counts[2] + counts[3]);
+}
+
+/* AVX2 - 8 floats per step */
+__attribute__((target("avx2"), always_inline))
+static inline void agg_avx2(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc, int ops)
+{
+	__m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+	__m256 min = _mm256_set1_ps(INFINITY), max = _mm256_set1_ps(-INFINITY);
+	__m256 pinf = min, ninf = max;
+	__m256i count = _mm256_setzero_si256();
+	double sums[4];
+	float mins[8], maxs[8];
+	uint32_t counts[8];
+	unsigned int i;
+
+	for ( ; n >= 8; n -= 8, p += 8 * stride) {
+		__m256 x = (stride == 1) ? _mm256_loadu_ps(p) : _mm256_setr_ps(p[0], p[stride], p[2 * stride],
+			p[3 * stride], p[4 * stride], p[5 * stride], p[6 * stride], p[7 * stride]);
+		__m256 valid = _mm256_cmp_ps(x, x, _CMP_ORD_Q);
+		if (ops & AGG_SUM) {
+			__m256 xs = _mm256_and_ps(x, valid);
+			sum_lo = _mm256_add_pd(sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(xs)));
+			sum_hi = _mm256_add_pd(sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(xs, 1)));
+		}
+		if (ops & AGG_MIN)
+			min = _mm256_min_ps(min, _mm256_blendv_ps(pinf, x, valid));
+		if (ops & AGG_MAX)
+			max = _mm256_max_ps(max, _mm256_blendv_ps(ninf, x, valid));
+		count = _mm256_sub_epi32(count, _mm256_castps_si256(valid));
+	}
+
+	_mm256_storeu_pd(sums, _mm256_add_pd(sum_lo, sum_hi));
+	_mm256_storeu_ps(mins, min);
+	_mm256_storeu_ps(maxs, max);
+	_mm256_storeu_si256((__m256i*)counts, count);
+	for (i = 1; i < 8; i++) {
+		mins[0] = fminf(mins[0], mins[i]);
+		maxs[0] = fmaxf(maxs[0], maxs[i]);
+		counts[0] += counts[i];
+	}
+	agg_scalar(p, n, stride, acc, ops, (sums[0] + sums[1]) + (sums[2] + sums[3]), mins[0], maxs[0], counts[0]);
+}
+
+static void lerp_sse2(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	for ( ; n >= 4; n -= 4, y0 += 4, y1 += 4, frac += 4, out += 4) {
+		__m128 a = _mm_loadu_ps(y0);
+		_mm_storeu_ps(out, _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(frac), _mm_sub_ps(_mm_loadu_ps(y1), a))));
+	}
+	lerp_scalar(y0, y1, frac, out, n);
+}
+
+__attribute__((target("avx2")))
+static void lerp_avx2(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	for ( ; n >= 8; n -= 8, y0 += 8, y1 += 8, frac += 8, out += 8) {
+		__m256 a = _mm256_loadu_ps(y0);
+		_mm256_storeu_ps(out, _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(frac),
+			_mm256_sub_ps(_mm256_loadu_ps(y1), a))));
+	}
+	lerp_scalar(y0, y1, frac, out, n);
+}
+
+#else /* TSDB_DOUBLE_TYPE */
+
+/* SSE2 - 2 doubles per step */
+AGG_INLINE void agg_sse2(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc, int ops)
+{
+	__m128d sum = _mm_setzero_pd();
+	__m128d min = _mm_set1_pd(INFINITY), max = _mm_set1_pd(-INFINITY);
+	__m128d pinf = min, ninf = max;
+	__m128i count = _mm_setzero_si128();
+	double sums[2], mins[2], maxs[2];
+	uint64_t counts[2];
+
+	for ( ; n >= 2; n -= 2, p += 2 * stride) {
+		__m128d x = (stride == 1) ? _mm_loadu_pd(p) : _mm_set_pd(p[stride], p[0]);
+		__m128d valid = _mm_cmpord_pd(x, x);
+		if (ops & AGG_SUM)
+			sum = _mm_add_pd(sum, _mm_and_pd(x, valid));
+		if (ops & AGG_MIN)
+			min = _mm_min_pd(min, _mm_or_pd(_mm_and_pd(valid, x), _mm_andnot_pd(valid, pinf)));
+		if (ops & AGG_MAX)
+			max = _mm_max_pd(max, _mm_or_pd(_mm_and_pd(valid, x), _mm_andnot_pd(valid, ninf)));
+		count = _mm_sub_epi64(count, _mm_castpd_si128(valid));
+	}
+
+	_mm_storeu_pd(sums, sum);
+	_mm_storeu_pd(mins, min);
+	_mm_storeu_pd(maxs, max);
+	_mm_storeu_si128((__m128i*)counts, count);
+	agg_scalar(p, n, stride, acc, ops, sums[0] + sums[1], fmin(mins[0], mins[1]), fmax(maxs[0], maxs[1]),
+		(uint32_t)(counts[0] + counts[1]));
+}
+
+/* AVX2 - 4 doubles per step */
+__attribute__((target("avx2"), always_inline))
+static inline void agg_avx2(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc, int ops)
+{
+	__m256d sum = _mm256_setzero_pd();
+	__m256d min = _mm256_set1_pd(INFINITY), max = _mm256_set1_pd(-INFINITY);
+	__m256d pinf = min, ninf = max;
+	__m256i count = _mm256_setzero_si256();
+	double sums[4], mins[4], maxs[4];
+	uint64_t counts[4];
+
+	for ( ; n >= 4; n -= 4, p += 4 * stride) {
+		__m256d x = (stride == 1) ? _mm256_loadu_pd(p) : _mm256_setr_pd(p[0], p[stride], p[2 * stride], p[3 * stride]);
+		__m256d valid = _mm256_cmp_pd(x, x, _CMP_ORD_Q);
+		if (ops & AGG_SUM)
+			sum = _mm256_add_pd(sum, _mm256_and_pd(x, valid));
+		if (ops & AGG_MIN)
+			min = _mm256_min_pd(min, _mm256_blendv_pd(pinf, x, valid));
+		if (ops & AGG_MAX)
+			max = _mm256_max_pd(max, _mm256_blendv_pd(ninf, x, valid));
+		count = _mm256_sub_epi64(count, _mm256_castpd_si256(valid));
+	}
+
+	_mm256_storeu_pd(sums, sum);
+	_mm256_storeu_pd(mins, min);
+	_mm256_storeu_pd(maxs, max);
+	_mm256_storeu_si256((__m256i*)counts, count);
+	agg_scalar(p, n, stride, acc, ops, (sums[0] + sums[1]) + (sums[2] + sums[3]),
+		fmin(fmin(mins[0], mins[1]), fmin(mins[2], mins[3])),
+		fmax(fmax(maxs[0], maxs[1]), fmax(maxs[2], maxs[3])),
+		(uint32_t)(counts[0] + counts[1] + counts[2] + counts[3]));
+}
+
+static void lerp_sse2(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	for ( ; n >= 2; n -= 2, y0 += 2, y1 += 2, frac += 2, out += 2) {
+		__m128d a = _mm_loadu_pd(y0);
+		_mm_storeu_pd(out, _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(frac), _mm_sub_pd(_mm_loadu_pd(y1), a))));
+	}
+	lerp_scalar(y0, y1, frac, out, n);
+}
+
+__attribute__((target("avx2")))
+static void lerp_avx2(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	for ( ; n >= 4; n -= 4, y0 += 4, y1 += 4, frac += 4, out += 4) {
+		__m256d a = _mm256_loadu_pd(y0);
+		_mm256_storeu_pd(out, _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(frac),
+			_mm256_sub_pd(_mm256_loadu_pd(y1), a))));
+	}
+	lerp_scalar(y0, y1, frac, out, n);
+}
+
+#endif /* TSDB_DOUBLE_TYPE */
+
+AGG_KERNELS(sse2, agg_sse2)
+
+/* The AVX2 wrappers must themselves be compiled for AVX2 to inline the body */
+#define AGG_AVX2_KERNEL(op, ops) \
+	__attribute__((target("avx2"))) \
+	static void agg_avx2_##op(const tsdb_data_t *p, unsigned int n, unsigned int stride, tsdb_accum_t *acc) \
+		{ agg_avx2(p, n, stride, acc, ops); }
+AGG_AVX2_KERNEL(count, 0)
+AGG_AVX2_KERNEL(sum, AGG_SUM)
+AGG_AVX2_KERNEL(min, AGG_MIN)
+AGG_AVX2_KERNEL(max, AGG_MAX)
+AGG_AVX2_KERNEL(all, AGG_SUM | AGG_MIN | AGG_MAX)
+
+#endif /* TSDB_AGG_X86 */
+
+static void tsdb_agg_init(void)
+{
+#ifdef TSDB_AGG_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		g_kernels = (tsdb_agg_kernels_t){ agg_avx2_count, agg_avx2_sum, agg_avx2_min, agg_avx2_max, agg_avx2_all, lerp_avx2, "avx2" };
+	} else if (__builtin_cpu_supports("sse2")) {
+		g_kernels = (tsdb_agg_kernels_t){ agg_sse2_count, agg_sse2_sum, agg_sse2_min, agg_sse2_max, agg_sse2_all, lerp_sse2, "sse2" };
+	} else
+#endif
+	{
+		g_kernels = (tsdb_agg_kernels_t){ agg_scalar_count, agg_scalar_sum, agg_scalar_min, agg_scalar_max, agg_scalar_all, lerp_scalar, "scalar" };
+	}
+	INFO("Using %s aggregation kernels\n", g_kernels.isa);
+}
+
+tsdb_agg_fn_t tsdb_agg_select(tsdb_downsample_mode_t mode)
+{
+	pthread_once(&g_kernels_once, tsdb_agg_init);
+
+	switch (mode) {
+		case tsdbDownsample_Mean:
+		case tsdbDownsample_Sum:
+			return g_kernels.sum;
+		case tsdbDownsample_Min:
+			return g_kernels.min;
+		case tsdbDownsample_Max:
+			return g_kernels.max;
+		default:
+			return g_kernels.count;
+	}
+}
+
+tsdb_agg_fn_t tsdb_agg_select_all(void)
+{
+	pthread_once(&g_kernels_once, tsdb_agg_init);
+	return g_kernels.all;
+}
+
+void tsdb_agg_lerp(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n)
+{
+	pthread_once(&g_kernels_once, tsdb_agg_init);
+	g_kernels.lerp(y0, y1, frac, out, n);
+}
+
+unsigned int tsdb_agg_lttb(const tsdb_data_t *data, const uint64_t *index, unsigned int n,
+	double ax, double ay, double cx, double cy)
+{
+	unsigned int i, best = 0;
+	double area, best_area = -1.0;
+	
+	/* Twice the area of the triangle - the factor makes no difference to the choice */
+	for (i = 0; i < n; i++) {
+		area = fabs((ax - cx) * (data[i] - ay) - (ax - index[i]) * (cy - ay));
+		if (area > best_area) {
+			best_area = area;
+			best = i;
+		}
+	}
+	return best;
+}
+
+tsdb_data_t tsdb_agg_median(const tsdb_data_t *data, unsigned int n, unsigned int stride, tsdb_data_t *scratch)
+{
+	unsigned int count = 0, left, right, k, i, j;
+	tsdb_data_t pivot, tmp, upper;
+	
+	/* Gather the valid values */
+	for ( ; n; n--, data += stride) {
+		if (!isnan(*data))
+			scratch[count++] = *data;
+	}
+	if (count == 0)
+		return NAN;
+	
+	/* Quickselect the lower middle value, using the median of three as the pivot */
+	k = (count - 1) / 2;
+	left = 0;
+	right = count - 1;
+	while (left < right) {
+		unsigned int mid = left + (right - left) / 2;
+		
+		if (scratch[mid] < scratch[left]) { tmp = scratch[mid]; scratch[mid] = scratch[left]; scratch[left] = tmp; }
+		if (scratch[right] < scratch[left]) { tmp = scratch[right]; scratch[right] = scratch[left]; scratch[left] = tmp; }
+		if (scratch[right] < scratch[mid]) { tmp = scratch[right]; scratch[right] = scratch[mid]; scratch[mid] = tmp; }
+		pivot = scratch[mid];
+		
+		/* Hoare partition */
+		i = left;
+		j = right;
+		while (i <= j) {
+			while (scratch[i] < pivot)
+				i++;
+			while (scratch[j] > pivot)
+				j--;
+			if (i <= j) {
+				tmp = scratch[i]; scratch[i] = scratch[j]; scratch[j] = tmp;
+				i++;
+				if (j == 0)
+					break;
+				j--;
+			}
+		}
+		if (k <= j)
+			right = j;
+		else if (k >= i)
+			left = i;
+		else
+			break;
+	}
+	if (count & 1)
+		return scratch[k];
+	
+	/* Everything above k is no smaller, so the upper middle value is their minimum */
+	upper = scratch[k + 1];
+	for (i = k + 2; i < count; i++) {
+		if (scratch[i] < upper)
+			upper = scratch[i];
+	}
+	return (tsdb_data_t)(((double)scratch[k] + (double)upper) / 2.0);
+}
+
+tsdb_data_t tsdb_agg_mode(const tsdb_data_t *data, unsigned int n, unsigned int stride, tsdb_agg_bucket_t *table)
+{
+	unsigned int size = tsdb_agg_mode_buckets(n), mask = size - 1, slot;
+	tsdb_agg_bucket_t *best = NULL;
+	tsdb_data_t value;
+#ifdef TSDB_DOUBLE_TYPE
+	uint64_t bits;
+#else
+	uint32_t bits;
+#endif
+	
+	memset(table, 0, sizeof(tsdb_agg_bucket_t) * size);
+	for ( ; n; n--, data += stride) {
+		if (isnan(*data))
+			continue;
+		
+		/* -0 and +0 are the same value */
+		value = (*data == 0) ? 0 : *data;
+		
+		/* Fibonacci hash of the value's representation, linear probing */
+		memcpy(&bits, &value, sizeof(bits));
+		slot = (unsigned int)(((uint64_t)bits * 0x9E3779B97F4A7C15ull) >> 40) & mask;
+		while (table[slot].count && table[slot].value != value) {
+			slot = (slot + 1) & mask;
+		}
+		table[slot].value = value;
+		table[slot].count++;
+		if (best == NULL || table[slot].count > best->count ||
+			(table[slot].count == best->count && value < best->value)) {
+			best = &table[slot];
+		}
+	}
+	return best ? best->value : NAN;
+}
+
+const char* tsdb_agg_isa(void)
+{
+	pthread_once(&g_kernels_once, tsdb_agg_init);
+	return g_kernels.isa;
+}
@@ -0,0 +1,150 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TSDB_AGG_H
+#define TSDB_AGG_H
+
+#include <stdint.h>
+
+#include "tsdb.h"
+
+/* Use SSE2/AVX2 aggregation kernels where the CPU supports them */
+#define TSDB_SIMD_KERNELS
+
+/*!
+ * \brief		Aggregation kernel
+ *
+ * Adds the valid (non-NaN) values among n values spaced stride apart to an
+ * accumulator.  The count is always updated, but only the other fields needed by
+ * the kernel's downsampling mode are.  Sums are accumulated in double precision.
+ *
+ * \param data		Pointer to the first value
+ * \param n		Number of values
+ * \param stride	Distance between values (1 for contiguous data)
+ * \param acc		Accumulator to update
+ */
+typedef void (*tsdb_agg_fn_t)(const tsdb_data_t *data, unsigned int n, unsigned int stride, tsdb_accum_t *acc);
+
+/* Hash table entry for finding the mode of a set of values */
+typedef struct tsdb_agg_bucket {
+	tsdb_data_t	value;
+	uint32_t	count;				/*< Occurrences of value, or 0 if the entry is free */
+} tsdb_agg_bucket_t;
+
+/* Number of hash table entries needed to find the mode of up to n values */
+static inline unsigned int tsdb_agg_mode_buckets(unsigned int n)
+{
+	unsigned int size = 2;
+	
+	while (size < 2 * n)
+		size <<= 1;
+	return size;
+}
+
+/*!
+ * \brief		Returns the kernel for a downsampling mode
+ *
+ * The best implementation for the CPU is chosen on first use.  Modes that cannot be
+ * computed from an accumulator (median, mode) get a kernel that only counts.
+ *
+ * \param mode		Downsampling mode \see tsdb_downsample_mode_t
+ * \return		Kernel function
+ */
+tsdb_agg_fn_t tsdb_agg_select(tsdb_downsample_mode_t mode);
+
+/*!
+ * \brief		Returns the kernel that maintains all of the fields of an accumulator
+ *
+ * Used for envelopes (minimum, maximum, mean and count) regardless of downsampling mode.
+ *
+ * \return		Kernel function
+ */
+tsdb_agg_fn_t tsdb_agg_select_all(void);
+
+/*!
+ * \brief		Finds the median of the valid (non-NaN) values in a strided buffer
+ *
+ * Uses quickselect, so runs in linear time on average without sorting.  The median
+ * of an even number of values is the mean of the middle two.
+ *
+ * \param data		Pointer to the first value
+ * \param n		Number of values
+ * \param stride	Distance between values (1 for contiguous data)
+ * \param scratch	Pointer to a work area large enough for n values
+ * \return		Median, or NaN if there are no valid values
+ */
+tsdb_data_t tsdb_agg_median(const tsdb_data_t *data, unsigned int n, unsigned int stride, tsdb_data_t *scratch);
+
+/*!
+ * \brief		Finds the most frequent of the valid (non-NaN) values in a strided buffer
+ *
+ * Values are counted in a hash table, so runs in linear time without sorting.  Ties
+ * are resolved in favour of the smallest value.
+ *
+ * \param data		Pointer to the first value
+ * \param n		Number of values
+ * \param stride	Distance between values (1 for contiguous data)
+ * \param table	Pointer to a work area of tsdb_agg_mode_buckets(n) entries
+ * \return		Mode, or NaN if there are no valid values
+ */
+tsdb_data_t tsdb_agg_mode(const tsdb_data_t *data, unsigned int n, unsigned int stride, tsdb_agg_bucket_t *table);
+
+/*!
+ * \brief		Interpolates linearly between pairs of values
+ *
+ * Computes out[i] = y0[i] + frac[i] * (y1[i] - y0[i]).  NaNs propagate, so the caller
+ * must set y1 to y0 where frac is 0 and y1 may be unknown.
+ *
+ * \param y0		Pointer to the values at the start of each interval
+ * \param y1		Pointer to the values at the end of each interval
+ * \param frac		Pointer to the position in each interval (0 to 1)
+ * \param out		Pointer to an array to receive the results (may be y0)
+ * \param n		Number of values
+ */
+void tsdb_agg_lerp(const tsdb_data_t *y0, const tsdb_data_t *y1, const tsdb_data_t *frac,
+	tsdb_data_t *out, unsigned int n);
+
+/*!
+ * \brief		Chooses the point of a bucket for Largest-Triangle-Three-Buckets downsampling
+ *
+ * The point chosen forms the largest triangle with the point chosen from the previous
+ * bucket and the mean of the next bucket.
+ *
+ * \param data		Pointer to the (valid) values in the bucket
+ * \param index	Pointer to the position of each value (the x coordinate)
+ * \param n		Number of values (at least 1)
+ * \param ax		Position of the point chosen from the previous bucket
+ * \param ay		Value of the point chosen from the previous bucket
+ * \param cx		Mean position of the next bucket
+ * \param cy		Mean value of the next bucket
+ * \return		Index into data of the chosen point
+ */
+unsigned int tsdb_agg_lttb(const tsdb_data_t *data, const uint64_t *index, unsigned int n,
+	double ax, double ay, double cx, double cy);
+
+/*!
+ * \brief		Returns the name of the kernel implementation in use ("avx2", "sse2" or "scalar")
+ */
+const char* tsdb_agg_isa(void);
+
+#endif
@@ -0,0 +1,570 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Containers that pack many small nodes into a few large files.
+ *
+ * Each container has a metadata file holding the metadata of its nodes, a data file
+ * holding their segments, and an index recording where each of these extents is.  The
+ * index is only ever appended to, so a torn write can lose no more than the last
+ * record.  All extents are held in memory while the container is open.  Freed extents
+ * have their space released from the file and are reused by later allocations. */
+
+#define _GNU_SOURCE		/* for fallocate */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tsdb.h"
+#include "tsdb_pack.h"
+#include "logging.h"
+#include "profile.h"
+
+/* Extent held in memory, either in use (in the hash table) or free */
+typedef struct tsdb_pack_extent {
+	tsdb_extent_t	record;				/*< Latest index record for the extent */
+	struct tsdb_pack_extent *next;			/*< Next in the same hash bucket or free list */
+} tsdb_pack_extent_t;
+
+static tsdb_pack_t g_packs[TSDB_PACK_FILES] = {
+	[0 ... TSDB_PACK_FILES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+#define TSDB_EXTENT_IS_META(record)	((record)->layer == TSDB_EXTENT_METADATA)
+/* Whether the index holds enough superseded records to be worth rewriting */
+#define TSDB_PACK_NEEDS_COMPACT(pack)	((pack)->nrecords > 1024 && \
+	(pack)->nrecords > 2 * ((pack)->nlive + (pack)->nfree))
+
+static inline unsigned int tsdb_pack_hash(uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment)
+{
+	uint64_t key = node_id ^ ((uint64_t)layer << 56) ^ ((uint64_t)column << 48) ^
+		(segment * 0x9E3779B97F4A7C15ull);
+
+	return (unsigned int)((key ^ (key >> 32)) * 2654435761u) & (TSDB_PACK_HASH_SIZE - 1);
+}
+
+/* Returns the link to an extent in use, or NULL if there is none.  Must be called with
+ * the container locked. */
+static tsdb_pack_extent_t** tsdb_pack_lookup(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer,
+	unsigned int column, uint64_t segment)
+{
+	tsdb_pack_extent_t **link = &pack->hash[tsdb_pack_hash(node_id, layer, column, segment)];
+
+	for ( ; *link; link = &(*link)->next) {
+		if ((*link)->record.node_id == node_id && (*link)->record.layer == layer &&
+				(*link)->record.column == column && (*link)->record.segment == segment)
+			return link;
+	}
+	return NULL;
+}
+
+/* Removes the space of a newly allocated extent from the free extent it came from */
+static int tsdb_pack_take(tsdb_pack_t *pack, const tsdb_extent_t *record)
+{
+	tsdb_pack_extent_t **link, *extent, *tail;
+	uint64_t end, record_end = record->offset + record->length;
+
+	for (link = &pack->free; (extent = *link) != NULL; link = &extent->next) {
+		end = extent->record.offset + extent->record.length;
+		if (TSDB_EXTENT_IS_META(&extent->record) != TSDB_EXTENT_IS_META(record) ||
+				record->offset < extent->record.offset || record->offset >= end)
+			continue;
+
+		/* Whatever is left either side stays free */
+		if (record_end < end) {
+			tail = (tsdb_pack_extent_t*)malloc(sizeof(tsdb_pack_extent_t));
+			if (tail == NULL) {
+				CRITICAL("Out of memory\n");
+				return -ENOMEM;
+			}
+			tail->record = extent->record;
+			tail->record.offset = record_end;
+			tail->record.length = end - record_end;
+			tail->next = extent->next;
+			extent->next = tail;
+			pack->nfree++;
+		}
+		if (extent->record.offset < record->offset) {
+			extent->record.length = record->offset - extent->record.offset;
+		} else {
+			*link = extent->next;
+			free(extent);
+			pack->nfree--;
+		}
+		break;
+	}
+	return 0;
+}
+
+/* Adds a freed extent to the free list, merging it with any free neighbours in the same
+ * file so that space released by many small extents can be reused by a larger one */
+static void tsdb_pack_merge(tsdb_pack_t *pack, tsdb_pack_extent_t *extent)
+{
+	tsdb_pack_extent_t **link, *other;
+
+	for (link = &pack->free; (other = *link) != NULL; ) {
+		if (TSDB_EXTENT_IS_META(&other->record) != TSDB_EXTENT_IS_META(&extent->record) ||
+				(other->record.offset + other->record.length != extent->record.offset &&
+				extent->record.offset + extent->record.length != other->record.offset)) {
+			link = &other->next;
+			continue;
+		}
+		if (other->record.offset < extent->record.offset)
+			extent->record.offset = other->record.offset;
+		extent->record.length += other->record.length;
+		*link = other->next;
+		free(other);
+		pack->nfree--;
+	}
+	extent->next = pack->free;
+	pack->free = extent;
+	pack->nfree++;
+}
+
+/* Applies an index record to the extents held in memory */
+static int tsdb_pack_apply(tsdb_pack_t *pack, const tsdb_extent_t *record)
+{
+	tsdb_pack_extent_t **link, *extent;
+	int rc;
+
+	link = tsdb_pack_lookup(pack, record->node_id, record->layer, record->column, record->segment);
+	if (record->free) {
+		/* The key no longer refers to the extent once it has been freed */
+		if (link != NULL && (*link)->record.offset == record->offset) {
+			extent = *link;
+			*link = extent->next;
+			pack->nlive--;
+		} else {
+			extent = (tsdb_pack_extent_t*)malloc(sizeof(tsdb_pack_extent_t));
+			if (extent == NULL) {
+				CRITICAL("Out of memory\n");
+				return -ENOMEM;
+			}
+		}
+		extent->record = *record;
+		tsdb_pack_merge(pack, extent);
+		return 0;
+	}
+
+	if ((rc = tsdb_pack_take(pack, record)) < 0)
+		return rc;
+	if (link != NULL) {
+		(*link)->record = *record;
+		return 0;
+	}
+	extent = (tsdb_pack_extent_t*)malloc(sizeof(tsdb_pack_extent_t));
+	if (extent == NULL) {
+		CRITICAL("Out of memory\n");
+		return -ENOMEM;
+	}
+	extent->record = *record;
+	link = &pack->hash[tsdb_pack_hash(record->node_id, record->layer, record->column, record->segment)];
+	extent->next = *link;
+	*link = extent;
+	pack->nlive++;
+	return 0;
+}
+
+/* Writes an index holding only the current record of each extent, and replaces the
+ * old index with it */
+static int tsdb_pack_compact(tsdb_pack_t *pack)
+{
+	tsdb_pack_extent_t *extent;
+	char path[TSDB_MAX_PATH], tmp[TSDB_MAX_PATH];
+	uint64_t end = 0;
+	unsigned int n;
+	int fd;
+
+	snprintf(path, TSDB_MAX_PATH, TSDB_PACK_INDEX_FORMAT, pack->number);
+	snprintf(tmp, TSDB_MAX_PATH, TSDB_PACK_INDEX_FORMAT ".new", pack->number);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERROR("Error creating %s: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+	for (n = 0; n <= TSDB_PACK_HASH_SIZE; n++) {
+		extent = (n < TSDB_PACK_HASH_SIZE) ? pack->hash[n] : pack->free;
+		for ( ; extent; extent = extent->next) {
+			if (pwrite(fd, &extent->record, sizeof(tsdb_extent_t), end) != sizeof(tsdb_extent_t))
+				goto fail;
+			end += sizeof(tsdb_extent_t);
+		}
+	}
+	if (fdatasync(fd) < 0 || rename(tmp, path) < 0)
+		goto fail;
+
+	INFO("Compacted index of container %u from %u to %u records\n", pack->number, pack->nrecords,
+		pack->nlive + pack->nfree);
+	close(pack->index_fd);
+	pack->index_fd = fd;
+	pack->index_end = end;
+	pack->nrecords = pack->nlive + pack->nfree;
+	return 0;
+
+fail:
+	ERROR("Error compacting index of container %u: %s\n", pack->number, strerror(errno));
+	close(fd);
+	unlink(tmp);
+	return -EIO;
+}
+
+/* Appends a record to the index and applies it */
+static int tsdb_pack_append(tsdb_pack_t *pack, const tsdb_extent_t *record)
+{
+	int rc;
+
+	if (pwrite(pack->index_fd, record, sizeof(tsdb_extent_t), pack->index_end) != sizeof(tsdb_extent_t)) {
+		ERROR("Error writing index of container %u: %s\n", pack->number, strerror(errno));
+		return -EIO;
+	}
+	pack->index_end += sizeof(tsdb_extent_t);
+	pack->nrecords++;
+	if ((rc = tsdb_pack_apply(pack, record)) < 0)
+		return rc;
+
+	/* Superseded records are dropped once they make up most of the index */
+	if (TSDB_PACK_NEEDS_COMPACT(pack))
+		tsdb_pack_compact(pack);
+	return 0;
+}
+
+/* Returns a range of a container file to zeroes, releasing its space if possible */
+static int tsdb_pack_zero(int fd, uint64_t offset, uint64_t length)
+{
+	static const uint8_t zeroes[4096];
+	ssize_t count;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		return 0;
+#endif
+	while (length) {
+		count = pwrite(fd, zeroes, (length < sizeof(zeroes)) ? length : sizeof(zeroes), offset);
+		if (count < 0)
+			return -errno;
+		offset += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/* Frees an extent in use.  Must be called with the container locked. */
+static int tsdb_pack_release(tsdb_pack_t *pack, const tsdb_extent_t *extent)
+{
+	tsdb_extent_t record = *extent;
+	int rc;
+
+	DEBUG("Freeing %" PRIu64 " bytes at %" PRIu64 " in container %u\n", record.length, record.offset,
+		pack->number);
+	rc = tsdb_pack_zero(TSDB_EXTENT_IS_META(&record) ? pack->meta_fd : pack->data_fd,
+		record.offset, record.length);
+	if (rc < 0) {
+		ERROR("Error freeing extent in container %u: %s\n", pack->number, strerror(-rc));
+		return rc;
+	}
+	record.free = 1;
+	return tsdb_pack_append(pack, &record);
+}
+
+/* Frees every extent held in memory */
+static void tsdb_pack_clear(tsdb_pack_t *pack)
+{
+	tsdb_pack_extent_t *extent, *next;
+	unsigned int n;
+
+	for (n = 0; n < TSDB_PACK_HASH_SIZE; n++) {
+		for (extent = pack->hash[n]; extent; extent = next) {
+			next = extent->next;
+			free(extent);
+		}
+		pack->hash[n] = NULL;
+	}
+	for (extent = pack->free; extent; extent = next) {
+		next = extent->next;
+		free(extent);
+	}
+	pack->free = NULL;
+	pack->nlive = pack->nfree = pack->nrecords = 0;
+}
+
+/* Opens a container's files and reads its index, stopping at the first torn or corrupt
+ * record.  Must be called with the container locked. */
+static int tsdb_pack_load(tsdb_pack_t *pack, int create)
+{
+	int flags = O_RDWR | (create ? O_CREAT : 0);
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	char path[TSDB_MAX_PATH];
+	tsdb_extent_t record;
+	struct stat st;
+	int rc;
+
+	FUNCTION_TRACE;
+
+	pack->meta_fd = pack->data_fd = -1;
+	snprintf(path, TSDB_MAX_PATH, TSDB_PACK_INDEX_FORMAT, pack->number);
+	pack->index_fd = open(path, flags, 0644);
+	if (pack->index_fd < 0) {
+		rc = -errno;
+		if (rc != -ENOENT)
+			ERROR("Error opening %s: %s\n", path, strerror(-rc));
+		return rc;
+	}
+	snprintf(path, TSDB_MAX_PATH, TSDB_PACK_META_FORMAT, pack->number);
+	if ((pack->meta_fd = open(path, flags, 0644)) < 0 || fstat(pack->meta_fd, &st) < 0)
+		goto fail;
+	pack->meta_end = (st.st_size + TSDB_PACK_META_ALIGN - 1) / TSDB_PACK_META_ALIGN * TSDB_PACK_META_ALIGN;
+	snprintf(path, TSDB_MAX_PATH, TSDB_PACK_DATA_FORMAT, pack->number);
+	if ((pack->data_fd = open(path, flags, 0644)) < 0 || fstat(pack->data_fd, &st) < 0)
+		goto fail;
+	pack->data_end = (st.st_size + page - 1) / page * page;
+
+	snprintf(path, TSDB_MAX_PATH, TSDB_PACK_INDEX_FORMAT, pack->number);
+	if (fstat(pack->index_fd, &st) < 0)
+		goto fail;
+	pack->index_end = 0;
+	while (pread(pack->index_fd, &record, sizeof(record), pack->index_end) == sizeof(record) &&
+			record.magic == TSDB_MAGIC_EXTENT) {
+		if ((rc = tsdb_pack_apply(pack, &record)) < 0) {
+			tsdb_pack_clear(pack);
+			goto done;
+		}
+		pack->index_end += sizeof(record);
+		pack->nrecords++;
+	}
+	if (pack->index_end != (uint64_t)st.st_size) {
+		ERROR("Discarding torn end of %s\n", path);
+		if (ftruncate(pack->index_fd, pack->index_end) < 0)
+			goto fail;
+	}
+	DEBUG("Container %u holds %u extents (%u free) from %u records\n", pack->number, pack->nlive,
+		pack->nfree, pack->nrecords);
+
+	if (TSDB_PACK_NEEDS_COMPACT(pack))
+		tsdb_pack_compact(pack);
+	pack->loaded = 1;
+	return 0;
+
+fail:
+	rc = -errno;
+	ERROR("Error opening %s: %s\n", path, strerror(-rc));
+	tsdb_pack_clear(pack);
+done:
+	if (pack->data_fd >= 0)
+		close(pack->data_fd);
+	if (pack->meta_fd >= 0)
+		close(pack->meta_fd);
+	close(pack->index_fd);
+	return rc;
+}
+
+int tsdb_pack_get(uint64_t node_id, int create, tsdb_pack_t **packp)
+{
+	tsdb_pack_t *pack = &g_packs[node_id % TSDB_PACK_FILES];
+	int rc = 0;
+
+	FUNCTION_TRACE;
+
+	pthread_mutex_lock(&pack->lock);
+	if (!pack->loaded) {
+		pack->number = (unsigned int)(node_id % TSDB_PACK_FILES);
+		rc = tsdb_pack_load(pack, create);
+	}
+	pthread_mutex_unlock(&pack->lock);
+	if (rc == 0)
+		*packp = pack;
+	return rc;
+}
+
+int tsdb_pack_find(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment, uint64_t *offset, uint64_t *length)
+{
+	tsdb_pack_extent_t **link;
+
+	pthread_mutex_lock(&pack->lock);
+	link = tsdb_pack_lookup(pack, node_id, layer, column, segment);
+	if (link != NULL) {
+		if (offset)
+			*offset = (*link)->record.offset;
+		if (length)
+			*length = (*link)->record.length;
+	}
+	pthread_mutex_unlock(&pack->lock);
+	return link ? 0 : -ENOENT;
+}
+
+int tsdb_pack_alloc(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment, uint64_t length, uint64_t *offset)
+{
+	tsdb_extent_t record;
+	tsdb_pack_extent_t *extent;
+	uint64_t align = (layer == TSDB_EXTENT_METADATA) ? TSDB_PACK_META_ALIGN : (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t *end = (layer == TSDB_EXTENT_METADATA) ? &pack->meta_end : &pack->data_end;
+	int fd = (layer == TSDB_EXTENT_METADATA) ? pack->meta_fd : pack->data_fd;
+	int rc = 0;
+
+	FUNCTION_TRACE;
+
+	memset(&record, 0, sizeof(record));
+	record.magic = TSDB_MAGIC_EXTENT;
+	record.node_id = node_id;
+	record.layer = layer;
+	record.column = column;
+	record.segment = segment;
+	record.length = (length + align - 1) / align * align;
+
+	pthread_mutex_lock(&pack->lock);
+	if (tsdb_pack_lookup(pack, node_id, layer, column, segment) != NULL) {
+		rc = -EEXIST;
+		goto done;
+	}
+
+	/* Reuse the first free extent that is big enough, otherwise extend the file */
+	for (extent = pack->free; extent; extent = extent->next) {
+		if (TSDB_EXTENT_IS_META(&extent->record) == TSDB_EXTENT_IS_META(&record) &&
+				extent->record.length >= record.length)
+			break;
+	}
+	if (extent != NULL) {
+		record.offset = extent->record.offset;
+	} else {
+		record.offset = *end;
+		if (ftruncate(fd, record.offset + record.length) < 0) {
+			rc = -errno;
+			ERROR("Error extending container %u: %s\n", pack->number, strerror(-rc));
+			goto done;
+		}
+		*end = record.offset + record.length;
+	}
+	DEBUG("Allocated %" PRIu64 " bytes at %" PRIu64 " in container %u\n", record.length, record.offset,
+		pack->number);
+
+	/* Nothing may be written to the extent until it is known to be allocated, or a crash
+	 * could leave it used by two nodes */
+	if ((rc = tsdb_pack_append(pack, &record)) < 0)
+		goto done;
+	if (fdatasync(pack->index_fd) < 0) {
+		rc = -errno;
+		ERROR("Sync of index of container %u failed: %s\n", pack->number, strerror(-rc));
+		goto done;
+	}
+	*offset = record.offset;
+done:
+	pthread_mutex_unlock(&pack->lock);
+	return rc;
+}
+
+int tsdb_pack_free(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment)
+{
+	tsdb_pack_extent_t **link;
+	int rc;
+
+	FUNCTION_TRACE;
+
+	pthread_mutex_lock(&pack->lock);
+	link = tsdb_pack_lookup(pack, node_id, layer, column, segment);
+	rc = link ? tsdb_pack_release(pack, &(*link)->record) : -ENOENT;
+	pthread_mutex_unlock(&pack->lock);
+	return rc;
+}
+
+int tsdb_pack_free_node(tsdb_pack_t *pack, uint64_t node_id)
+{
+	tsdb_pack_extent_t **link;
+	unsigned int n;
+	int rc = 0, err;
+
+	FUNCTION_TRACE;
+
+	pthread_mutex_lock(&pack->lock);
+	for (n = 0; n < TSDB_PACK_HASH_SIZE; n++) {
+		/* Freeing an extent unlinks it, leaving the link pointing to the next */
+		for (link = &pack->hash[n]; *link; ) {
+			if ((*link)->record.node_id != node_id) {
+				link = &(*link)->next;
+				continue;
+			}
+			if ((err = tsdb_pack_release(pack, &(*link)->record)) < 0) {
+				rc = err;
+				link = &(*link)->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&pack->lock);
+	return rc;
+}
+
+void tsdb_pack_get_stats(tsdb_pack_stats_t *stats)
+{
+	tsdb_pack_extent_t *extent;
+	tsdb_pack_t *pack;
+	unsigned int n;
+
+	FUNCTION_TRACE;
+
+	memset(stats, 0, sizeof(*stats));
+	for (n = 0; n < TSDB_PACK_FILES; n++) {
+		pack = &g_packs[n];
+		pthread_mutex_lock(&pack->lock);
+		if (!pack->loaded) {
+			pack->number = n;
+			tsdb_pack_load(pack, 0);
+		}
+		if (pack->loaded) {
+			stats->size += pack->meta_end + pack->data_end;
+			for (extent = pack->free; extent; extent = extent->next)
+				stats->free += extent->record.length;
+		}
+		pthread_mutex_unlock(&pack->lock);
+	}
+}
+
+void tsdb_pack_close_all(void)
+{
+	tsdb_pack_t *pack;
+	unsigned int n;
+
+	FUNCTION_TRACE;
+
+	for (n = 0; n < TSDB_PACK_FILES; n++) {
+		pack = &g_packs[n];
+		pthread_mutex_lock(&pack->lock);
+		if (pack->loaded) {
+			tsdb_pack_clear(pack);
+			close(pack->index_fd);
+			close(pack->data_fd);
+			close(pack->meta_fd);
+			pack->loaded = 0;
+		}
+		pthread_mutex_unlock(&pack->lock);
+	}
+}
@@ -0,0 +1,169 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TSDB_PACK_H
+#define TSDB_PACK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "tsdb.h"
+
+#define TSDB_MAGIC_EXTENT	0x54584554 // TEXT (little-endian)
+
+/* Number of containers in the database directory.  Nodes are spread over them by ID. */
+#define TSDB_PACK_FILES		16
+/* Formats for the names of a container's metadata file, data file and extent index
+ * ((unsigned int)container) */
+#define TSDB_PACK_META_FORMAT	"pack_%02u.meta"
+#define TSDB_PACK_DATA_FORMAT	"pack_%02u.dat"
+#define TSDB_PACK_INDEX_FORMAT	"pack_%02u.idx"
+/* Size of the hash table of extents held for each container */
+#define TSDB_PACK_HASH_SIZE	4096
+/* Metadata is packed at this alignment.  Data extents are whole pages, so that each
+ * segment can be mapped on its own. */
+#define TSDB_PACK_META_ALIGN	64
+
+/* Layer number of the extent holding a node's metadata (column and segment 0) */
+#define TSDB_EXTENT_METADATA	UINT32_MAX
+
+/* Extent index record.  The index is a log of these, applied in order when the container
+ * is opened, and rewritten without the records that have been superseded once there are
+ * enough of them. */
+typedef struct {
+	uint32_t	magic;				/*< Magic number - indicates an extent record */
+	uint32_t	layer;				/*< Layer, or TSDB_EXTENT_METADATA */
+	uint64_t	node_id;			/*< Node the extent belongs to */
+	uint32_t	column;				/*< Table column (0 if not columnar) */
+	uint32_t	free;				/*< Set if the extent has been freed */
+	uint64_t	segment;			/*< Segment number */
+	uint64_t	offset;				/*< Position in the metadata or data file (bytes) */
+	uint64_t	length;				/*< Size of the extent (bytes) */
+} tsdb_extent_t;
+
+/* Container of many small nodes.  The metadata of each node is a slot in the metadata
+ * file, and each of its segments an extent in the data file, so a node costs no files
+ * or descriptors of its own. */
+typedef struct tsdb_pack {
+	unsigned int	number;				/*< Container number */
+	int		loaded;				/*< Set once the files are open and the index read */
+	int		meta_fd;			/*< Metadata file */
+	int		data_fd;			/*< Data file */
+	int		index_fd;			/*< Extent index */
+	uint64_t	meta_end;			/*< Size of the metadata file */
+	uint64_t	data_end;			/*< Size of the data file */
+	uint64_t	index_end;			/*< Size of the extent index */
+	unsigned int	nlive;				/*< Number of extents in use */
+	unsigned int	nfree;				/*< Number of free extents */
+	unsigned int	nrecords;			/*< Number of records in the index */
+	struct tsdb_pack_extent *hash[TSDB_PACK_HASH_SIZE];	/*< Extents in use */
+	struct tsdb_pack_extent *free;			/*< Freed extents available for reuse */
+	pthread_mutex_t	lock;				/*< Protects all of the above */
+} tsdb_pack_t;
+
+/* Space used by the containers */
+typedef struct {
+	uint64_t	size;				/*< Size of the metadata and data files (bytes) */
+	uint64_t	free;				/*< Space in them held by freed extents (bytes) */
+} tsdb_pack_stats_t;
+
+/*!
+ * \brief		Returns the container that packs a node, opening it if necessary
+ * \param node_id	Node whose container is wanted
+ * \param create	Non-zero to create the container's files if they do not exist
+ * \param packp		Pointer to variable to receive the container
+ * \return		0, -ENOENT if the container does not exist and is not to be
+ *			created, or other negative error code
+ */
+int tsdb_pack_get(uint64_t node_id, int create, tsdb_pack_t **packp);
+
+/*!
+ * \brief		Finds an extent of a node in its container
+ * \param pack		Container returned by tsdb_pack_get
+ * \param node_id	Node the extent belongs to
+ * \param layer		Layer, or TSDB_EXTENT_METADATA for the node's metadata
+ * \param column	Table column (0 if not columnar or for metadata)
+ * \param segment	Segment number (0 for metadata)
+ * \param offset	Pointer to variable to receive the extent's position (or NULL)
+ * \param length	Pointer to variable to receive the extent's size (or NULL)
+ * \return		0, -ENOENT if the extent does not exist
+ */
+int tsdb_pack_find(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment, uint64_t *offset, uint64_t *length);
+
+/*!
+ * \brief		Allocates a new extent of a node in its container
+ *
+ * The extent reads as zeroes until it is written.  Its index record is made durable
+ * before it is returned.
+ *
+ * \param pack		Container returned by tsdb_pack_get
+ * \param node_id	Node the extent belongs to
+ * \param layer		Layer, or TSDB_EXTENT_METADATA for the node's metadata
+ * \param column	Table column (0 if not columnar or for metadata)
+ * \param segment	Segment number (0 for metadata)
+ * \param length	Size of the extent (bytes).  Data extents are rounded up to whole pages.
+ * \param offset	Pointer to variable to receive the extent's position
+ * \return		0, -EEXIST if the extent already exists, or other negative error code
+ */
+int tsdb_pack_alloc(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment, uint64_t length, uint64_t *offset);
+
+/*!
+ * \brief		Frees an extent of a node, releasing its space on disk
+ * \param pack		Container returned by tsdb_pack_get
+ * \param node_id	Node the extent belongs to
+ * \param layer		Layer, or TSDB_EXTENT_METADATA for the node's metadata
+ * \param column	Table column (0 if not columnar or for metadata)
+ * \param segment	Segment number (0 for metadata)
+ * \return		0, -ENOENT if the extent does not exist, or other negative error code
+ */
+int tsdb_pack_free(tsdb_pack_t *pack, uint64_t node_id, unsigned int layer, unsigned int column,
+	uint64_t segment);
+
+/*!
+ * \brief		Frees every extent of a node, including its metadata
+ * \param pack		Container returned by tsdb_pack_get
+ * \param node_id	Node to free
+ * \return		0 or negative error code
+ */
+int tsdb_pack_free_node(tsdb_pack_t *pack, uint64_t node_id);
+
+/*!
+ * \brief		Returns the space used by all of the containers, opening any that exist
+ *
+ * Freed space is reused by later extents before the files are extended, so the size
+ * only grows once the free space runs out.
+ *
+ * \param stats		Pointer to the statistics to be filled in
+ */
+void tsdb_pack_get_stats(tsdb_pack_stats_t *stats);
+
+/*!
+ * \brief		Closes all open containers
+ *
+ * Must only be called while no packed node is open.
+ */
+void tsdb_pack_close_all(void);
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Write-ahead log shared by all nodes.
+ *
+ * Every update is appended to the log before it is applied to the node's files,
+ * which are written without syncing as before.  Records are appended with the node
+ * locked for writing, so the log holds each node's updates in the order they were
+ * applied.  After a crash the log is replayed on startup in that order, which ends
+ * with the same values as the tables had even where records had already reached them.
+ * Deleting a node appends a tombstone, and none of the node's records before it are
+ * replayed.  The log is emptied at each checkpoint, once all nodes modified since the
+ * last one have been synced.
+ *
+ * Log sequence numbers (LSNs) are the total number of bytes ever appended, so they
+ * keep increasing across checkpoints.  A single commit thread syncs the log, so
+ * concurrent updates waiting on the every-commit policy share one fdatasync. */
+
+#define _GNU_SOURCE		/* for PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tsdb.h"
+#include "tsdb_wal.h"
+#include "logging.h"
+#include "profile.h"
+
+static struct {
+	int		fd;				/*< Log file, or -1 if the log is not in use */
+	int		logging;			/*< Set once replay is complete */
+	int		stop;				/*< Tells the commit thread to exit */
+	int		error;				/*< Error from the last sync, if it failed */
+	tsdb_wal_policy_t policy;
+	unsigned int	interval;			/*< Commit thread period (ms) */
+	uint64_t	size;				/*< Current size of the log file */
+	uint64_t	written_lsn;			/*< LSN of the end of the last record appended */
+	uint64_t	synced_lsn;			/*< All records up to this LSN are durable */
+	pthread_t	thread;
+	pthread_mutex_t	mutex;				/*< Protects all of the above */
+	pthread_cond_t	work;				/*< Signalled when there is work for the commit thread */
+	pthread_cond_t	done;				/*< Signalled when synced_lsn advances */
+	pthread_rwlock_t checkpoint_lock;		/*< Held for read from append to commit, for write
+							 *  while checkpointing */
+} g_wal = {
+	.fd = -1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+#define FNV_OFFSET_BASIS	2166136261u
+#define FNV_PRIME		16777619u
+
+static uint32_t tsdb_wal_hash(uint32_t hash, const void *data, size_t size)
+{
+	const uint8_t *ptr = (const uint8_t*)data;
+
+	while (size--) {
+		hash = (hash ^ *ptr++) * FNV_PRIME;
+	}
+	return hash;
+}
+
+/* Reads the record at offset into record and buffer (grown as needed).  Returns 0, or
+ * -ENOENT at the end of the log or at a torn or corrupt record. */
+static int tsdb_wal_read(uint64_t offset, tsdb_wal_record_t *record, uint8_t **buffer, size_t *buffer_size)
+{
+	size_t payload;
+	uint32_t checksum;
+
+	if (pread(g_wal.fd, record, sizeof(*record), offset) != sizeof(*record))
+		return -ENOENT;
+	if (TSDB_WAL_IS_TOMBSTONE(record)) {
+		payload = 0;
+	} else {
+		if (record->magic != TSDB_MAGIC_WAL || record->value_size != sizeof(tsdb_data_t) ||
+			record->nmetrics == 0 || record->nmetrics > TSDB_MAX_METRICS ||
+			record->count == 0 || record->count > (UINT32_MAX - sizeof(*record)) /
+				(sizeof(int64_t) + sizeof(tsdb_data_t) * record->nmetrics)) {
+			return -ENOENT;
+		}
+		payload = (size_t)record->count * (sizeof(int64_t) + sizeof(tsdb_data_t) * record->nmetrics);
+	}
+	if (record->length != sizeof(*record) + payload)
+		return -ENOENT;
+	if (payload > *buffer_size) {
+		uint8_t *newbuffer = (uint8_t*)realloc(*buffer, payload);
+		if (newbuffer == NULL) {
+			CRITICAL("Out of memory\n");
+			return -ENOMEM;
+		}
+		*buffer = newbuffer;
+		*buffer_size = payload;
+	}
+	if (payload && pread(g_wal.fd, *buffer, payload, offset + sizeof(*record)) != payload)
+		return -ENOENT;
+	checksum = record->checksum;
+	record->checksum = 0;
+	if (tsdb_wal_hash(tsdb_wal_hash(FNV_OFFSET_BASIS, record, sizeof(*record)), *buffer, payload) != checksum)
+		return -ENOENT;
+	return 0;
+}
+
+/* Apply every complete record in the log, stopping at the first torn or corrupt one.
+ * The tombstones are found first, so that the records of a deleted node can be passed
+ * over even if a node of the same ID was created after it. */
+static int tsdb_wal_replay(void)
+{
+	tsdb_wal_record_t record;
+	uint8_t *buffer = NULL;
+	size_t buffer_size = 0;
+	uint64_t offset, end, *tombstones = NULL, *newtombstones;
+	unsigned int n, ntombstones = 0, nrecords = 0, nskipped = 0;
+	struct stat st;
+	tsdb_ctx_t *ctx;
+	int rc = 0;
+
+	FUNCTION_TRACE;
+
+	if (fstat(g_wal.fd, &st) < 0) {
+		ERROR("Unable to stat log: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	/* Each tombstone is held as the node ID followed by the offset of the record */
+	for (offset = 0; (rc = tsdb_wal_read(offset, &record, &buffer, &buffer_size)) == 0; offset += record.length) {
+		if (!TSDB_WAL_IS_TOMBSTONE(&record))
+			continue;
+		newtombstones = (uint64_t*)realloc(tombstones, sizeof(uint64_t) * 2 * (ntombstones + 1));
+		if (newtombstones == NULL) {
+			CRITICAL("Out of memory\n");
+			rc = -ENOMEM;
+			goto done;
+		}
+		tombstones = newtombstones;
+		tombstones[2 * ntombstones] = record.node_id;
+		tombstones[2 * ntombstones++ + 1] = offset;
+	}
+	if (rc == -ENOMEM)
+		goto done;
+	end = offset;
+
+	for (offset = 0; offset < end; offset += record.length) {
+		if ((rc = tsdb_wal_read(offset, &record, &buffer, &buffer_size)) < 0)
+			goto done;
+		nrecords++;
+		if (TSDB_WAL_IS_TOMBSTONE(&record))
+			continue;
+
+		/* Nodes deleted since the record was written are skipped */
+		for (n = 0; n < ntombstones; n++) {
+			if (tombstones[2 * n] == record.node_id && tombstones[2 * n + 1] > offset)
+				break;
+		}
+		ctx = (n < ntombstones) ? NULL : tsdb_open(record.node_id);
+		if (ctx == NULL || ctx->meta->nmetrics != record.nmetrics) {
+			INFO("Skipping log record for node %016" PRIX64 "\n", record.node_id);
+			nskipped++;
+		} else {
+			rc = tsdb_update_values_batch(ctx, (int64_t*)buffer,
+				(tsdb_data_t*)(buffer + sizeof(int64_t) * record.count), record.count);
+			if (rc < 0) {
+				ERROR("Replay of log record for node %016" PRIX64 " failed: %s\n",
+					record.node_id, strerror(-rc));
+			}
+		}
+		if (ctx != NULL)
+			tsdb_close(ctx);
+	}
+
+	if (end < (uint64_t)st.st_size) {
+		INFO("Discarding %" PRIu64 " bytes of incomplete log\n", (uint64_t)st.st_size - end);
+	}
+	if (nrecords) {
+		INFO("Replayed %u log records (%u skipped, %u tombstones)\n", nrecords, nskipped, ntombstones);
+	}
+
+	/* Everything replayed must be durable before the log can be emptied */
+	if ((rc = tsdb_sync_all()) < 0)
+		goto done;
+	if (ftruncate(g_wal.fd, 0) < 0 || fdatasync(g_wal.fd) < 0) {
+		ERROR("Unable to truncate log: %s\n", strerror(errno));
+		rc = -errno;
+	}
+done:
+	free(buffer);
+	free(tombstones);
+	return rc;
+}
+
+static int tsdb_wal_do_checkpoint(void)
+{
+	int rc;
+
+	FUNCTION_TRACE;
+
+	/* Waits for updates in progress to be applied and holds off new ones */
+	pthread_rwlock_wrlock(&g_wal.checkpoint_lock);
+	rc = tsdb_sync_all();
+	if (rc == 0) {
+		pthread_mutex_lock(&g_wal.mutex);
+		if (ftruncate(g_wal.fd, 0) < 0 || fdatasync(g_wal.fd) < 0) {
+			ERROR("Unable to truncate log: %s\n", strerror(errno));
+			rc = -errno;
+		} else {
+			DEBUG("Checkpoint at LSN %" PRIu64 "\n", g_wal.written_lsn);
+			g_wal.size = 0;
+
+			/* Everything logged so far is now in the synced tables */
+			g_wal.synced_lsn = g_wal.written_lsn;
+			pthread_cond_broadcast(&g_wal.done);
+		}
+		pthread_mutex_unlock(&g_wal.mutex);
+	}
+	pthread_rwlock_unlock(&g_wal.checkpoint_lock);
+	return rc;
+}
+
+static void* tsdb_wal_thread(void *arg)
+{
+	struct timespec deadline;
+	uint64_t target, size;
+	int rc;
+
+	pthread_mutex_lock(&g_wal.mutex);
+	while (!g_wal.stop) {
+		if (g_wal.policy == tsdbWal_Commit) {
+			/* Sync as soon as anything is waiting.  Records appended while a sync is in
+			 * progress are picked up together by the next one. */
+			while (!g_wal.stop && g_wal.written_lsn == g_wal.synced_lsn) {
+				pthread_cond_wait(&g_wal.work, &g_wal.mutex);
+			}
+		} else {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += g_wal.interval / 1000;
+			deadline.tv_nsec += (long)(g_wal.interval % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while (!g_wal.stop && pthread_cond_timedwait(&g_wal.work, &g_wal.mutex, &deadline) != ETIMEDOUT);
+		}
+		if (g_wal.stop)
+			break;
+
+		target = g_wal.written_lsn;
+		size = g_wal.size;
+		if (target != g_wal.synced_lsn && g_wal.policy != tsdbWal_None) {
+			pthread_mutex_unlock(&g_wal.mutex);
+			rc = (fdatasync(g_wal.fd) < 0) ? -errno : 0;
+			pthread_mutex_lock(&g_wal.mutex);
+			if (rc < 0) {
+				ERROR("Log sync failed: %s\n", strerror(-rc));
+				g_wal.error = rc;
+			}
+			/* A checkpoint may have overtaken us */
+			if (target > g_wal.synced_lsn)
+				g_wal.synced_lsn = target;
+			pthread_cond_broadcast(&g_wal.done);
+		}
+
+		if (size >= TSDB_WAL_CHECKPOINT_SIZE) {
+			pthread_mutex_unlock(&g_wal.mutex);
+			tsdb_wal_do_checkpoint();
+			pthread_mutex_lock(&g_wal.mutex);
+		}
+	}
+	pthread_mutex_unlock(&g_wal.mutex);
+
+	return NULL;
+}
+
+int tsdb_wal_open(const char *path, tsdb_wal_policy_t policy, unsigned int interval)
+{
+	pthread_rwlockattr_t attr;
+	int rc;
+
+	FUNCTION_TRACE;
+
+	if ((unsigned int)policy >= tsdbWal_Max || interval == 0) {
+		ERROR("Bad log policy\n");
+		return -EINVAL;
+	}
+	if (g_wal.fd >= 0) {
+		ERROR("Log already open\n");
+		return -EBUSY;
+	}
+
+	INFO("Opening log %s\n", path);
+	g_wal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (g_wal.fd < 0) {
+		ERROR("Error opening log %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	g_wal.policy = policy;
+	g_wal.interval = interval;
+	g_wal.stop = 0;
+	g_wal.error = 0;
+
+	/* Checkpoints must not be starved by a steady stream of updates */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&g_wal.checkpoint_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	/* Replay is not logged, but nodes are already synced if evicted from the cache */
+	if ((rc = tsdb_wal_replay()) < 0)
+		goto fail;
+
+	g_wal.size = 0;
+	g_wal.logging = 1;
+	if ((rc = -pthread_create(&g_wal.thread, NULL, tsdb_wal_thread, NULL)) < 0) {
+		ERROR("Unable to start log commit thread\n");
+		g_wal.logging = 0;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	pthread_rwlock_destroy(&g_wal.checkpoint_lock);
+	close(g_wal.fd);
+	g_wal.fd = -1;
+	return rc;
+}
+
+void tsdb_wal_close(void)
+{
+	FUNCTION_TRACE;
+
+	if (g_wal.fd < 0)
+		return;
+
+	pthread_mutex_lock(&g_wal.mutex);
+	g_wal.stop = 1;
+	pthread_cond_signal(&g_wal.work);
+	pthread_mutex_unlock(&g_wal.mutex);
+	pthread_join(g_wal.thread, NULL);
+
+	/* Leave an empty log if everything could be synced */
+	tsdb_wal_do_checkpoint();
+	g_wal.logging = 0;
+
+	pthread_rwlock_destroy(&g_wal.checkpoint_lock);
+	close(g_wal.fd);
+	g_wal.fd = -1;
+}
+
+int tsdb_wal_checkpoint(void)
+{
+	if (!g_wal.logging)
+		return 0;
+	return tsdb_wal_do_checkpoint();
+}
+
+int tsdb_wal_enabled(void)
+{
+	return g_wal.fd >= 0;
+}
+
+void tsdb_wal_begin(void)
+{
+	if (g_wal.logging)
+		pthread_rwlock_rdlock(&g_wal.checkpoint_lock);
+}
+
+int tsdb_wal_append(uint64_t node_id, unsigned int nmetrics, const int64_t *timestamps,
+	const tsdb_data_t *values, unsigned int count, uint64_t *lsn)
+{
+	tsdb_wal_record_t record;
+	struct iovec iov[3];
+	ssize_t rc;
+
+	FUNCTION_TRACE;
+
+	*lsn = 0;
+	if (!g_wal.logging)
+		return 0;
+
+	record.magic = TSDB_MAGIC_WAL;
+	record.node_id = node_id;
+	record.nmetrics = nmetrics;
+	record.count = count;
+	record.value_size = sizeof(tsdb_data_t);
+	record.checksum = 0;
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = (void*)timestamps;
+	iov[1].iov_len = sizeof(int64_t) * count;
+	iov[2].iov_base = (void*)values;
+	iov[2].iov_len = sizeof(tsdb_data_t) * nmetrics * count;
+	if (iov[1].iov_len + iov[2].iov_len > UINT32_MAX - sizeof(record)) {
+		ERROR("Update too large to log\n");
+		return -E2BIG;
+	}
+	record.length = sizeof(record) + iov[1].iov_len + iov[2].iov_len;
+	record.checksum = tsdb_wal_hash(tsdb_wal_hash(tsdb_wal_hash(FNV_OFFSET_BASIS,
+		&record, sizeof(record)), timestamps, iov[1].iov_len), values, iov[2].iov_len);
+
+	pthread_mutex_lock(&g_wal.mutex);
+	rc = writev(g_wal.fd, iov, 3);
+	if (rc != record.length) {
+		rc = (rc < 0) ? -errno : -EIO;
+		ERROR("Log write failed: %s\n", strerror(-rc));
+
+		/* Don't leave a torn record that would end replay early */
+		if (ftruncate(g_wal.fd, g_wal.size) < 0) {
+			ERROR("Unable to truncate log: %s\n", strerror(errno));
+		}
+		pthread_mutex_unlock(&g_wal.mutex);
+		return (int)rc;
+	}
+	g_wal.size += record.length;
+	g_wal.written_lsn += record.length;
+	*lsn = g_wal.written_lsn;
+	if (g_wal.policy == tsdbWal_Commit) {
+		pthread_cond_signal(&g_wal.work);
+	}
+	pthread_mutex_unlock(&g_wal.mutex);
+	return 0;
+}
+
+int tsdb_wal_commit(uint64_t lsn)
+{
+	int rc = 0;
+
+	FUNCTION_TRACE;
+
+	if (!g_wal.logging)
+		return 0;
+	pthread_rwlock_unlock(&g_wal.checkpoint_lock);
+
+	if (lsn && g_wal.policy == tsdbWal_Commit) {
+		pthread_mutex_lock(&g_wal.mutex);
+		while (g_wal.synced_lsn < lsn && g_wal.error == 0) {
+			pthread_cond_wait(&g_wal.done, &g_wal.mutex);
+		}
+		if (g_wal.synced_lsn < lsn)
+			rc = g_wal.error;
+		pthread_mutex_unlock(&g_wal.mutex);
+	}
+	return rc;
+}
+
+int tsdb_wal_delete(uint64_t node_id)
+{
+	tsdb_wal_record_t record;
+	ssize_t count;
+	int rc = 0;
+
+	FUNCTION_TRACE;
+
+	if (!g_wal.logging)
+		return 0;
+
+	memset(&record, 0, sizeof(record));
+	record.magic = TSDB_MAGIC_WAL;
+	record.length = sizeof(record);
+	record.node_id = node_id;
+	record.value_size = sizeof(tsdb_data_t);
+	record.checksum = tsdb_wal_hash(FNV_OFFSET_BASIS, &record, sizeof(record));
+
+	pthread_mutex_lock(&g_wal.mutex);
+	count = write(g_wal.fd, &record, sizeof(record));
+	if (count != sizeof(record)) {
+		rc = (count < 0) ? -errno : -EIO;
+		ERROR("Log write failed: %s\n", strerror(-rc));
+		if (ftruncate(g_wal.fd, g_wal.size) < 0) {
+			ERROR("Unable to truncate log: %s\n", strerror(errno));
+		}
+		pthread_mutex_unlock(&g_wal.mutex);
+		return rc;
+	}
+	g_wal.size += sizeof(record);
+	g_wal.written_lsn += sizeof(record);
+	pthread_mutex_unlock(&g_wal.mutex);
+
+	/* Whatever the policy, the tombstone must be durable before the node's files go, or
+	 * its records could be replayed into a new node of the same ID */
+	if (fdatasync(g_wal.fd) < 0) {
+		rc = -errno;
+		ERROR("Log sync failed: %s\n", strerror(-rc));
+	}
+	return rc;
+}
@@ -0,0 +1,148 @@
+/*
+ * File-based time series database
+ *
+ * Copyright (C) 2012, 2013 Mike Stirling
+ *
+ * This file is part of TimeStore (http://www.livesense.co.uk/timestore)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TSDB_WAL_H
+#define TSDB_WAL_H
+
+#include <stdint.h>
+
+#include "tsdb.h"
+
+#define TSDB_MAGIC_WAL		0x4C415754 // TWAL (little-endian)
+
+/* Default name of the log file in the database directory */
+#define TSDB_WAL_FILE		"timestore.wal"
+/* Default time (ms) between log syncs for the interval policy */
+#define TSDB_WAL_DEFAULT_INTERVAL	1000
+/* The log is checkpointed (all modified nodes synced and the log emptied) once it
+ * grows beyond this size */
+#define TSDB_WAL_CHECKPOINT_SIZE	(64 * 1024 * 1024)
+
+/* When the log is made durable */
+typedef enum {
+	tsdbWal_None = 0,		/*< Never synced explicitly - survives a crash of the process only */
+	tsdbWal_Interval,		/*< Synced periodically by the commit thread */
+	tsdbWal_Commit,			/*< Updates return only once their record has been synced */
+	tsdbWal_Max
+} tsdb_wal_policy_t;
+
+/* Header of each log record.  It is followed by count timestamps (int64_t) and then
+ * count * nmetrics values (tsdb_data_t) in the order passed to tsdb_update_values_batch.
+ * A record with no time points or metrics is the tombstone of a deleted node. */
+typedef struct {
+	uint32_t	magic;				/*< Magic number - indicates a log record */
+	uint32_t	length;				/*< Size of the record including this header */
+	uint64_t	node_id;			/*< Node being updated */
+	uint32_t	nmetrics;			/*< Number of values per time point */
+	uint32_t	count;				/*< Number of time points */
+	uint32_t	value_size;			/*< sizeof(tsdb_data_t) when written */
+	uint32_t	checksum;			/*< FNV-1a of the record with this field zeroed */
+} tsdb_wal_record_t;
+
+#define TSDB_WAL_IS_TOMBSTONE(record)	((record)->magic == TSDB_MAGIC_WAL && \
+	(record)->count == 0 && (record)->nmetrics == 0)
+
+/*!
+ * \brief		Opens the write-ahead log, replaying any records left by an unclean shutdown
+ *
+ * Must be called before any updates are made.  Once open, every update is appended
+ * to the log before it is applied, and a commit thread syncs the log according to
+ * the selected policy.  The log is checkpointed when it grows too large and when it
+ * is closed.
+ *
+ * \param path		Path to the log file (created if it does not exist)
+ * \param policy	When the log is synced \see tsdb_wal_policy_t
+ * \param interval	Time (ms) between syncs for the interval policy, and between
+ *			checks for a checkpoint for all policies
+ * \return		0 or negative error code
+ */
+int tsdb_wal_open(const char *path, tsdb_wal_policy_t policy, unsigned int interval);
+
+/*!
+ * \brief		Stops the commit thread, checkpoints and closes the write-ahead log
+ */
+void tsdb_wal_close(void);
+
+/*!
+ * \brief		Syncs all modified nodes and empties the write-ahead log
+ * \return		0 or negative error code
+ */
+int tsdb_wal_checkpoint(void);
+
+/*!
+ * \brief		Returns non-zero if the write-ahead log is in use
+ */
+int tsdb_wal_enabled(void);
+
+/*!
+ * \brief		Starts an update, holding off checkpoints until tsdb_wal_commit
+ *
+ * For use by the update functions only, before the node is locked for writing.  Every
+ * call must be matched by a call to tsdb_wal_commit.
+ */
+void tsdb_wal_begin(void);
+
+/*!
+ * \brief		Appends an update to the write-ahead log
+ *
+ * For use by the update functions only, between tsdb_wal_begin and tsdb_wal_commit
+ * and with the node locked for writing, so that records are logged in the order
+ * they are applied.  On success the caller must apply the update before unlocking
+ * the node.
+ *
+ * \param node_id	Node being updated
+ * \param nmetrics	Number of values per time point
+ * \param timestamps	Pointer to an array of count timestamps
+ * \param values	Pointer to an array of count * nmetrics values
+ * \param count		Number of time points
+ * \param lsn		Pointer to variable to receive the log sequence number of the
+ *			record (0 if the log is not in use)
+ * \return		0 or negative error code
+ */
+int tsdb_wal_append(uint64_t node_id, unsigned int nmetrics, const int64_t *timestamps,
+	const tsdb_data_t *values, unsigned int count, uint64_t *lsn);
+
+/*!
+ * \brief		Completes an update started by tsdb_wal_begin
+ *
+ * With the every-commit policy this blocks until the record is durable.  Records
+ * appended by concurrent updates are synced together.
+ *
+ * \param lsn		Log sequence number returned by tsdb_wal_append (0 if nothing
+ *			was appended)
+ * \return		0 or negative error code if the log could not be synced
+ */
+int tsdb_wal_commit(uint64_t lsn);
+
+/*!
+ * \brief		Appends a durable tombstone for a node that is being deleted
+ *
+ * None of the node's records before the tombstone are replayed, even into a new node
+ * of the same ID.
+ *
+ * \param node_id	Node being deleted
+ * \return		0 or negative error code
+ */
+int tsdb_wal_delete(uint64_t node_id);
+
+#endif
@@ -103,6 +103,10 @@ class Client(object):
 		(status, nodes) = self.__do_request('GET', '/nodes', key = key)
 		return nodes
 			
+	def get_stats(self, key = None):
+		(status, resp) = self.__do_request('GET', '/stats', key = key)
+		return resp
+
 	def get_node(self, node_id, key = None):
 		(status, resp) = self.__do_request('GET', "/nodes/%x" % (node_id), key = key)
 		return resp
@@ -156,9 +160,37 @@ class Client(object):
 #		ts = datetime.fromtimestamp(resp['timestamp'] / 1000.0)
 #		return (ts, resp['values'])
 		
-	def get_series(self, node_id, metric_id, npoints, start = None, end = None, key = None):
+	def get_series(self, node_id, metric_id, npoints, start = None, end = None, key = None, envelope = False, lttb = False, interpolate = None, once = False):
 		url = "/nodes/%x/series/%x" % (node_id, metric_id)
 		args = { 'npoints' : npoints }
+		if envelope:
+			args['envelope'] = 1
+		if lttb:
+			args['lttb'] = 1
+		if once:
+			args['once'] = 1
+		if interpolate:
+			args['interpolate'] = interpolate
+		
+		# Convert start/end to UNIX timestamp
+		if start:
+			args['start'] = time.mktime(datetime.timetuple(start))
+		if end:
+			args['end'] = time.mktime(datetime.timetuple(end))
+		(status, series) = self.__do_request('GET', url, args = args, key = key)
+		return series
+	
+	def get_multi_series(self, node_id, npoints, metric_ids = None, start = None, end = None, key = None, envelope = False, interpolate = None, once = False):
+		url = "/nodes/%x/series" % (node_id)
+		args = { 'npoints' : npoints }
+		if envelope:
+			args['envelope'] = 1
+		if once:
+			args['once'] = 1
+		if interpolate:
+			args['interpolate'] = interpolate
+		if metric_ids is not None:
+			args['metrics'] = ",".join(str(m) for m in metric_ids)
 		
 		# Convert start/end to UNIX timestamp
 		if start: